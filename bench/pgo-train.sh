@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Profile-guided optimization workload: runs the server under the load
+# generator with a mix of fan-out, message size and room scenarios, then
+# stops it with SIGINT so the profile is written on exit.
+#
+# Usage: pgo-train.sh <server> <loadgen> [port]
+#
+
+set -e
+
+SERVER=$1
+LOADGEN=$2
+PORT=${3:-17200}
+
+if [ ! -x "$SERVER" ] || [ ! -x "$LOADGEN" ]; then
+  echo "Usage: pgo-train.sh <server> <loadgen> [port]" >&2
+  exit 1
+fi
+
+"$SERVER" -t 2 -l warning "$PORT" &
+SERVER_PID=$!
+trap 'kill -INT $SERVER_PID 2>/dev/null || true' EXIT
+sleep 0.5
+
+run() {
+  "$LOADGEN" -w 0.5 -d 3 "$@" 127.0.0.1 "$PORT"
+}
+
+# Many receivers of short lines: the fan-out path.
+run -c 200 -p 4 -r 3000 -s 64
+# Few receivers of large messages: the read and write paths.
+run -c 20 -p 10 -r 2000 -s 8192
+# A numbered room: joins and the room directory.
+run -c 100 -p 2 -r 3000 -s 128 -R 42
+
+kill -INT $SERVER_PID
+wait $SERVER_PID
+trap - EXIT
@@ -0,0 +1,197 @@
+//
+// alloccheck.cpp
+// ~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Steady-state allocation check of the server's sessions, run by ctest.
+// The server is compiled in with its main() renamed and listens on a
+// loopback port; two binary clients on two shards then trade bursts of
+// messages through a room. Once the pools, the handler memory and the
+// room history have warmed up, a message read, fanned out and written
+// back must not reach operator new: the check fails on any allocation
+// of the process while the measured messages pass.
+//
+// Usage: alloccheck [-U <io_uring 0|1>]
+
+
+#define main chat_server_main
+#include "../../server/src/server.cpp"
+#undef main
+
+#include <new>
+#include <boost/array.hpp>
+#include <boost/atomic.hpp>
+#include <boost/config.hpp>
+
+
+namespace
+{
+
+/// Every operator new of the process.
+boost::atomic< std::size_t >  allocations(0);
+
+const std::size_t  burst = 8;
+const std::size_t  warmup_bursts = 2000;
+const std::size_t  measured_bursts = 10000;
+
+typedef boost::array< char, ChatMessage::binary_header_length + 16 >
+    frame_t;
+
+/// The sessions leave Nagle on: a client that delays its acks stalls the
+/// next write to it, and every burst, for 40 ms.
+typedef boost::asio::detail::socket_option::boolean< IPPROTO_TCP,
+    TCP_QUICKACK >  quick_ack;
+
+frame_t make_frame()
+{
+  frame_t  frame;
+  ChatMessage  message;
+  message.body_length(frame.size() - ChatMessage::binary_header_length);
+  std::memset(message.body(), 'x', message.body_length());
+  message.encode_header(ChatMessage::binary_framing);
+  std::memcpy(frame.data(), message.header(ChatMessage::binary_framing),
+      ChatMessage::binary_header_length);
+  std::memcpy(frame.data() + ChatMessage::binary_header_length,
+      message.body(), message.body_length());
+  return frame;
+}
+
+/// Connects a binary client, which joins the room with its first frame.
+void negotiate(tcp::socket& socket, unsigned short port)
+{
+  socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+      port));
+  socket.set_option(tcp::no_delay(true));
+  boost::asio::write(socket, boost::asio::buffer(
+      ChatMessage::protocol_preface(), ChatMessage::preface_length));
+  char  reply[ChatMessage::preface_length];
+  boost::asio::read(socket, boost::asio::buffer(reply));
+}
+
+/// Reads what the client was sent, acking each part of it at once.
+template< typename MutableBuffer >
+void receive(tcp::socket& socket, const MutableBuffer& buffer)
+{
+  boost::asio::read(socket, buffer);
+  socket.set_option(quick_ack(true));
+}
+
+/// Sends a burst from one client and reads it back on both.
+void exchange(tcp::socket& sender, tcp::socket& receiver,
+    const std::vector< char >& frames, std::vector< char >& scratch)
+{
+  boost::asio::write(sender, boost::asio::buffer(frames));
+  receive(sender, boost::asio::buffer(scratch));
+  receive(receiver, boost::asio::buffer(scratch));
+}
+
+} // namespace
+
+// Kept out of line: inlined into new-expressions, they make GCC take the
+// malloc/free pairs for mismatched.
+BOOST_NOINLINE void* operator new(std::size_t size)
+{
+  allocations.fetch_add(1, boost::memory_order_relaxed);
+  if (void* pointer = std::malloc(size ? size : 1))
+  {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+BOOST_NOINLINE void operator delete(void* pointer) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete(void* pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    ChatLog::instance().level(log_warning);
+
+    ChatOptions  options;
+    options.thread_count = 2;
+    options.acceptor_count = 1;
+#if defined(CHAT_URING)
+    using namespace std; // For atoi.
+    options.uring.enabled = (argc == 3) && (std::string(argv[1]) == "-U")
+        && (atoi(argv[2]) != 0);
+#endif
+
+    ChatShards  shards(options.thread_count);
+#if defined(CHAT_URING)
+    for (std::size_t i = 0; options.uring.enabled && (i < shards.size()); ++i)
+    {
+      ChatUring*  ring = new ChatUring(shards[i], options.uring);
+      boost::asio::add_service(shards[i], ring);
+      if (!ring->valid())
+      {
+        std::cout << "io_uring unavailable: " << ring->failure()
+            << ", skipped\n";
+        return 0;
+      }
+    }
+#endif
+    ChatSession::reserve(options.preallocated_sessions);
+    ChatServer  server(shards,
+        tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0), options);
+    boost::thread  workers(boost::bind(&ChatShards::run, &shards));
+
+    const frame_t  frame = make_frame();
+    std::vector< char >  one(frame.size());
+
+    // Sessions are dealt out to the shards in turn: one client each. The
+    // second one joins after the first and is replayed its frame.
+    boost::asio::io_service  io_service;
+    tcp::socket  first(io_service);
+    tcp::socket  second(io_service);
+    negotiate(first, server.port());
+    boost::asio::write(first, boost::asio::buffer(frame));
+    boost::asio::read(first, boost::asio::buffer(one));
+    negotiate(second, server.port());
+    boost::asio::write(second, boost::asio::buffer(frame));
+    boost::asio::read(second, boost::asio::buffer(one));
+    boost::asio::read(second, boost::asio::buffer(one));
+    boost::asio::read(first, boost::asio::buffer(one));
+
+    std::vector< char >  frames;
+    for (std::size_t i = 0; i < burst; ++i)
+    {
+      frames.insert(frames.end(), frame.begin(), frame.end());
+    }
+    std::vector< char >  scratch(frames.size());
+
+    for (std::size_t i = 0; i < warmup_bursts; ++i)
+    {
+      exchange((i % 2) ? first : second, (i % 2) ? second : first,
+          frames, scratch);
+    }
+    const std::size_t  before = allocations.load();
+    for (std::size_t i = 0; i < measured_bursts; ++i)
+    {
+      exchange((i % 2) ? first : second, (i % 2) ? second : first,
+          frames, scratch);
+    }
+    const std::size_t  count = allocations.load() - before;
+
+    shards.stop();
+    workers.join();
+
+    std::cout << count << " allocations in " << measured_bursts * burst
+        << " messages\n";
+    return (count == 0) ? 0 : 1;
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+  }
+  return 1;
+}
@@ -0,0 +1,306 @@
+//
+// historycheck.cpp
+// ~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Recovery check of the room history logs, run by ctest. Each case writes
+// a log into a fresh directory, damages its files the way a crash or an
+// operator might, and opens it again: a torn last record must be dropped,
+// an index lost or stale rebuilt from the records, the segments trimmed
+// beyond max_segments gone with <path>.head keeping the numbering, and a
+// truncated segment refused.
+//
+// Usage: historycheck
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include "history_log.h"
+
+
+namespace
+{
+
+std::string  directory;
+int  failures = 0;
+
+void check(bool condition, const char* test, const char* what)
+{
+  if (!condition)
+  {
+    std::cout << test << ": " << what << " failed\n";
+    ++failures;
+  }
+}
+
+void set_flag(boost::atomic< bool >* flag)
+{
+  flag->store(true);
+}
+
+/// Returns once what was posted to ChatHistorySyncer so far has run.
+void wait_for_syncer()
+{
+  boost::atomic< bool >  done(false);
+  ChatHistorySyncer::instance().post(boost::bind(&set_flag, &done));
+  while (!done.load())
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+  }
+}
+
+/// Message 'seq' of a test log: its number, then filler up to 'length'.
+void make(ChatMessage& msg, std::size_t seq, std::size_t length)
+{
+  msg.body_length(length);
+  std::memset(msg.body(), 'a' + seq % 26, length);
+  char  number[16];
+  std::snprintf(number, sizeof(number), "%08lu",
+      static_cast< unsigned long >(seq));
+  std::memcpy(msg.body(), number, std::min< std::size_t >(8, length));
+  msg.encode_headers();
+}
+
+/// Appends, making the next segment in line as the room has it made.
+void append(ChatHistoryLog& log, std::size_t seq, std::size_t length)
+{
+  ChatMessage  msg;
+  make(msg, seq, length);
+  if (!log.append(msg))
+  {
+    log.add_spare(ChatHistoryLog::create_segment(log.path(),
+          log.next_segment()));
+    if (!log.append(msg))
+    {
+      throw std::runtime_error("append failed with a spare segment");
+    }
+  }
+}
+
+/// The log holds message 'seq' as append() wrote it.
+bool holds(const ChatHistoryLog& log, std::size_t seq, std::size_t length)
+{
+  ChatMessage  expected;
+  make(expected, seq, length);
+  ChatMessage  msg;
+  return log.read(seq, msg) && (msg.body_length() == length)
+      && (std::memcmp(msg.body(), expected.body(), length) == 0);
+}
+
+std::string file(const std::string& name)
+{
+  return directory + "/" + name;
+}
+
+bool file_exists(const std::string& path)
+{
+  return std::ifstream(path.c_str()).good();
+}
+
+/// Overwrites 'size' bytes at 'offset' of an existing file.
+void patch(const std::string& path, std::size_t offset, const void* data,
+    std::size_t size)
+{
+  std::fstream  f(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+  f.seekp(offset);
+  f.write(static_cast< const char* >(data), size);
+  if (!f)
+  {
+    throw std::runtime_error("cannot patch " + path);
+  }
+}
+
+const std::size_t  record_length =
+    ChatHistoryLog::record_header_length + ChatMessage::binary_header_length;
+
+/// A crash in the middle of the last record: it is dropped and its
+/// sequence number given to the next message.
+void torn_tail()
+{
+  const char*  test = "torn-tail";
+  const std::string  path = file("torn");
+  {
+    ChatHistoryLog  log(path);
+    for (std::size_t seq = 0; seq < 3; ++seq)
+    {
+      append(log, seq, 100);
+    }
+  }
+  wait_for_syncer();
+  const char  garbage = '#';
+  patch(path + "-0.log", 2 * (record_length + 100) + record_length + 50,
+      &garbage, 1);
+
+  {
+    ChatHistoryLog  log(path);
+    check(log.end() == 2, test, "end after the torn record");
+    check(holds(log, 1, 100), test, "read of the last good record");
+    check(!holds(log, 2, 100), test, "read of the torn record");
+    append(log, 2, 40);
+  }
+  wait_for_syncer();
+
+  ChatHistoryLog  log(path);
+  check(log.end() == 3, test, "end after appending again");
+  check(holds(log, 2, 40), test, "read of the record appended again");
+}
+
+/// An index lost, or pointing past the records: rebuilt from the log.
+void index_rebuild()
+{
+  const char*  test = "index-rebuild";
+  const std::string  path = file("index");
+  {
+    ChatHistoryLog  log(path);
+    for (std::size_t seq = 0; seq < 3; ++seq)
+    {
+      append(log, seq, 10 + seq);
+    }
+  }
+  wait_for_syncer();
+
+  const boost::uint32_t  zeros[3] = { 0, 0, 0 };
+  patch(path + "-0.idx", 0, zeros, sizeof(zeros));
+  {
+    ChatHistoryLog  log(path);
+    check(log.end() == 3, test, "end with the index lost");
+    for (std::size_t seq = 0; seq < 3; ++seq)
+    {
+      check(holds(log, seq, 10 + seq), test, "read with the index lost");
+    }
+  }
+  wait_for_syncer();
+
+  const boost::uint32_t  stale = 4096;
+  patch(path + "-0.idx", 3 * sizeof(boost::uint32_t), &stale, sizeof(stale));
+  ChatHistoryLog  log(path);
+  check(log.end() == 3, test, "end with a stale index entry");
+  check(holds(log, 2, 12), test, "read with a stale index entry");
+}
+
+/// Segments beyond max_segments go, and the log opened again numbers its
+/// messages on from where the kept ones are.
+void trim_and_head()
+{
+  const char*  test = "trim-and-head";
+  const std::string  path = file("trim");
+  const std::size_t  length = ChatMessage::max_binary_body_length;
+  const std::size_t  per_segment =
+      ChatHistoryLog::segment_size / (record_length + length);
+  const std::size_t  count = 2 * per_segment + 10;
+  {
+    ChatHistoryLog  log(path, 2);
+    for (std::size_t seq = 0; seq < count; ++seq)
+    {
+      append(log, seq, length);
+    }
+    check(log.begin() == per_segment, test, "begin after the trim");
+  }
+  wait_for_syncer();
+
+  check(!file_exists(path + "-0.log") && !file_exists(path + "-0.idx"), test,
+      "removal of the oldest segment");
+  std::ifstream  head((path + ".head").c_str());
+  unsigned long  first_segment = 0;
+  unsigned long long  first = 0;
+  check((head >> first_segment >> first) && (first_segment == 1)
+      && (first == per_segment), test, "head");
+
+  {
+    ChatHistoryLog  log(path, 2);
+    check(log.begin() == per_segment, test, "begin when opened again");
+    check(log.end() == count, test, "end when opened again");
+    check(holds(log, per_segment, length), test, "read of the first kept");
+    check(!holds(log, per_segment - 1, length), test, "read of a trimmed one");
+    append(log, count, 10);
+    check(holds(log, count, 10), test, "read of the next one appended");
+  }
+  wait_for_syncer();
+}
+
+/// A segment file cut short is refused rather than mapped beyond its end.
+void truncated_segment()
+{
+  const char*  test = "truncated-segment";
+  const std::string  path = file("short");
+  {
+    ChatHistoryLog  log(path);
+    append(log, 0, 10);
+  }
+  wait_for_syncer();
+  if (::truncate((path + "-0.log").c_str(), 4096) != 0)
+  {
+    throw std::runtime_error("cannot truncate " + path + "-0.log");
+  }
+
+  bool  refused = false;
+  try
+  {
+    ChatHistoryLog  log(path);
+  }
+  catch (const std::runtime_error& e)
+  {
+    refused = std::strstr(e.what(), "truncated segment") != 0;
+  }
+  check(refused, test, "refusal");
+}
+
+void remove_files()
+{
+  static const char* const  logs[] = { "torn", "index", "trim", "short" };
+  for (std::size_t i = 0; i < sizeof(logs) / sizeof(logs[0]); ++i)
+  {
+    const std::string  path = file(logs[i]);
+    std::remove((path + ".head").c_str());
+    for (std::size_t k = 0; k < 4; ++k)
+    {
+      char  suffix[16];
+      std::snprintf(suffix, sizeof(suffix), "-%lu",
+          static_cast< unsigned long >(k));
+      std::remove((path + suffix + ".log").c_str());
+      std::remove((path + suffix + ".idx").c_str());
+    }
+  }
+  ::rmdir(directory.c_str());
+}
+
+} // namespace
+
+int main()
+{
+  char  temp[] = "/tmp/historycheck.XXXXXX";
+  if (!::mkdtemp(temp))
+  {
+    std::cerr << "Cannot create a directory\n";
+    return 1;
+  }
+  directory = temp;
+
+  try
+  {
+    torn_tail();
+    index_rebuild();
+    trim_and_head();
+    truncated_segment();
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+    ++failures;
+  }
+  remove_files();
+
+  std::cout << (failures ? "FAILED\n" : "passed\n");
+  return failures ? 1 : 0;
+}
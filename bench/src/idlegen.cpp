@@ -0,0 +1,341 @@
+//
+// idlegen.cpp
+// ~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Scaling benchmark for idle sessions: opens connections to the chat
+// server in steps and holds them without sending anything, and after
+// every step reads the server's resident memory from its metrics
+// endpoint (server -M). Prints one JSON object per step.
+
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+#include "../../server/include/message.h"
+
+
+using boost::asio::ip::tcp;
+
+
+struct IdleOptions
+{
+  IdleOptions()
+    : connections(10000),
+      step(0),
+      metrics_port(0),
+      source_addresses(1),
+      framing(ChatMessage::binary_framing),
+      settle(1.0)
+  {
+  }
+
+  std::string  host;
+  std::string  port;
+  std::size_t  connections;
+  /// Connections opened between two measurements.
+  std::size_t  step;
+  unsigned short  metrics_port;
+  /// Loopback source addresses 127.0.0.1... to spread the connections
+  /// over, for more than one address's worth of ephemeral ports.
+  std::size_t  source_addresses;
+  ChatMessage::Framing  framing;
+  /// Seconds to wait after a step before measuring.
+  double  settle;
+};
+
+//----------------------------------------------------------------------
+
+/**
+* A connection which negotiates its framing and then only reads, so
+* whatever the server sends (a room's backlog) does not pile up.
+*/
+class IdleConnection
+{
+public:
+  IdleConnection(boost::asio::io_service& io_service,
+      const IdleOptions& options, std::size_t& connected,
+      std::size_t& errors)
+    : socket_(io_service),
+      options_(options),
+      connected_(connected),
+      errors_(errors)
+  {
+  }
+
+  void start(const tcp::endpoint& endpoint, std::size_t index)
+  {
+    if (options_.source_addresses > 1)
+    {
+      boost::system::error_code  error;
+      socket_.open(tcp::v4(), error);
+      socket_.bind(tcp::endpoint(boost::asio::ip::address_v4(
+          0x7f000001 + boost::uint32_t(index % options_.source_addresses)), 0),
+          error);
+      if (error)
+      {
+        ++errors_;
+        return;
+      }
+    }
+    socket_.async_connect(endpoint,
+        boost::bind(&IdleConnection::handle_connect, this,
+          boost::asio::placeholders::error));
+  }
+
+private:
+  void handle_connect(const boost::system::error_code& error)
+  {
+    if (error)
+    {
+      ++errors_;
+      return;
+    }
+    ++connected_;
+    if (options_.framing == ChatMessage::binary_framing)
+    {
+      boost::asio::async_write(socket_,
+          boost::asio::buffer(ChatMessage::protocol_preface(),
+            ChatMessage::preface_length),
+          boost::bind(&IdleConnection::handle_write, this,
+            boost::asio::placeholders::error));
+    }
+    start_read();
+  }
+
+  void handle_write(const boost::system::error_code& error)
+  {
+    if (error)
+    {
+      ++errors_;
+    }
+  }
+
+  void start_read()
+  {
+    socket_.async_read_some(boost::asio::buffer(read_buffer_),
+        boost::bind(&IdleConnection::handle_read, this,
+          boost::asio::placeholders::error));
+  }
+
+  void handle_read(const boost::system::error_code& error)
+  {
+    if (error)
+    {
+      ++errors_;
+      --connected_;
+      return;
+    }
+    start_read();
+  }
+
+private:
+  tcp::socket  socket_;
+  const IdleOptions&  options_;
+  std::size_t&  connected_;
+  std::size_t&  errors_;
+  char  read_buffer_[256];
+};
+
+typedef boost::shared_ptr< IdleConnection >  idleConnectionPTR;
+
+//----------------------------------------------------------------------
+
+/**
+* What the server reports about itself: its resident memory and its
+* live sessions (accepted minus closed, over all threads).
+*/
+struct ServerSample
+{
+  ServerSample()
+    : resident_bytes(0),
+      sessions(0)
+  {
+  }
+
+  double  resident_bytes;
+  double  sessions;
+};
+
+/// Scrapes the metrics endpoint; throws if it cannot be reached.
+ServerSample scrape(const std::string& host, unsigned short port)
+{
+  boost::asio::io_service  io_service;
+  tcp::socket  socket(io_service);
+  socket.connect(tcp::endpoint(
+      boost::asio::ip::address::from_string(host), port));
+  const std::string  request = "GET /metrics HTTP/1.0\r\n\r\n";
+  boost::asio::write(socket, boost::asio::buffer(request));
+
+  std::string  response;
+  char  buffer[4096];
+  boost::system::error_code  error;
+  for (std::size_t n; (n = socket.read_some(
+         boost::asio::buffer(buffer), error)) > 0 || !error; )
+  {
+    response.append(buffer, n);
+  }
+
+  ServerSample  sample;
+  std::istringstream  lines(response);
+  std::string  line;
+  while (std::getline(lines, line))
+  {
+    const std::size_t  space = line.rfind(' ');
+    if ((space == std::string::npos) || (line[0] == '#'))
+    {
+      continue;
+    }
+    const double  value = std::atof(line.c_str() + space + 1);
+    if (line.compare(0, 30, "process_resident_memory_bytes ") == 0)
+    {
+      sample.resident_bytes = value;
+    }
+    else if (line.compare(0, 32, "chat_connections_accepted_total{") == 0)
+    {
+      sample.sessions += value;
+    }
+    else if (line.compare(0, 30, "chat_connections_closed_total{") == 0)
+    {
+      sample.sessions -= value;
+    }
+  }
+  return sample;
+}
+
+inline void sleep_seconds(double seconds)
+{
+  boost::this_thread::sleep(boost::posix_time::microseconds(
+      boost::int64_t(seconds * 1e6)));
+}
+
+//----------------------------------------------------------------------
+
+
+
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    IdleOptions  options;
+    int  arg = 1;
+    for ( ; (arg + 1 < argc) && (argv[arg][0] == '-'); arg += 2)
+    {
+      using namespace std; // For atof and strtoul.
+      const std::string  name = argv[arg];
+      const char*  value = argv[arg + 1];
+      if (name == "-c")
+        options.connections = strtoul(value, 0, 10);
+      else if (name == "-s")
+        options.step = strtoul(value, 0, 10);
+      else if (name == "-M")
+        options.metrics_port = (unsigned short)strtoul(value, 0, 10);
+      else if (name == "-a")
+        options.source_addresses = strtoul(value, 0, 10);
+      else if (name == "-f")
+        options.framing = (std::string(value) == "legacy")
+            ? ChatMessage::legacy_framing : ChatMessage::binary_framing;
+      else if (name == "-w")
+        options.settle = atof(value);
+      else
+        arg = argc;
+    }
+
+    if ((argc != arg + 2) || (options.connections == 0)
+        || (options.metrics_port == 0))
+    {
+      std::cerr << "Usage: idlegen -M <server metrics port>"
+          " [-c <connections>] [-s <step>] [-a <source addresses>]"
+          " [-f binary|legacy] [-w <settle s>] <host> <port>\n";
+      return 1;
+    }
+    options.host = argv[arg];
+    options.port = argv[arg + 1];
+    if (options.step == 0)
+    {
+      options.step = std::max< std::size_t >(options.connections / 10, 1);
+    }
+
+#if !defined(_WIN32)
+    // Every connection is a descriptor.
+    struct rlimit  limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+
+    boost::asio::io_service  io_service;
+    tcp::resolver  resolver(io_service);
+    const tcp::endpoint  endpoint = *resolver.resolve(
+        tcp::resolver::query(options.host, options.port));
+    const std::string  metrics_host = endpoint.address().to_string();
+
+    const ServerSample  baseline = scrape(metrics_host, options.metrics_port);
+
+    std::size_t  connected = 0;
+    std::size_t  errors = 0;
+    boost::asio::io_service::work  work(io_service);
+    boost::thread  thread(boost::bind(&boost::asio::io_service::run,
+        &io_service));
+
+    std::vector< idleConnectionPTR >  connections;
+    while (connections.size() < options.connections)
+    {
+      const std::size_t  target =
+          std::min(connections.size() + options.step, options.connections);
+      while (connections.size() < target)
+      {
+        const idleConnectionPTR  connection(new IdleConnection(
+            io_service, options, connected, errors));
+        io_service.post(boost::bind(&IdleConnection::start, connection.get(),
+            endpoint, connections.size()));
+        connections.push_back(connection);
+      }
+
+      // Negotiation takes up to 250 ms for legacy clients.
+      sleep_seconds(options.settle);
+      const ServerSample  sample = scrape(metrics_host, options.metrics_port);
+      const double  sessions = sample.sessions - baseline.sessions;
+      std::printf("{\"connections\":%lu,\"connected\":%lu,\"errors\":%lu,"
+          "\"server_sessions\":%.0f,\"resident_bytes\":%.0f,"
+          "\"bytes_per_session\":%.0f}\n",
+          static_cast< unsigned long >(connections.size()),
+          static_cast< unsigned long >(connected),
+          static_cast< unsigned long >(errors),
+          sessions, sample.resident_bytes,
+          (sessions > 0)
+            ? (sample.resident_bytes - baseline.resident_bytes) / sessions
+            : 0.0);
+      std::fflush(stdout);
+    }
+
+    io_service.stop();
+    thread.join();
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,820 @@
+//
+// loadgen.cpp
+// ~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Headless load generator for the chat server: opens many binary-framing
+// connections, publishes at a fixed rate from some of them and measures
+// the fan-out latency seen by every receiver. Prints one JSON object.
+// Built with CHAT_TLS, -T 1 connects over TLS. Built with CHAT_DEFLATE,
+// -Z 1 asks for deflated messages and inflates them.
+
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#if defined(CHAT_TLS)
+#include <boost/asio/ssl.hpp>
+#include <boost/scoped_ptr.hpp>
+#endif
+#if defined(CHAT_DEFLATE)
+#include <zlib.h>
+#endif
+#include "../../server/include/histogram.h"
+#include "../../server/include/message.h"
+
+
+using boost::asio::ip::tcp;
+
+
+typedef std::chrono::steady_clock  steadyClock_t;
+
+inline boost::uint64_t now_ns()
+{
+  return std::chrono::duration_cast< std::chrono::nanoseconds >(
+      steadyClock_t::now().time_since_epoch()).count();
+}
+
+inline void put_uint32(char* p, boost::uint32_t value)
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    p[i] = char(value >> (8 * i));
+  }
+}
+
+inline void put_uint64(char* p, boost::uint64_t value)
+{
+  for (int i = 0; i < 8; ++i)
+  {
+    p[i] = char(value >> (8 * i));
+  }
+}
+
+inline boost::uint32_t get_uint32(const char* p)
+{
+  const unsigned char* u = reinterpret_cast< const unsigned char* >(p);
+  return boost::uint32_t(u[0]) | (boost::uint32_t(u[1]) << 8)
+      | (boost::uint32_t(u[2]) << 16) | (boost::uint32_t(u[3]) << 24);
+}
+
+inline boost::uint64_t get_uint64(const char* p)
+{
+  return boost::uint64_t(get_uint32(p))
+      | (boost::uint64_t(get_uint32(p + 4)) << 32);
+}
+
+//----------------------------------------------------------------------
+
+struct LoadOptions
+{
+  LoadOptions()
+    : connections(100),
+      publishers(1),
+      rate(1000),
+      message_size(64),
+      duration(10),
+      warmup(2),
+      threads(boost::thread::hardware_concurrency()),
+      room(ChatMessage::default_room),
+      compressed(false)
+#if defined(CHAT_TLS)
+      , tls_context(0)
+#endif
+  {
+  }
+
+  std::string  host;
+  std::string  port;
+  std::size_t  connections;
+  std::size_t  publishers;
+  /// Messages per second over all publishers.
+  double  rate;
+  std::size_t  message_size;
+  /// Measured seconds; the warm-up precedes them.
+  double  duration;
+  double  warmup;
+  std::size_t  threads;
+  boost::uint32_t  room;
+  /// Asks for deflated messages.
+  bool  compressed;
+#if defined(CHAT_TLS)
+  /// Null for plaintext.
+  boost::asio::ssl::context*  tls_context;
+#endif
+};
+
+/**
+* Counters of one I/O thread; merged when the run is over.
+*/
+struct LoadStats
+{
+  LoadStats()
+    : sent(0),
+      received(0),
+      bytes_sent(0),
+      bytes_received(0),
+      errors(0)
+  {
+  }
+
+  void merge(const LoadStats& other)
+  {
+    latency.merge(other.latency);
+    sent += other.sent;
+    received += other.received;
+    bytes_sent += other.bytes_sent;
+    bytes_received += other.bytes_received;
+    errors += other.errors;
+  }
+
+  ChatHistogram  latency;
+  boost::uint64_t  sent;
+  boost::uint64_t  received;
+  boost::uint64_t  bytes_sent;
+  boost::uint64_t  bytes_received;
+  boost::uint64_t  errors;
+};
+
+/**
+* Time window whose messages are measured, by their send time.
+* Every body starts with the run ID and the send time, so messages of
+* earlier runs replayed from the room's history are ignored.
+*/
+struct LoadWindow
+{
+  enum { min_body_length = 16 };
+
+  boost::uint64_t  run_id;
+  boost::atomic< boost::uint64_t >  begin;
+  boost::atomic< boost::uint64_t >  end;
+
+  bool contains(boost::uint64_t sent_at) const
+  {
+    return (sent_at >= begin.load(boost::memory_order_relaxed))
+        && (sent_at < end.load(boost::memory_order_relaxed));
+  }
+};
+
+//----------------------------------------------------------------------
+
+/**
+* One connection. All of its handlers run on the single thread of its
+* io_service, together with its LoadStats.
+*/
+class LoadConnection
+{
+public:
+  LoadConnection(boost::asio::io_service& io_service,
+      const tcp::endpoint& endpoint,
+      const LoadOptions& options,
+      const LoadWindow& window,
+      LoadStats& stats,
+      boost::atomic< std::size_t >& connected,
+      bool publisher)
+    : socket_(io_service),
+      timer_(io_service),
+      endpoint_(endpoint),
+      options_(options),
+      window_(window),
+      stats_(stats),
+      connected_(connected),
+      publisher_(publisher),
+      publishing_(false),
+      negotiated_(false),
+      read_buffer_(read_buffer_size),
+      read_size_(0),
+      write_in_progress_(false)
+  {
+    // Chat-like text rather than one repeated byte, so that compression
+    // has something to do.
+    static const char  text[] =
+        "so who is up for lunch? the usual place at noon, I will book "
+        "a table for six. did anybody see the build break this morning? ";
+    body_.resize(std::max< std::size_t >(options.message_size,
+        LoadWindow::min_body_length));
+    for (std::size_t i = 0; i < body_.size(); ++i)
+    {
+      body_[i] = text[i % (sizeof(text) - 1)];
+    }
+    put_uint64(&body_[0], window.run_id);
+#if defined(CHAT_DEFLATE)
+    std::memset(&inflater_, 0, sizeof(inflater_));
+    inflater_valid_ = options.compressed
+        && (inflateInit2(&inflater_, -15) == Z_OK);
+#endif
+  }
+
+#if defined(CHAT_DEFLATE)
+  ~LoadConnection()
+  {
+    if (inflater_valid_)
+    {
+      inflateEnd(&inflater_);
+    }
+  }
+#endif
+
+  void start()
+  {
+    socket_.async_connect(endpoint_,
+        boost::bind(&LoadConnection::handle_connect, this,
+          boost::asio::placeholders::error));
+  }
+
+  void start_publishing()
+  {
+    if (!publisher_ || !socket_.is_open())
+    {
+      return;
+    }
+    publishing_ = true;
+    interval_ = std::chrono::nanoseconds(boost::int64_t(
+        1e9 * double(options_.publishers) / options_.rate));
+    next_send_ = steadyClock_t::now();
+    schedule_publish();
+  }
+
+  void stop_publishing()
+  {
+    publishing_ = false;
+    boost::system::error_code  ignored;
+    timer_.cancel(ignored);
+  }
+
+  void close()
+  {
+    stop_publishing();
+    boost::system::error_code  ignored;
+    socket_.close(ignored);
+  }
+
+private:
+  void handle_connect(const boost::system::error_code& error)
+  {
+    if (error)
+    {
+      ++stats_.errors;
+      return;
+    }
+
+    boost::system::error_code  ignored;
+    socket_.set_option(tcp::no_delay(true), ignored);
+#if defined(CHAT_TLS)
+    if (options_.tls_context)
+    {
+      tls_.reset(new tlsStream_t(socket_, *options_.tls_context));
+      tls_->async_handshake(boost::asio::ssl::stream_base::client,
+          boost::bind(&LoadConnection::handle_handshake, this,
+            boost::asio::placeholders::error));
+      return;
+    }
+#endif
+    start_session();
+  }
+
+#if defined(CHAT_TLS)
+  void handle_handshake(const boost::system::error_code& error)
+  {
+    if (error)
+    {
+      ++stats_.errors;
+      return;
+    }
+    start_session();
+  }
+#endif
+
+  void start_session()
+  {
+    ++connected_;
+
+    // The preface and the join go out together; the server reads both
+    // from one buffer.
+    append(ChatMessage::protocol_preface(), ChatMessage::preface_length);
+    if (options_.compressed)
+    {
+      const char  capabilities = ChatMessage::hello_deflate;
+      append_frame(ChatMessage::type_hello, &capabilities, 1);
+    }
+    if (options_.room != ChatMessage::default_room)
+    {
+      append_frame(ChatMessage::type_join, 0, 0);
+    }
+    flush();
+    start_read();
+  }
+
+  void schedule_publish()
+  {
+    timer_.expires_at(next_send_);
+    timer_.async_wait(boost::bind(&LoadConnection::handle_publish, this,
+        boost::asio::placeholders::error));
+  }
+
+  void handle_publish(const boost::system::error_code& error)
+  {
+    if (error || !publishing_)
+    {
+      return;
+    }
+
+    // Catch up on every send which fell due, bounded so a stalled
+    // connection does not build an unbounded burst.
+    const steadyClock_t::time_point  now = steadyClock_t::now();
+    for (int burst = 0; (next_send_ <= now) && (burst < max_burst); ++burst)
+    {
+      const boost::uint64_t  sent_at = now_ns();
+      put_uint64(&body_[8], sent_at);
+      append_frame(ChatMessage::type_publish, &body_[0], body_.size());
+      if (window_.contains(sent_at))
+      {
+        ++stats_.sent;
+        stats_.bytes_sent += ChatMessage::binary_header_length + body_.size();
+      }
+      next_send_ += interval_;
+    }
+    if (next_send_ < now)
+    {
+      next_send_ = steadyClock_t::now();
+    }
+    flush();
+    schedule_publish();
+  }
+
+  void append(const char* data, std::size_t length)
+  {
+    pending_.insert(pending_.end(), data, data + length);
+  }
+
+  void append_frame(ChatMessage::Type type, const char* body,
+      std::size_t length)
+  {
+    char  header[ChatMessage::binary_header_length] = { 0 };
+    put_uint32(header, boost::uint32_t(length));
+    header[4] = char(type);
+    put_uint32(header + 8, options_.room);
+    append(header, sizeof(header));
+    if (length > 0)
+    {
+      append(body, length);
+    }
+  }
+
+  void flush()
+  {
+    if (write_in_progress_ || pending_.empty())
+    {
+      return;
+    }
+    writing_.swap(pending_);
+    pending_.clear();
+    write_in_progress_ = true;
+#if defined(CHAT_TLS)
+    if (tls_)
+    {
+      start_write(*tls_);
+      return;
+    }
+#endif
+    start_write(socket_);
+  }
+
+  template< typename Stream >
+  void start_write(Stream& stream)
+  {
+    boost::asio::async_write(stream,
+        boost::asio::buffer(writing_),
+        boost::bind(&LoadConnection::handle_write, this,
+          boost::asio::placeholders::error));
+  }
+
+  void handle_write(const boost::system::error_code& error)
+  {
+    write_in_progress_ = false;
+    if (error)
+    {
+      ++stats_.errors;
+      close();
+      return;
+    }
+    flush();
+  }
+
+  void start_read()
+  {
+#if defined(CHAT_TLS)
+    if (tls_)
+    {
+      start_read(*tls_);
+      return;
+    }
+#endif
+    start_read(socket_);
+  }
+
+  template< typename Stream >
+  void start_read(Stream& stream)
+  {
+    stream.async_read_some(
+        boost::asio::buffer(&read_buffer_[read_size_],
+          read_buffer_.size() - read_size_),
+        boost::bind(&LoadConnection::handle_read, this,
+          boost::asio::placeholders::error,
+          boost::asio::placeholders::bytes_transferred));
+  }
+
+  void handle_read(const boost::system::error_code& error,
+      std::size_t bytes_transferred)
+  {
+    if (error)
+    {
+      if (error != boost::asio::error::operation_aborted)
+      {
+        ++stats_.errors;
+      }
+      return;
+    }
+
+    read_size_ += bytes_transferred;
+    const boost::uint64_t  received_at = now_ns();
+    std::size_t  offset = 0;
+    if (!negotiated_)
+    {
+      if (read_size_ < std::size_t(ChatMessage::preface_length))
+      {
+        start_read();
+        return;
+      }
+      if (!ChatMessage::is_protocol_preface(&read_buffer_[0]))
+      {
+        std::cerr << "The server does not speak the binary framing.\n";
+        ++stats_.errors;
+        close();
+        return;
+      }
+      negotiated_ = true;
+      offset = ChatMessage::preface_length;
+    }
+
+    for ( ; ; )
+    {
+      const std::size_t  available = read_size_ - offset;
+      if (available < std::size_t(ChatMessage::binary_header_length))
+      {
+        break;
+      }
+      const char*  frame = &read_buffer_[offset];
+      const std::size_t  length = get_uint32(frame);
+      const std::size_t  frame_length =
+          ChatMessage::binary_header_length + length;
+      if (frame_length > read_buffer_.size())
+      {
+        std::cerr << "Frame of " << length << " bytes does not fit.\n";
+        ++stats_.errors;
+        close();
+        return;
+      }
+      if (available < frame_length)
+      {
+        break;
+      }
+
+      const char*  body = frame + ChatMessage::binary_header_length;
+      std::size_t  body_length = length;
+      offset += frame_length;
+      if (frame[4] == char(ChatMessage::type_dictionary))
+      {
+        dictionary_.assign(body, length);
+        continue;
+      }
+      if ((frame[5] & ChatMessage::flag_deflate)
+          && !inflate(body, body_length))
+      {
+        ++stats_.errors;
+        continue;
+      }
+      if ((body_length >= std::size_t(LoadWindow::min_body_length))
+          && (get_uint64(body) == window_.run_id))
+      {
+        const boost::uint64_t  sent_at = get_uint64(body + 8);
+        if (window_.contains(sent_at))
+        {
+          stats_.latency.record(received_at - sent_at);
+          ++stats_.received;
+          stats_.bytes_received += frame_length;
+        }
+      }
+    }
+
+    std::memmove(&read_buffer_[0], &read_buffer_[offset], read_size_ - offset);
+    read_size_ -= offset;
+    start_read();
+  }
+
+  /// Replaces a deflated body with its inflated copy.
+  bool inflate(const char*& body, std::size_t& length)
+  {
+#if defined(CHAT_DEFLATE)
+    if (!inflater_valid_ || (inflateReset(&inflater_) != Z_OK))
+    {
+      return false;
+    }
+    if (!dictionary_.empty() && (inflateSetDictionary(&inflater_,
+          reinterpret_cast< const Bytef* >(dictionary_.data()),
+          uInt(dictionary_.size())) != Z_OK))
+    {
+      return false;
+    }
+    inflated_.resize(ChatMessage::max_binary_body_length);
+    inflater_.next_in = reinterpret_cast< Bytef* >(const_cast< char* >(body));
+    inflater_.avail_in = uInt(length);
+    inflater_.next_out = reinterpret_cast< Bytef* >(&inflated_[0]);
+    inflater_.avail_out = uInt(inflated_.size());
+    if (::inflate(&inflater_, Z_FINISH) != Z_STREAM_END)
+    {
+      return false;
+    }
+    body = &inflated_[0];
+    length = inflated_.size() - inflater_.avail_out;
+    return true;
+#else
+    (void)body;
+    (void)length;
+    return false;
+#endif
+  }
+
+private:
+  enum { read_buffer_size = 128 * 1024 };
+  enum { max_burst = 1000 };
+
+  tcp::socket  socket_;
+#if defined(CHAT_TLS)
+  typedef boost::asio::ssl::stream< tcp::socket& >  tlsStream_t;
+  boost::scoped_ptr< tlsStream_t >  tls_;
+#endif
+  boost::asio::steady_timer  timer_;
+  const tcp::endpoint  endpoint_;
+  const LoadOptions&  options_;
+  const LoadWindow&  window_;
+  LoadStats&  stats_;
+  boost::atomic< std::size_t >&  connected_;
+
+  const bool  publisher_;
+  bool  publishing_;
+  steadyClock_t::duration  interval_;
+  steadyClock_t::time_point  next_send_;
+  std::vector< char >  body_;
+
+  bool  negotiated_;
+  std::vector< char >  read_buffer_;
+  std::size_t  read_size_;
+
+  /// The room's preset dictionary and the last inflated body.
+  std::string  dictionary_;
+  std::vector< char >  inflated_;
+#if defined(CHAT_DEFLATE)
+  z_stream  inflater_;
+  bool  inflater_valid_;
+#endif
+
+  bool  write_in_progress_;
+  std::vector< char >  pending_;
+  std::vector< char >  writing_;
+};
+
+typedef boost::shared_ptr< LoadConnection >  loadConnectionPTR;
+
+//----------------------------------------------------------------------
+
+/**
+* One io_service per thread; a connection never leaves its thread, so
+* neither connections nor LoadStats need locking.
+*/
+struct LoadWorker
+{
+  explicit LoadWorker()
+    : work(io_service)
+  {
+  }
+
+  boost::asio::io_service  io_service;
+  boost::asio::io_service::work  work;
+  LoadStats  stats;
+  std::vector< loadConnectionPTR >  connections;
+};
+
+typedef boost::shared_ptr< LoadWorker >  loadWorkerPTR;
+
+inline void sleep_seconds(double seconds)
+{
+  boost::this_thread::sleep(boost::posix_time::microseconds(
+      boost::int64_t(seconds * 1e6)));
+}
+
+template< typename Function >
+void for_each_connection(std::vector< loadWorkerPTR >& workers, Function f)
+{
+  for (std::size_t w = 0; w < workers.size(); ++w)
+  {
+    LoadWorker&  worker = *workers[w];
+    for (std::size_t c = 0; c < worker.connections.size(); ++c)
+    {
+      worker.io_service.post(boost::bind(f, worker.connections[c].get()));
+    }
+  }
+}
+
+//----------------------------------------------------------------------
+
+
+
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    LoadOptions  options;
+#if defined(CHAT_TLS)
+    bool  tls = false;
+#endif
+    int  arg = 1;
+    for ( ; (arg + 1 < argc) && (argv[arg][0] == '-'); arg += 2)
+    {
+      using namespace std; // For atof and strtoul.
+      const std::string  name = argv[arg];
+      const char*  value = argv[arg + 1];
+      if (name == "-c")
+        options.connections = strtoul(value, 0, 10);
+      else if (name == "-p")
+        options.publishers = strtoul(value, 0, 10);
+      else if (name == "-r")
+        options.rate = atof(value);
+      else if (name == "-s")
+        options.message_size = strtoul(value, 0, 10);
+      else if (name == "-d")
+        options.duration = atof(value);
+      else if (name == "-w")
+        options.warmup = atof(value);
+      else if (name == "-t")
+        options.threads = strtoul(value, 0, 10);
+      else if (name == "-R")
+        options.room = strtoul(value, 0, 10);
+#if defined(CHAT_TLS)
+      else if (name == "-T")
+        tls = (strtoul(value, 0, 10) != 0);
+#endif
+#if defined(CHAT_DEFLATE)
+      else if (name == "-Z")
+        options.compressed = (strtoul(value, 0, 10) != 0);
+#endif
+      else
+        arg = argc;
+    }
+
+    if ((argc != arg + 2) || (options.connections == 0)
+        || (options.rate <= 0))
+    {
+      std::cerr << "Usage: loadgen [-c <connections>] [-p <publishers>]"
+          " [-r <msgs/s>] [-s <body bytes>] [-d <seconds>] [-w <warm-up s>]"
+          " [-t <threads>] [-R <room>]"
+#if defined(CHAT_TLS)
+          " [-T <TLS 0|1>]"
+#endif
+#if defined(CHAT_DEFLATE)
+          " [-Z <deflate 0|1>]"
+#endif
+          " <host> <port>\n";
+      return 1;
+    }
+    options.host = argv[arg];
+    options.port = argv[arg + 1];
+    options.threads = std::max< std::size_t >(options.threads, 1);
+    options.publishers =
+        std::min(std::max< std::size_t >(options.publishers, 1),
+          options.connections);
+
+#if defined(CHAT_TLS)
+    // The server's certificate is not checked: this measures, it does
+    // not trust.
+    boost::asio::ssl::context  tls_context(
+        boost::asio::ssl::context::tls_client);
+    tls_context.set_verify_mode(boost::asio::ssl::verify_none);
+    if (tls)
+    {
+      options.tls_context = &tls_context;
+    }
+#endif
+
+    boost::asio::io_service  resolver_service;
+    tcp::resolver  resolver(resolver_service);
+    const tcp::endpoint  endpoint = *resolver.resolve(
+        tcp::resolver::query(options.host, options.port));
+
+    LoadWindow  window;
+    window.run_id = now_ns();
+    window.begin = ~boost::uint64_t(0);
+    window.end = ~boost::uint64_t(0);
+    boost::atomic< std::size_t >  connected(0);
+
+    std::vector< loadWorkerPTR >  workers;
+    for (std::size_t i = 0; i < options.threads; ++i)
+    {
+      workers.push_back(loadWorkerPTR(new LoadWorker()));
+    }
+    for (std::size_t i = 0; i < options.connections; ++i)
+    {
+      LoadWorker&  worker = *workers[i % workers.size()];
+      worker.connections.push_back(loadConnectionPTR(new LoadConnection(
+          worker.io_service, endpoint, options, window, worker.stats,
+          connected, i < options.publishers)));
+    }
+
+    boost::thread_group  threads;
+    for (std::size_t i = 0; i < workers.size(); ++i)
+    {
+      threads.create_thread(boost::bind(&boost::asio::io_service::run,
+          &workers[i]->io_service));
+    }
+
+    // Connect, give the server time to negotiate and join everybody.
+    for_each_connection(workers, &LoadConnection::start);
+    for (int i = 0; (i < 300) && (connected < options.connections); ++i)
+    {
+      sleep_seconds(0.1);
+    }
+    sleep_seconds(0.5);
+
+    const boost::uint64_t  started = now_ns();
+    window.begin = started + boost::uint64_t(options.warmup * 1e9);
+    window.end = window.begin + boost::uint64_t(options.duration * 1e9);
+    for_each_connection(workers, &LoadConnection::start_publishing);
+    sleep_seconds(options.warmup + options.duration);
+    for_each_connection(workers, &LoadConnection::stop_publishing);
+
+    // Let the tail of the measured messages arrive.
+    sleep_seconds(1.0);
+    for_each_connection(workers, &LoadConnection::close);
+    for (std::size_t i = 0; i < workers.size(); ++i)
+    {
+      workers[i]->io_service.stop();
+    }
+    threads.join_all();
+
+    LoadStats  total;
+    for (std::size_t i = 0; i < workers.size(); ++i)
+    {
+      total.merge(workers[i]->stats);
+    }
+
+    const double  seconds = options.duration;
+    std::printf("{\"connections\":%lu,\"connected\":%lu,\"publishers\":%lu,"
+        "\"rate\":%.0f,\"message_size\":%lu,\"duration_s\":%.3f,"
+        "\"sent\":%llu,\"received\":%llu,\"errors\":%llu,"
+        "\"sent_msgs_per_sec\":%.1f,\"msgs_per_sec\":%.1f,"
+        "\"bytes_per_sec\":%.1f,"
+        "\"latency_ns\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,"
+        "\"max\":%llu,\"mean\":%.0f}}\n",
+        static_cast< unsigned long >(options.connections),
+        static_cast< unsigned long >(connected.load()),
+        static_cast< unsigned long >(options.publishers),
+        options.rate,
+        static_cast< unsigned long >(options.message_size),
+        seconds,
+        static_cast< unsigned long long >(total.sent),
+        static_cast< unsigned long long >(total.received),
+        static_cast< unsigned long long >(total.errors),
+        total.sent / seconds,
+        total.received / seconds,
+        total.bytes_received / seconds,
+        static_cast< unsigned long long >(total.latency.percentile(0.50)),
+        static_cast< unsigned long long >(total.latency.percentile(0.99)),
+        static_cast< unsigned long long >(total.latency.percentile(0.999)),
+        static_cast< unsigned long long >(total.latency.max()),
+        total.latency.mean());
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,477 @@
+//
+// microbench.cpp
+// ~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Google Benchmark suite for the message codec, the room fan-out, the
+// history log and the handler allocation. The room is driven by polling
+// its shards from the benchmark thread and delivers to in-process
+// fake participants; only the allocation benchmark uses a loopback
+// connection and only the history log writes files, under /tmp.
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/config.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include "../../server/include/compression.h"
+#include "../../server/include/handler_allocator.h"
+#include "../../server/include/history_log.h"
+#include "../../server/include/log.h"
+#include "../../server/include/message.h"
+#include "../../server/include/room.h"
+
+
+namespace
+{
+
+/// Every operator new of the process, for the allocation counters.
+boost::atomic< std::size_t >  allocations(0);
+
+} // namespace
+
+// Kept out of line: inlined into new-expressions, they make GCC take the
+// malloc/free pairs for mismatched.
+BOOST_NOINLINE void* operator new(std::size_t size)
+{
+  allocations.fetch_add(1, boost::memory_order_relaxed);
+  if (void* pointer = std::malloc(size ? size : 1))
+  {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+BOOST_NOINLINE void operator delete(void* pointer) noexcept
+{
+  std::free(pointer);
+}
+
+BOOST_NOINLINE void operator delete(void* pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+namespace
+{
+
+/**
+* Stands in for ChatSession: takes a reference to every message and
+* backlog, as a session's write queue does, and keeps a bounded number
+* of them.
+*/
+class FakeParticipant
+{
+public:
+  enum { max_queued_msgs = 64 };
+
+  FakeParticipant()
+    : delivered_(0)
+  {
+  }
+
+  void deliver(const chatMessageBatch_t& batch)
+  {
+    for (chatMessageBatch_t::const_iterator itr = batch.begin();
+         itr != batch.end(); ++itr)
+    {
+      if (queue_.size() == max_queued_msgs)
+      {
+        queue_.pop_front();
+      }
+      queue_.push_back(*itr);
+    }
+    delivered_ += batch.size();
+  }
+
+  void deliver(const chatBacklogPTR& backlog)
+  {
+    backlog_ = backlog;
+    delivered_ += backlog->count();
+  }
+
+  std::size_t delivered() const
+  {
+    return delivered_;
+  }
+
+private:
+  chatMessageQueue_t  queue_;
+  chatBacklogPTR  backlog_;
+  std::size_t  delivered_;
+};
+
+typedef ChatRoom< FakeParticipant >  fakeRoom_t;
+typedef boost::shared_ptr< FakeParticipant >  fakeParticipantPTR;
+
+chatMessagePTR make_line(std::size_t length, boost::uint32_t room = 0)
+{
+  boost::shared_ptr< ChatMessage >  msg = make_message();
+  msg->body_length(length);
+  std::memset(msg->body(), 'x', length);
+  msg->room(room);
+  msg->encode_headers();
+  return msg;
+}
+
+/// Runs whatever the room dispatched to its strands, on every shard.
+void run_pending(ChatShards& shards)
+{
+  for (std::size_t handlers = 1; handlers > 0; )
+  {
+    handlers = 0;
+    for (std::size_t i = 0; i < shards.size(); ++i)
+    {
+      handlers += shards[i].poll();
+      shards[i].reset();
+    }
+  }
+}
+
+} // namespace
+
+//----------------------------------------------------------------------
+
+static void BM_EncodeHeader(benchmark::State& state)
+{
+  const ChatMessage::Framing  framing = ChatMessage::Framing(state.range(0));
+  boost::shared_ptr< ChatMessage >  msg = make_message();
+  msg->body_length(300);
+  msg->room(7);
+  for (auto _ : state)
+  {
+    msg->encode_header(framing);
+    benchmark::DoNotOptimize(msg->header(framing));
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeHeader)
+    ->Arg(ChatMessage::legacy_framing)->Arg(ChatMessage::binary_framing);
+
+static void BM_EncodeHeaders(benchmark::State& state)
+{
+  boost::shared_ptr< ChatMessage >  msg = make_message();
+  msg->body_length(300);
+  for (auto _ : state)
+  {
+    msg->encode_headers();
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeHeaders);
+
+static void BM_DecodeHeader(benchmark::State& state)
+{
+  const ChatMessage::Framing  framing = ChatMessage::Framing(state.range(0));
+  const chatMessagePTR  source = make_line(300, 7);
+  ChatMessage  msg;
+  for (auto _ : state)
+  {
+    std::memcpy(msg.header(framing), source->header(framing),
+        ChatMessage::header_size(framing));
+    benchmark::DoNotOptimize(msg.decode_header(framing));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DecodeHeader)
+    ->Arg(ChatMessage::legacy_framing)->Arg(ChatMessage::binary_framing);
+
+static void BM_Str(benchmark::State& state)
+{
+  const chatMessagePTR  msg = make_line(state.range(0));
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(msg->str());
+  }
+  state.SetBytesProcessed(state.iterations() * msg->length(
+      ChatMessage::legacy_framing));
+}
+BENCHMARK(BM_Str)->Arg(16)->Arg(128)->Arg(ChatMessage::max_body_length);
+
+static void BM_MakeMessage(benchmark::State& state)
+{
+  const std::size_t  length = state.range(0);
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(make_line(length));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MakeMessage)->Arg(16)->Arg(512)->Arg(16 * 1024);
+
+//----------------------------------------------------------------------
+
+/**
+* Args: participants, messages per batch, shards. The participants are
+* spread over the shards, which all run on the benchmark thread: more
+* shards show what forwarding costs, not what it gains.
+*/
+static void BM_RoomDeliver(benchmark::State& state)
+{
+  const std::size_t  participant_count = state.range(0);
+  const std::size_t  batch_size = state.range(1);
+
+  ChatShards  shards(state.range(2));
+  const boost::shared_ptr< fakeRoom_t >  room =
+      boost::make_shared< fakeRoom_t >(boost::ref(shards), 0);
+  std::vector< fakeParticipantPTR >  participants;
+  for (std::size_t i = 0; i < participant_count; ++i)
+  {
+    participants.push_back(boost::make_shared< FakeParticipant >());
+    const chatMembershipPTR  membership =
+        boost::make_shared< ChatMembership >();
+    membership->shard = i % shards.size();
+    room->join(participants.back(), membership, ChatMessage::binary_framing);
+  }
+  run_pending(shards);
+
+  chatMessageBatch_t  batch;
+  for (std::size_t i = 0; i < batch_size; ++i)
+  {
+    batch.push_back(make_line(64));
+  }
+
+  for (auto _ : state)
+  {
+    room->deliver(batch);
+    run_pending(shards);
+  }
+  state.SetItemsProcessed(
+      state.iterations() * participant_count * batch_size);
+}
+BENCHMARK(BM_RoomDeliver)
+    ->ArgNames({ "participants", "batch", "shards" })
+    ->ArgsProduct({ { 1, 16, 256, 4096 }, { 1, 16 }, { 1, 4 } });
+
+/// A participant joining a room whose history is full gets its backlog.
+static void BM_RoomJoinFullBacklog(benchmark::State& state)
+{
+  ChatShards  shards(1);
+  const boost::shared_ptr< fakeRoom_t >  room =
+      boost::make_shared< fakeRoom_t >(boost::ref(shards), 0);
+
+  chatMessageBatch_t  history;
+  for (int i = 0; i < 200; ++i)
+  {
+    history.push_back(make_line(64));
+  }
+  room->deliver(history);
+  run_pending(shards);
+
+  const fakeParticipantPTR  participant =
+      boost::make_shared< FakeParticipant >();
+  const chatMembershipPTR  membership = boost::make_shared< ChatMembership >();
+  for (auto _ : state)
+  {
+    room->join(participant, membership, ChatMessage::binary_framing);
+    room->leave(membership);
+    run_pending(shards);
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["replayed"] = benchmark::Counter(
+      double(participant->delivered()) / double(state.iterations()));
+}
+BENCHMARK(BM_RoomJoinFullBacklog);
+
+//----------------------------------------------------------------------
+
+/// Numbered chat lines, alike but not the same.
+static chatMessagePTR make_chat_line(std::size_t length, std::size_t n)
+{
+  static const char  text[] =
+      "so who is up for lunch? the usual place at noon, I will book "
+      "a table for six. did anybody see the build break this morning? ";
+  boost::shared_ptr< ChatMessage >  msg = make_message();
+  msg->body_length(length);
+  for (std::size_t i = 0; i < length; ++i)
+  {
+    msg->body()[i] = text[(i + 7 * n) % (sizeof(text) - 1)];
+  }
+  std::snprintf(msg->body(), length, "%lu", static_cast< unsigned long >(n));
+  msg->encode_headers();
+  return msg;
+}
+
+/**
+* Deflates one message the way a room does, with a dictionary trained
+* from 100 recent ones. Args: body bytes, dictionary bytes (0: none).
+* Built without CHAT_DEFLATE this measures the refusal.
+*/
+static void BM_Deflate(benchmark::State& state)
+{
+  const std::size_t  length = state.range(0);
+  chatMessageQueue_t  recent;
+  for (std::size_t i = 0; i < 100; ++i)
+  {
+    recent.push_back(make_chat_line(length, i));
+  }
+  std::string  dictionary;
+  ChatDeflater::train(recent.begin(), recent.end(), state.range(1),
+      dictionary);
+  ChatDeflater  deflater(6);
+  deflater.dictionary(dictionary.data(), dictionary.size());
+
+  const chatMessagePTR  msg = make_chat_line(length, 100);
+  ChatMessage  out;
+  std::size_t  compressed = length;
+  for (auto _ : state)
+  {
+    if (deflater.compress(*msg, out))
+    {
+      compressed = out.body_length();
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * length);
+  state.counters["ratio"] = double(compressed) / double(length);
+}
+BENCHMARK(BM_Deflate)
+    ->ArgNames({ "bytes", "dictionary" })
+    ->ArgsProduct({ { 64, 256, 1024 }, { 0, 8 * 1024 } });
+
+//----------------------------------------------------------------------
+
+/// Appends to a room's log; the msyncs it asks for run on another thread.
+/// Segments are made in line here; the room has them made on another.
+/// Arg: body bytes.
+static void BM_HistoryAppend(benchmark::State& state)
+{
+  char  path[64];
+  std::snprintf(path, sizeof(path), "/tmp/chat-microbench-%lu",
+      static_cast< unsigned long >(state.range(0)));
+  const chatMessagePTR  msg = make_line(state.range(0));
+  {
+    ChatHistoryLog  log(path);
+    for (auto _ : state)
+    {
+      if (!log.append(*msg))
+      {
+        log.add_spare(ChatHistoryLog::create_segment(path,
+            log.next_segment()));
+        log.append(*msg);
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * msg->body_length());
+
+  for (std::size_t k = 0; ; ++k)
+  {
+    char  suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "-%lu",
+        static_cast< unsigned long >(k));
+    const std::string  segment = std::string(path) + suffix;
+    std::remove((segment + ".idx").c_str());
+    if (std::remove((segment + ".log").c_str()) != 0)
+    {
+      break;
+    }
+  }
+}
+BENCHMARK(BM_HistoryAppend)->Arg(64)->Arg(4096);
+
+//----------------------------------------------------------------------
+
+namespace
+{
+
+void on_transfer(const boost::shared_ptr< char >&,
+    const boost::system::error_code&, std::size_t)
+{
+}
+
+} // namespace
+
+/**
+* A write and a read over loopback through a strand, bound as the session
+* binds them; arg 1 builds the operations in ChatHandlerMemory. With it,
+* allocs_per_op must be 0 but for the benchmark's own bookkeeping.
+*/
+static void BM_AsyncWriteRead(benchmark::State& state)
+{
+  using boost::asio::ip::tcp;
+
+  const bool  recycled = (state.range(0) != 0);
+  boost::asio::io_service  io_service;
+  tcp::acceptor  acceptor(io_service,
+      tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+  tcp::socket  writer(io_service);
+  tcp::socket  reader(io_service);
+  writer.connect(acceptor.local_endpoint());
+  acceptor.accept(reader);
+
+  boost::asio::strand< boost::asio::io_service::executor_type >  strand(
+      boost::asio::make_strand(io_service));
+  const boost::shared_ptr< char >  owner = boost::make_shared< char >();
+  char  out[64] = { 0 };
+  char  in[64];
+  ChatHandlerMemory  write_memory;
+  ChatHandlerMemory  read_memory;
+
+  std::size_t  before = 0;
+  std::size_t  iterations = 0;
+  for (auto _ : state)
+  {
+    // The first round fills Asio's own caches.
+    if (iterations++ == 1)
+    {
+      before = allocations.load(boost::memory_order_relaxed);
+    }
+    if (recycled)
+    {
+      boost::asio::async_write(writer, boost::asio::buffer(out),
+          boost::asio::bind_executor(strand, make_alloc_handler(write_memory,
+            boost::bind(&on_transfer, owner, _1, _2))));
+      boost::asio::async_read(reader, boost::asio::buffer(in),
+          boost::asio::bind_executor(strand, make_alloc_handler(read_memory,
+            boost::bind(&on_transfer, owner, _1, _2))));
+    }
+    else
+    {
+      boost::asio::async_write(writer, boost::asio::buffer(out),
+          boost::asio::bind_executor(strand,
+            boost::bind(&on_transfer, owner, _1, _2)));
+      boost::asio::async_read(reader, boost::asio::buffer(in),
+          boost::asio::bind_executor(strand,
+            boost::bind(&on_transfer, owner, _1, _2)));
+    }
+    io_service.run();
+    io_service.reset();
+  }
+
+  const std::size_t  measured = (iterations > 1) ? (iterations - 1) : 1;
+  state.SetItemsProcessed(state.iterations());
+  state.counters["allocs_per_op"] = benchmark::Counter(double(
+      allocations.load(boost::memory_order_relaxed) - before)
+      / double(measured));
+}
+BENCHMARK(BM_AsyncWriteRead)->ArgName("recycled")->Arg(0)->Arg(1);
+
+//----------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+  // Joins log at info; keep the sink out of the measurements.
+  ChatLog::instance().level(log_warning);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+  {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,262 @@
+//
+// overflowcheck.cpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Check of the write queue overflow policies, run by ctest. The server is
+// compiled in with its main() renamed and, for each policy, listens on a
+// loopback port with a short write queue. A binary client floods a room
+// in short bursts, reading each back before the next, while another one
+// in it, with a tiny receive buffer, reads nothing;
+// then that one reads what reached it:
+//   - drop-oldest and drop-newest: messages in order, some missing, as
+//     many as the server counts dropped, and the last one with
+//     drop-oldest;
+//   - coalesce: messages in order up to the last one, and notices for
+//     exactly the messages missing;
+//   - disconnect: messages in order, then the end of the connection.
+//
+// Usage: overflowcheck
+
+
+#define main chat_server_main
+#include "../../server/src/server.cpp"
+#undef main
+
+#include <cstdio>
+#include <poll.h>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/thread/thread.hpp>
+
+
+namespace
+{
+
+const std::size_t  flood_msgs = 4000;
+const std::size_t  body_length = 3000;
+const std::size_t  max_queued_msgs = 16;
+/// Sent at once, then read back: the sender's queue never overflows.
+/// A burst fits the session's read buffer, so it is echoed in one write.
+const std::size_t  burst = 4;
+/// The server is done with the client once it is silent that long, ms.
+const int  quiet_time = 500;
+
+int  failures = 0;
+
+/// The sessions leave Nagle on: a client that delays its acks stalls the
+/// next write to it, and every burst, for 40 ms.
+typedef boost::asio::detail::socket_option::boolean< IPPROTO_TCP,
+    TCP_QUICKACK >  quick_ack;
+
+void check(bool condition, const char* test, const char* what)
+{
+  if (!condition)
+  {
+    std::cout << test << ": " << what << " failed\n";
+    ++failures;
+  }
+}
+
+/// Message 'seq' of the flood: its number, then filler.
+void append_frame(std::vector< char >& frames, std::size_t seq)
+{
+  ChatMessage  message;
+  message.body_length(body_length);
+  std::memset(message.body(), 'x', body_length);
+  char  number[16];
+  std::snprintf(number, sizeof(number), "%08lu",
+      static_cast< unsigned long >(seq));
+  std::memcpy(message.body(), number, 8);
+  message.encode_header(ChatMessage::binary_framing);
+  const char*  header = message.header(ChatMessage::binary_framing);
+  frames.insert(frames.end(), header,
+      header + ChatMessage::binary_header_length);
+  frames.insert(frames.end(), message.body(),
+      message.body() + message.body_length());
+}
+
+/// Connects a binary client; its first frame joins it to the room.
+void negotiate(tcp::socket& socket, unsigned short port)
+{
+  socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+      port));
+  socket.set_option(tcp::no_delay(true));
+  boost::asio::write(socket, boost::asio::buffer(
+      ChatMessage::protocol_preface(), ChatMessage::preface_length));
+  char  reply[ChatMessage::preface_length];
+  boost::asio::read(socket, boost::asio::buffer(reply));
+}
+
+/// Reads a frame; false at the end of the connection, or when nothing
+/// arrived for quiet_time ms.
+bool read_frame(tcp::socket& socket, ChatMessage& msg, bool& closed)
+{
+  pollfd  fd = { socket.native_handle(), POLLIN, 0 };
+  closed = false;
+  if (::poll(&fd, 1, quiet_time) != 1)
+  {
+    return false;
+  }
+  boost::system::error_code  error;
+  boost::asio::read(socket, boost::asio::buffer(
+      msg.header(ChatMessage::binary_framing),
+      ChatMessage::binary_header_length), error);
+  if (!error)
+  {
+    msg.decode_header(ChatMessage::binary_framing);
+    boost::asio::read(socket,
+        boost::asio::buffer(msg.body(), msg.body_length()), error);
+  }
+  closed = bool(error);
+  return !error;
+}
+
+/// A flood message's number, or false for anything else.
+bool flood_number(const ChatMessage& msg, std::size_t& seq)
+{
+  if (msg.body_length() != body_length)
+  {
+    return false;
+  }
+  unsigned long  number = 0;
+  const std::string  text(msg.body(), 8);
+  if (std::sscanf(text.c_str(), "%8lu", &number) != 1)
+  {
+    return false;
+  }
+  seq = number;
+  return true;
+}
+
+/// The number of messages a coalesce notice stands for, or 0.
+std::size_t skipped_number(const ChatMessage& msg)
+{
+  const std::string  text(msg.body(), msg.body_length());
+  unsigned long  skipped = 0;
+  return (std::sscanf(text.c_str(), "*** %lu messages skipped ***",
+        &skipped) == 1) ? skipped : 0;
+}
+
+void run(ChatOptions::OverflowPolicy policy)
+{
+  const char*  test = ChatOptions::overflow_policy_name(policy);
+  ChatOverflowCounters&  counters = ChatOverflowCounters::instance();
+  const std::size_t  fired = counters.fired[policy].load();
+  const std::size_t  dropped = counters.dropped_msgs.load();
+
+  ChatOptions  options;
+  options.thread_count = 2;
+  options.acceptor_count = 1;
+  options.max_queued_msgs = max_queued_msgs;
+  options.overflow_policy = policy;
+  ChatShards  shards(options.thread_count);
+  ChatServer  server(shards,
+      tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0), options);
+  boost::thread  workers(boost::bind(&ChatShards::run, &shards));
+
+  // Joined once each has its first frame back.
+  std::vector< char >  hello;
+  append_frame(hello, flood_msgs);
+  std::vector< char >  scratch(hello.size());
+  boost::asio::io_service  io_service;
+  tcp::socket  slow(io_service);
+  slow.open(tcp::v4());
+  slow.set_option(tcp::socket::receive_buffer_size(4096));
+  negotiate(slow, server.port());
+  boost::asio::write(slow, boost::asio::buffer(hello));
+  boost::asio::read(slow, boost::asio::buffer(scratch));
+  tcp::socket  sender(io_service);
+  negotiate(sender, server.port());
+  boost::asio::write(sender, boost::asio::buffer(hello));
+  boost::asio::read(sender, boost::asio::buffer(scratch));
+  boost::asio::read(sender, boost::asio::buffer(scratch));
+  boost::asio::read(slow, boost::asio::buffer(scratch));
+
+  std::vector< char >  frames;
+  for (std::size_t seq = 0; seq < flood_msgs; seq += burst)
+  {
+    frames.clear();
+    for (std::size_t i = seq; i < seq + burst; ++i)
+    {
+      append_frame(frames, i);
+    }
+    boost::asio::write(sender, boost::asio::buffer(frames));
+    boost::asio::read(sender, boost::asio::buffer(frames));
+    sender.set_option(quick_ack(true));
+  }
+
+  std::size_t  received = 0;
+  std::size_t  noticed = 0;
+  std::size_t  last = 0;
+  bool  ordered = true;
+  bool  closed = false;
+  ChatMessage  msg;
+  while (read_frame(slow, msg, closed))
+  {
+    std::size_t  seq = 0;
+    if (flood_number(msg, seq))
+    {
+      ordered &= (received == 0) || (seq > last);
+      last = seq;
+      ++received;
+    }
+    else
+    {
+      noticed += skipped_number(msg);
+    }
+  }
+
+  check(counters.fired[policy].load() > fired, test, "overflow");
+  check(ordered, test, "order");
+  check(received < flood_msgs, test, "loss");
+  switch (policy)
+  {
+    case ChatOptions::drop_oldest:
+      check(last == flood_msgs - 1, test, "delivery of the last message");
+      // Fall through.
+    case ChatOptions::drop_newest:
+      check(received + counters.dropped_msgs.load() - dropped == flood_msgs,
+          test, "count of the dropped messages");
+      check(noticed == 0, test, "absence of notices");
+      check(!closed, test, "connection");
+      break;
+
+    case ChatOptions::coalesce:
+      check(last == flood_msgs - 1, test, "delivery of the last message");
+      check(received + noticed == flood_msgs, test,
+          "count of the skipped messages");
+      check(!closed, test, "connection");
+      break;
+
+    case ChatOptions::disconnect:
+    default:
+      check(closed, test, "disconnection");
+      break;
+  }
+
+  shards.stop();
+  workers.join();
+}
+
+} // namespace
+
+int main()
+{
+  try
+  {
+    ChatLog::instance().level(log_error);
+    ChatSession::reserve(ChatOptions().preallocated_sessions);
+    for (int i = 0; i < ChatOptions::overflow_policy_count; ++i)
+    {
+      run(ChatOptions::OverflowPolicy(i));
+    }
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+    ++failures;
+  }
+
+  std::cout << (failures ? "FAILED\n" : "passed\n");
+  return failures ? 1 : 0;
+}
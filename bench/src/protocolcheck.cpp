@@ -0,0 +1,286 @@
+//
+// protocolcheck.cpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Check of the framings and their negotiation, run by ctest. The headers
+// are decoded and encoded on their own first: valid ones round-trip,
+// malformed ones are refused. Then the server, compiled in with its
+// main() renamed, listens on a loopback port for clients that:
+//   - send the preface, which is echoed, and a binary frame;
+//   - send a legacy message straight away;
+//   - send nothing, and are joined to the default room once the
+//     negotiation times out;
+//   - send a preface of another version, or a binary header with its
+//     reserved bytes set, and are disconnected;
+//   - close before saying anything, and are joined to no room.
+//
+// Usage: protocolcheck
+
+
+#define main chat_server_main
+#include "../../server/src/server.cpp"
+#undef main
+
+#include <poll.h>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/thread/thread.hpp>
+
+
+namespace
+{
+
+/// Longest wait for the server, ms.
+const int  reply_time = 2000;
+/// Twice the sessions' wait for a preface, ms.
+const long  negotiation_time = 500;
+
+int  failures = 0;
+
+void check(bool condition, const char* test, const char* what)
+{
+  if (!condition)
+  {
+    std::cout << test << ": " << what << " failed\n";
+    ++failures;
+  }
+}
+
+void legacy_headers()
+{
+  const char*  test = "legacy-headers";
+  ChatMessage  msg;
+  std::memcpy(msg.header(ChatMessage::legacy_framing), "  12", 4);
+  check(msg.decode_header() && (msg.body_length() == 12)
+      && (msg.room() == ChatMessage::default_room), test, "decode");
+
+  static const char* const  malformed[] = { "12  ", " 1 2", "12a4", "-012",
+      " 513" };
+  for (std::size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); ++i)
+  {
+    std::memcpy(msg.header(ChatMessage::legacy_framing), malformed[i], 4);
+    check(!msg.decode_header() && (msg.body_length() == 0), test,
+        "refusal of a malformed header");
+  }
+
+  // A long binary body goes to legacy clients cut to what they take.
+  msg.body_length(ChatMessage::max_body_length + 100);
+  msg.encode_headers();
+  check(std::memcmp(msg.header(ChatMessage::legacy_framing), " 512", 4) == 0,
+      test, "encode of a long body");
+}
+
+void binary_headers()
+{
+  const char*  test = "binary-headers";
+  ChatMessage  msg;
+  msg.body_length(1000);
+  msg.type(ChatMessage::type_join);
+  msg.flags(ChatMessage::flag_deflate);
+  msg.room(0x01020304);
+  msg.encode_header(ChatMessage::binary_framing);
+
+  ChatMessage  copy;
+  std::memcpy(copy.header(ChatMessage::binary_framing),
+      msg.header(ChatMessage::binary_framing),
+      ChatMessage::binary_header_length);
+  check(copy.decode_header(ChatMessage::binary_framing)
+      && (copy.body_length() == 1000)
+      && (copy.type() == ChatMessage::type_join)
+      && (copy.flags() == ChatMessage::flag_deflate)
+      && (copy.room() == 0x01020304), test, "round trip");
+  check(!copy.decode_header(ChatMessage::binary_framing, 999)
+      && (copy.body_length() == 0), test, "refusal of a long body");
+
+  for (std::size_t i = 6; i < 8; ++i)
+  {
+    std::memcpy(copy.header(ChatMessage::binary_framing),
+        msg.header(ChatMessage::binary_framing),
+        ChatMessage::binary_header_length);
+    copy.header(ChatMessage::binary_framing)[i] = 1;
+    check(!copy.decode_header(ChatMessage::binary_framing), test,
+        "refusal of reserved bytes set");
+  }
+}
+
+/// The socket has something to read, or its end, within 'timeout' ms.
+bool readable(tcp::socket& socket, int timeout)
+{
+  pollfd  fd = { socket.native_handle(), POLLIN, 0 };
+  return ::poll(&fd, 1, timeout) == 1;
+}
+
+/// Reads 'size' bytes, if they come in time.
+bool receive(tcp::socket& socket, char* data, std::size_t size)
+{
+  boost::system::error_code  error;
+  for (std::size_t n = 0; n < size; )
+  {
+    if (!readable(socket, reply_time))
+    {
+      return false;
+    }
+    n += socket.read_some(boost::asio::buffer(data + n, size - n), error);
+    if (error)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// The server closes the connection in time, having sent nothing more.
+bool closed(tcp::socket& socket)
+{
+  char  data[256];
+  boost::system::error_code  error;
+  while (readable(socket, reply_time))
+  {
+    socket.read_some(boost::asio::buffer(data), error);
+    if (error)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void connect(tcp::socket& socket, unsigned short port)
+{
+  socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+      port));
+  socket.set_option(tcp::no_delay(true));
+}
+
+std::string binary_frame(const std::string& body)
+{
+  ChatMessage  msg;
+  msg.body_length(body.size());
+  std::memcpy(msg.body(), body.data(), body.size());
+  msg.encode_header(ChatMessage::binary_framing);
+  return std::string(msg.header(ChatMessage::binary_framing),
+      ChatMessage::binary_header_length) + body;
+}
+
+std::string legacy_frame(const std::string& body)
+{
+  ChatMessage  msg;
+  msg.body_length(body.size());
+  std::memcpy(msg.body(), body.data(), body.size());
+  msg.encode_header(ChatMessage::legacy_framing);
+  return msg.str();
+}
+
+/// Reads back 'frame', which the client sent or should get.
+bool receive_frame(tcp::socket& socket, const std::string& frame)
+{
+  std::vector< char >  data(frame.size());
+  return receive(socket, &data[0], data.size())
+      && (std::string(data.begin(), data.end()) == frame);
+}
+
+std::size_t participants(ChatServer& server)
+{
+  const ChatSession::chatRoomPTR  room =
+      server.rooms().find(ChatMessage::default_room);
+  return room ? room->participant_count() : 0;
+}
+
+/// Sleeps until the negotiation of a client connected now is over.
+void wait_negotiation()
+{
+  boost::this_thread::sleep(boost::posix_time::milliseconds(
+      negotiation_time));
+}
+
+void negotiation()
+{
+  const char*  test = "negotiation";
+  ChatOptions  options;
+  options.thread_count = 2;
+  options.acceptor_count = 1;
+  ChatShards  shards(options.thread_count);
+  ChatServer  server(shards,
+      tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0), options);
+  boost::thread  workers(boost::bind(&ChatShards::run, &shards));
+  boost::asio::io_service  io_service;
+
+  tcp::socket  binary(io_service);
+  connect(binary, server.port());
+  const std::string  preface(ChatMessage::protocol_preface(),
+      ChatMessage::preface_length);
+  boost::asio::write(binary, boost::asio::buffer(preface));
+  check(receive_frame(binary, preface), test, "echo of the preface");
+  boost::asio::write(binary, boost::asio::buffer(binary_frame("binary")));
+  check(receive_frame(binary, binary_frame("binary")), test,
+      "echo of a binary frame");
+
+  tcp::socket  legacy(io_service);
+  connect(legacy, server.port());
+  boost::asio::write(legacy, boost::asio::buffer(legacy_frame("legacy")));
+  check(receive_frame(legacy, legacy_frame("binary"))
+      && receive_frame(legacy, legacy_frame("legacy")), test,
+      "legacy backlog and echo");
+  check(receive_frame(binary, binary_frame("legacy")), test,
+      "legacy message in the binary framing");
+
+  tcp::socket  silent(io_service);
+  connect(silent, server.port());
+  wait_negotiation();
+  check(receive_frame(silent, legacy_frame("binary"))
+      && receive_frame(silent, legacy_frame("legacy")), test,
+      "backlog of a silent client");
+  check(participants(server) == 3, test, "join of a silent client");
+
+  tcp::socket  other_version(io_service);
+  connect(other_version, server.port());
+  std::string  old_preface = preface;
+  old_preface[ChatMessage::preface_length - 1] =
+      char(ChatMessage::protocol_version - 1);
+  boost::asio::write(other_version, boost::asio::buffer(old_preface));
+  check(closed(other_version), test, "refusal of another version");
+
+  tcp::socket  reserved(io_service);
+  connect(reserved, server.port());
+  boost::asio::write(reserved, boost::asio::buffer(preface));
+  check(receive_frame(reserved, preface), test, "echo of the preface");
+  std::string  bad_frame = binary_frame("bad");
+  bad_frame[6] = 1;
+  boost::asio::write(reserved, boost::asio::buffer(bad_frame));
+  check(closed(reserved), test, "refusal of reserved bytes set");
+
+  wait_negotiation();
+  check(participants(server) == 3, test, "leave of the refused clients");
+  {
+    tcp::socket  gone(io_service);
+    connect(gone, server.port());
+  }
+  wait_negotiation();
+  check(participants(server) == 3, test,
+      "no join of a client gone before its preface");
+
+  shards.stop();
+  workers.join();
+}
+
+} // namespace
+
+int main()
+{
+  try
+  {
+    ChatLog::instance().level(log_error);
+    legacy_headers();
+    binary_headers();
+    ChatSession::reserve(ChatOptions().preallocated_sessions);
+    negotiation();
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+    ++failures;
+  }
+
+  std::cout << (failures ? "FAILED\n" : "passed\n");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# TLS benchmark: runs the same fan-out load against the server in
+# plaintext, with TLS records done in user space and with TLS offloaded
+# to the kernel (kTLS), and prints one JSON object per mode: the load
+# generator's figures, the CPU time the server took and how many of its
+# sessions the kernel took over.
+#
+# kTLS needs the kernel's tls module and an OpenSSL built with it; where
+# either is missing the third mode ends up in user space too, which
+# shows as "ktls_send":0.
+#
+# Usage: tls-bench.sh <server> <loadgen> [port]
+#
+
+set -e
+
+SERVER=$1
+LOADGEN=$2
+PORT=${3:-17300}
+METRICS_PORT=$((PORT + 1))
+
+if [ ! -x "$SERVER" ] || [ ! -x "$LOADGEN" ]; then
+  echo "Usage: tls-bench.sh <server> <loadgen> [port]" >&2
+  exit 1
+fi
+
+WORK=$(mktemp -d)
+SERVER_PID=
+cleanup() {
+  if [ -n "$SERVER_PID" ]; then
+    kill -INT $SERVER_PID 2>/dev/null || true
+  fi
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes \
+  -keyout "$WORK/key.pem" -out "$WORK/cert.pem" -days 1 \
+  -subj /CN=localhost 2>/dev/null
+
+TICKS=$(getconf CLK_TCK)
+
+# Server user and system time, in clock ticks.
+cpu_ticks() {
+  awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+metric() {
+  curl -s "http://127.0.0.1:$METRICS_PORT/metrics" \
+    | awk -v name="$1" 'index($0, name "{") == 1 { sum += $2 }
+                         END { print sum + 0 }'
+}
+
+# run <mode> <loadgen TLS 0|1> <server options...>
+run() {
+  MODE=$1
+  TLS=$2
+  shift 2
+  "$SERVER" -t 2 -l warning -M $METRICS_PORT "$@" $PORT &
+  SERVER_PID=$!
+  sleep 0.5
+
+  BEFORE=$(cpu_ticks $SERVER_PID)
+  RESULT=$("$LOADGEN" -w 1 -d 5 -c 100 -p 10 -r 2000 -s 1024 -T $TLS \
+    127.0.0.1 $PORT)
+  AFTER=$(cpu_ticks $SERVER_PID)
+  KTLS=$(metric chat_tls_ktls_send_total)
+
+  kill -INT $SERVER_PID
+  wait $SERVER_PID || true
+  SERVER_PID=
+
+  echo "$RESULT" | sed "s/^{/{\"mode\":\"$MODE\",\"server_cpu_s\":$(
+    awk -v t=$((AFTER - BEFORE)) -v hz=$TICKS 'BEGIN { printf "%.2f", t / hz }'
+  ),\"ktls_send\":$KTLS,/"
+}
+
+run plaintext 0
+run tls 1 -C "$WORK/cert.pem" -K "$WORK/key.pem" -O 0
+run ktls 1 -C "$WORK/cert.pem" -K "$WORK/key.pem" -O 1
@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Transport benchmark: runs the same fan-out load against the server with
+# its sessions on Asio's reactor (epoll) and on the io_uring transport,
+# and prints one JSON object per mode: the load generator's figures, the
+# CPU time the server took and how many io_uring_enter calls it made.
+#
+# Where the kernel cannot run the io_uring transport the server falls
+# back to epoll, which shows as "uring_enters":0.
+#
+# Usage: uring-bench.sh <server> <loadgen> [port]
+#
+
+set -e
+
+SERVER=$1
+LOADGEN=$2
+PORT=${3:-17400}
+METRICS_PORT=$((PORT + 1))
+
+if [ ! -x "$SERVER" ] || [ ! -x "$LOADGEN" ]; then
+  echo "Usage: uring-bench.sh <server> <loadgen> [port]" >&2
+  exit 1
+fi
+
+SERVER_PID=
+cleanup() {
+  if [ -n "$SERVER_PID" ]; then
+    kill -INT $SERVER_PID 2>/dev/null || true
+  fi
+}
+trap cleanup EXIT
+
+TICKS=$(getconf CLK_TCK)
+
+# Server user and system time, in clock ticks.
+cpu_ticks() {
+  awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+metric() {
+  curl -s "http://127.0.0.1:$METRICS_PORT/metrics" \
+    | awk -v name="$1" 'index($0, name "{") == 1 { sum += $2 }
+                         END { print sum + 0 }'
+}
+
+# run <mode> <server options...>
+run() {
+  MODE=$1
+  shift
+  "$SERVER" -t 2 -l warning -M $METRICS_PORT "$@" $PORT &
+  SERVER_PID=$!
+  sleep 0.5
+
+  BEFORE=$(cpu_ticks $SERVER_PID)
+  RESULT=$("$LOADGEN" -w 1 -d 5 -c 100 -p 10 -r 2000 -s 256 \
+    127.0.0.1 $PORT)
+  AFTER=$(cpu_ticks $SERVER_PID)
+  ENTERS=$(metric chat_uring_enters_total)
+
+  kill -INT $SERVER_PID
+  wait $SERVER_PID || true
+  SERVER_PID=
+
+  echo "$RESULT" | sed "s/^{/{\"mode\":\"$MODE\",\"server_cpu_s\":$(
+    awk -v t=$((AFTER - BEFORE)) -v hz=$TICKS 'BEGIN { printf "%.2f", t / hz }'
+  ),\"uring_enters\":$ENTERS,/"
+}
+
+run epoll -U 0
+run io_uring -U 1
@@ -15,9 +15,12 @@
 #include <cstdlib>
 #include <deque>
 #include <iostream>
+#include <string>
+#include <boost/array.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/thread/thread.hpp>
+#include "../../server/include/handler_allocator.h"
 #include "../../server/include/message.h"
 
 
@@ -27,12 +30,19 @@ using boost::asio::ip::tcp;
 typedef std::deque< ChatMessage >  chatMessageQueue_t;
 
 
+/**
+* Speaks the binary framing by default: the client opens with the protocol
+* preface and waits for the server to echo it. With legacy framing it
+* behaves as the original client and sends "%4d" headers.
+*/
 class ChatClient {
 public:
   ChatClient(boost::asio::io_service& io_service,
-      tcp::resolver::iterator endpoint_iterator)
+      tcp::resolver::iterator endpoint_iterator,
+      ChatMessage::Framing framing)
     : io_service_(io_service),
-      socket_(io_service)
+      socket_(io_service),
+      framing_(framing)
   {
     boost::asio::async_connect(socket_, endpoint_iterator,
         boost::bind(&ChatClient::handle_connect, this,
@@ -53,23 +63,67 @@ private:
 
   void handle_connect(const boost::system::error_code& error)
   {
-    if (!error)
+    if (error)
     {
+      return;
+    }
+
+    if (framing_ == ChatMessage::binary_framing)
+    {
+      boost::system::error_code  write_error;
+      boost::asio::write(socket_,
+          boost::asio::buffer(ChatMessage::protocol_preface(),
+            ChatMessage::preface_length),
+          write_error);
+      if (write_error)
+      {
+        do_close();
+        return;
+      }
       boost::asio::async_read(socket_,
-          boost::asio::buffer(read_msg_.data(), ChatMessage::header_length),
-          boost::bind(&ChatClient::handle_read_header, this,
-            boost::asio::placeholders::error));
+          boost::asio::buffer(preface_, ChatMessage::preface_length),
+          make_alloc_handler(read_memory_,
+            boost::bind(&ChatClient::handle_read_preface, this,
+              boost::asio::placeholders::error)));
+    }
+    else
+    {
+      start_read_header();
     }
   }
 
+  void handle_read_preface(const boost::system::error_code& error)
+  {
+    if (!error && ChatMessage::is_protocol_preface(preface_))
+    {
+      start_read_header();
+    }
+    else
+    {
+      std::cerr << "The server does not speak the binary framing.\n";
+      do_close();
+    }
+  }
+
+  void start_read_header()
+  {
+    boost::asio::async_read(socket_,
+        boost::asio::buffer(read_msg_.header(framing_),
+          ChatMessage::header_size(framing_)),
+        make_alloc_handler(read_memory_,
+          boost::bind(&ChatClient::handle_read_header, this,
+            boost::asio::placeholders::error)));
+  }
+
   void handle_read_header(const boost::system::error_code& error)
   {
-    if (!error && read_msg_.decode_header())
+    if (!error && read_msg_.decode_header(framing_))
     {
       boost::asio::async_read(socket_,
           boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-          boost::bind(&ChatClient::handle_read_body, this,
-            boost::asio::placeholders::error));
+          make_alloc_handler(read_memory_,
+            boost::bind(&ChatClient::handle_read_body, this,
+              boost::asio::placeholders::error)));
     }
     else
     {
@@ -81,12 +135,13 @@ private:
   {
     if (!error)
     {
+      if (read_msg_.room() != ChatMessage::default_room)
+      {
+        std::cout << "[" << read_msg_.room() << "] ";
+      }
       std::cout.write(read_msg_.body(), read_msg_.body_length());
       std::cout << "\n";
-      boost::asio::async_read(socket_,
-          boost::asio::buffer(read_msg_.data(), ChatMessage::header_length),
-          boost::bind(&ChatClient::handle_read_header, this,
-            boost::asio::placeholders::error));
+      start_read_header();
     }
     else
     {
@@ -100,14 +155,24 @@ private:
     write_msgs_.push_back(msg);
     if (!write_in_progress)
     {
-      boost::asio::async_write(socket_,
-          boost::asio::buffer(write_msgs_.front().data(),
-            write_msgs_.front().length()),
-          boost::bind(&ChatClient::handle_write, this,
-            boost::asio::placeholders::error));
+      start_write();
     }
   }
 
+  void start_write()
+  {
+    const ChatMessage&  msg = write_msgs_.front();
+    boost::array< boost::asio::const_buffer, 2 >  buffers = {{
+        boost::asio::buffer(msg.header(framing_),
+          ChatMessage::header_size(framing_)),
+        boost::asio::buffer(msg.body(), msg.body_length())
+    }};
+    boost::asio::async_write(socket_, buffers,
+        make_alloc_handler(write_memory_,
+          boost::bind(&ChatClient::handle_write, this,
+            boost::asio::placeholders::error)));
+  }
+
   void handle_write(const boost::system::error_code& error)
   {
     if (!error)
@@ -115,11 +180,7 @@ private:
       write_msgs_.pop_front();
       if (!write_msgs_.empty())
       {
-        boost::asio::async_write(socket_,
-            boost::asio::buffer(write_msgs_.front().data(),
-              write_msgs_.front().length()),
-            boost::bind(&ChatClient::handle_write, this,
-              boost::asio::placeholders::error));
+        start_write();
       }
     }
     else
@@ -136,8 +197,13 @@ private:
 private:
   boost::asio::io_service& io_service_;
   tcp::socket socket_;
+  ChatMessage::Framing  framing_;
+  char  preface_[ChatMessage::preface_length];
   ChatMessage read_msg_;
   chatMessageQueue_t write_msgs_;
+  /// One read and one write in flight at a time.
+  ChatHandlerMemory  read_memory_;
+  ChatHandlerMemory  write_memory_;
 };
 
 
@@ -147,30 +213,78 @@ int main(int argc, char* argv[])
 {
   try
   {
-    if (argc != 3)
+    ChatMessage::Framing  framing = ChatMessage::binary_framing;
+    int  first_arg = 1;
+    if ((argc > 1) && (std::string(argv[1]) == "--legacy"))
+    {
+      framing = ChatMessage::legacy_framing;
+      first_arg = 2;
+    }
+
+    if (argc != first_arg + 2)
     {
-      std::cerr << "Usage: ChatClient <host> <port>\n";
+      std::cerr << "Usage: ChatClient [--legacy] <host> <port>\n";
       return 1;
     }
 
     boost::asio::io_service io_service;
 
     tcp::resolver resolver(io_service);
-    tcp::resolver::query query(argv[1], argv[2]);
+    tcp::resolver::query query(argv[first_arg], argv[first_arg + 1]);
     tcp::resolver::iterator iterator = resolver.resolve(query);
 
-    ChatClient c(io_service, iterator);
+    ChatClient c(io_service, iterator, framing);
 
     boost::thread t(boost::bind(&boost::asio::io_service::run, &io_service));
 
+    // With the binary framing "/join <room>" and "/leave <room>" manage
+    // subscriptions and "/room <room>" selects where lines are published.
+    // "/history [<first>] <count>" replays messages of the selected room,
+    // the last <count> ones without <first>.
+    boost::uint32_t  room = ChatMessage::default_room;
     char line[ChatMessage::max_body_length + 1];
     while (std::cin.getline(line, ChatMessage::max_body_length + 1))
     {
-      using namespace std; // For strlen and memcpy.
+      using namespace std; // For strlen, strncmp, memcpy, strtoul and strtoull.
       ChatMessage msg;
-      msg.body_length(strlen(line));
-      memcpy(msg.body(), line, msg.body_length());
-      msg.encode_header();
+      msg.room(room);
+      if ((framing == ChatMessage::binary_framing) && (line[0] == '/'))
+      {
+        const boost::uint32_t  id = strtoul(strchr(line, ' ')
+            ? strchr(line, ' ') : "0", 0, 10);
+        if (strncmp(line, "/join ", 6) == 0)
+        {
+          msg.type(ChatMessage::type_join);
+          msg.room(id);
+        }
+        else if (strncmp(line, "/leave ", 7) == 0)
+        {
+          msg.type(ChatMessage::type_leave);
+          msg.room(id);
+        }
+        else if (strncmp(line, "/room ", 6) == 0)
+        {
+          room = id;
+          continue;
+        }
+        else if (strncmp(line, "/history ", 9) == 0)
+        {
+          char*  end;
+          const unsigned long long  first = strtoull(line + 9, &end, 10);
+          const unsigned long  count = strtoul(end, 0, 10);
+          if (count > 0)
+            msg.encode_history_request(first, boost::uint32_t(count));
+          else
+            msg.encode_history_request(ChatMessage::latest_history(),
+                boost::uint32_t(first));
+        }
+      }
+      if (msg.type() == ChatMessage::type_publish)
+      {
+        msg.body_length(strlen(line));
+        memcpy(msg.body(), line, msg.body_length());
+      }
+      msg.encode_header(framing);
       c.write(msg);
     }
 
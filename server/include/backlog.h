@@ -0,0 +1,167 @@
+//
+// backlog.h
+// ~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_BACKLOG_HPP
+#define CHAT_BACKLOG_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/shared_ptr.hpp>
+#include "message.h"
+
+
+/**
+* Frames of a room's recent messages in one framing, back to back as
+* they go on the wire. Immutable: every participant joining meanwhile
+* gets the same snapshot and writes it with a single buffer.
+*/
+class ChatBacklog
+  : private boost::noncopyable
+{
+public:
+  ChatBacklog(const boost::shared_array< char >& arena, const char* data,
+      std::size_t size, std::size_t count)
+    : arena_(arena),
+      data_(data),
+      size_(size),
+      count_(count)
+  {
+  }
+
+  const char* data() const
+  {
+    return data_;
+  }
+
+  std::size_t size() const
+  {
+    return size_;
+  }
+
+  /// Messages in the snapshot.
+  std::size_t count() const
+  {
+    return count_;
+  }
+
+private:
+  /// Keeps the bytes alive after the room moved on to another arena.
+  const boost::shared_array< char >  arena_;
+  const char* const  data_;
+  const std::size_t  size_;
+  const std::size_t  count_;
+};
+
+typedef boost::shared_ptr< const ChatBacklog >  chatBacklogPTR;
+
+
+
+
+/**
+* Keeps the recent messages of a room serialized in one framing, updated
+* as messages come and go, so a join costs no copy.
+*
+* The frames live in an arena: a new message is copied to its end and
+* dropping the oldest only moves the start, so bytes once written never
+* change and snapshots share the arena instead of copying it. When the
+* end is reached the live frames move to a new arena twice their size,
+* or back to the start of this one if no snapshot holds it any more and
+* they fill half of it at most: a room in its steady state allocates
+* nothing.
+* A snapshot is made on the first request after a change and handed out
+* until the next one.
+*/
+class ChatBacklogBuilder
+  : private boost::noncopyable
+{
+public:
+  enum { min_arena_size = 16 * 1024 };
+
+  explicit ChatBacklogBuilder(ChatMessage::Framing framing)
+    : framing_(framing),
+      capacity_(0),
+      begin_(0),
+      end_(0),
+      count_(0)
+  {
+  }
+
+  void push_back(const ChatMessage& msg)
+  {
+    const std::size_t  header_size = ChatMessage::header_size(framing_);
+    const std::size_t  body_length = msg.body_length(framing_);
+    snapshot_.reset();
+    if (end_ + header_size + body_length > capacity_)
+    {
+      grow(header_size + body_length);
+    }
+    std::memcpy(arena_.get() + end_, msg.header(framing_), header_size);
+    std::memcpy(arena_.get() + end_ + header_size, msg.body(), body_length);
+    end_ += header_size + body_length;
+    ++count_;
+  }
+
+  /// Drops the oldest message, which must be 'msg'.
+  void pop_front(const ChatMessage& msg)
+  {
+    begin_ += msg.length(framing_);
+    --count_;
+    snapshot_.reset();
+  }
+
+  const chatBacklogPTR& snapshot()
+  {
+    if (!snapshot_)
+    {
+      snapshot_ = boost::make_shared< ChatBacklog >(arena_,
+          arena_.get() + begin_, end_ - begin_, count_);
+    }
+    return snapshot_;
+  }
+
+private:
+  /// Moves the live frames to an arena with room for 'length' more.
+  void grow(std::size_t length)
+  {
+    const std::size_t  live = end_ - begin_;
+    if (arena_.unique() && (2 * (live + length) <= capacity_))
+    {
+      std::memmove(arena_.get(), arena_.get() + begin_, live);
+    }
+    else
+    {
+      const std::size_t  capacity =
+          std::max< std::size_t >(min_arena_size, 2 * (live + length));
+      const boost::shared_array< char >  arena(new char[capacity]);
+      if (live > 0)
+      {
+        std::memcpy(arena.get(), arena_.get() + begin_, live);
+      }
+      arena_ = arena;
+      capacity_ = capacity;
+    }
+    begin_ = 0;
+    end_ = live;
+  }
+
+private:
+  const ChatMessage::Framing  framing_;
+  boost::shared_array< char >  arena_;
+  std::size_t  capacity_;
+  std::size_t  begin_;
+  std::size_t  end_;
+  std::size_t  count_;
+  chatBacklogPTR  snapshot_;
+};
+
+#endif // CHAT_BACKLOG_HPP
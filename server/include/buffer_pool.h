@@ -0,0 +1,342 @@
+//
+// buffer_pool.h
+// ~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_BUFFER_POOL_HPP
+#define CHAT_BUFFER_POOL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+
+/**
+* Slab allocator with power-of-two size classes from 64 bytes to 64 KiB.
+*
+* Freed buffers go back to the free list of their class and are never
+* returned to the system, so once the working set has been reached the
+* server runs without malloc/free. Requests above max_buffer_size bypass
+* the pool.
+*
+* Each thread keeps a cache of free buffers per class, up to cache_size
+* bytes of them, and takes the lock of a class only to fetch half that
+* from it when its cache is empty or to give half back when it is full.
+* A buffer freed on another thread than the one which allocated it so
+* returns to the class in batches. A thread's cache goes back to the
+* classes when the thread ends.
+*/
+class ChatBufferPool
+  : private boost::noncopyable
+{
+public:
+  enum { min_buffer_size = 64 };
+  enum { class_count = 11 };
+  enum { max_buffer_size = min_buffer_size << (class_count - 1) };
+
+  /// Memory requested from the system at once when a class runs dry.
+  enum { slab_size = 256 * 1024 };
+
+  /// Free buffers of one class a thread keeps, in bytes.
+  enum { cache_size = 64 * 1024 };
+
+  static ChatBufferPool& instance()
+  {
+    static ChatBufferPool pool;
+    return pool;
+  }
+
+  ~ChatBufferPool()
+  {
+    for (std::vector< void* >::const_iterator itr = slabs_.begin();
+         itr != slabs_.end(); ++itr)
+    {
+      ::operator delete(*itr);
+    }
+  }
+
+  /// Size of the buffer which is really handed out for 'size' bytes.
+  static std::size_t capacity(std::size_t size)
+  {
+    return (size > max_buffer_size)
+        ? size
+        : (std::size_t(min_buffer_size) << class_index(size));
+  }
+
+  void* allocate(std::size_t size)
+  {
+    if (size > max_buffer_size)
+    {
+      return ::operator new(size);
+    }
+
+    const std::size_t  index = class_index(size);
+    ThreadCache&  thread = thread_cache();
+    FreeList&  cache = thread.lists[index];
+    if (!cache.head)
+    {
+      fetch(index, cache, std::max< std::size_t >(
+          cache_limit(index, thread) / 2, 1));
+    }
+    FreeNode*  node = cache.head;
+    cache.head = node->next;
+    --cache.count;
+    return node;
+  }
+
+  void deallocate(void* p, std::size_t size)
+  {
+    if (!p)
+    {
+      return;
+    }
+
+    if (size > max_buffer_size)
+    {
+      ::operator delete(p);
+      return;
+    }
+
+    const std::size_t  index = class_index(size);
+    ThreadCache&  thread = thread_cache();
+    FreeList&  cache = thread.lists[index];
+    FreeNode*  node = static_cast< FreeNode* >(p);
+    node->next = cache.head;
+    cache.head = node;
+    const std::size_t  limit = cache_limit(index, thread);
+    if (++cache.count > limit)
+    {
+      give_back(index, cache, cache.count - limit / 2);
+    }
+  }
+
+  /**
+  * Makes sure 'count' buffers for 'size' bytes are free in the class,
+  * besides those the threads keep, so that many
+  * allocations of that size are served without going to the system.
+  */
+  void reserve(std::size_t size, std::size_t count)
+  {
+    if (size > max_buffer_size)
+    {
+      return;
+    }
+
+    SizeClass&  sc = classes_[class_index(size)];
+    boost::mutex::scoped_lock  lock(sc.mutex);
+    while (sc.free_count < count)
+    {
+      refill(sc, capacity(size));
+    }
+  }
+
+private:
+  struct FreeNode
+  {
+    FreeNode*  next;
+  };
+
+  struct SizeClass
+  {
+    SizeClass() : head(0), free_count(0) {}
+    boost::mutex  mutex;
+    FreeNode*  head;
+    std::size_t  free_count;
+  };
+
+  /// Free buffers of one class in a thread's cache.
+  struct FreeList
+  {
+    FreeNode*  head;
+    std::size_t  count;
+  };
+
+  /**
+  * Zero-initialized and never destroyed, so buffers freed by destructors
+  * running after the thread's cache was closed still find it; they go
+  * straight back to their class.
+  */
+  struct ThreadCache
+  {
+    FreeList  lists[class_count];
+    bool  closed;
+  };
+
+  /// Gives a thread's cache back when the thread ends.
+  struct ThreadCacheCloser
+  {
+    ~ThreadCacheCloser()
+    {
+      ThreadCache&  thread = thread_cache();
+      thread.closed = true;
+      for (std::size_t i = 0; i < class_count; ++i)
+      {
+        instance().give_back(i, thread.lists[i], thread.lists[i].count);
+      }
+    }
+  };
+
+  ChatBufferPool()
+  {
+  }
+
+  static std::size_t class_index(std::size_t size)
+  {
+    std::size_t  index = 0;
+    std::size_t  class_size = min_buffer_size;
+    while (class_size < size)
+    {
+      class_size <<= 1;
+      ++index;
+    }
+    return index;
+  }
+
+  static ThreadCache& thread_cache()
+  {
+    static thread_local ThreadCache  cache;
+    static thread_local ThreadCacheCloser  closer;
+    (void)closer;
+    return cache;
+  }
+
+  /// Buffers of class 'index' the thread keeps at most.
+  static std::size_t cache_limit(std::size_t index, const ThreadCache& thread)
+  {
+    if (thread.closed)
+    {
+      return 0;
+    }
+    const std::size_t  limit = cache_size / (min_buffer_size << index);
+    return (limit < 2) ? 2 : limit;
+  }
+
+  /// Moves 'count' buffers of class 'index' to the empty 'cache'.
+  void fetch(std::size_t index, FreeList& cache, std::size_t count)
+  {
+    SizeClass&  sc = classes_[index];
+    boost::mutex::scoped_lock  lock(sc.mutex);
+    for (std::size_t n = count; n > 0; --n)
+    {
+      if (!sc.head)
+      {
+        refill(sc, std::size_t(min_buffer_size) << index);
+      }
+      FreeNode*  node = sc.head;
+      sc.head = node->next;
+      --sc.free_count;
+      node->next = cache.head;
+      cache.head = node;
+      ++cache.count;
+    }
+  }
+
+  /// Moves the first 'count' buffers of 'cache' to class 'index'.
+  void give_back(std::size_t index, FreeList& cache, std::size_t count)
+  {
+    if (count == 0)
+    {
+      return;
+    }
+    FreeNode*  first = cache.head;
+    FreeNode*  last = first;
+    for (std::size_t n = 1; n < count; ++n)
+    {
+      last = last->next;
+    }
+    cache.head = last->next;
+    cache.count -= count;
+
+    SizeClass&  sc = classes_[index];
+    boost::mutex::scoped_lock  lock(sc.mutex);
+    last->next = sc.head;
+    sc.head = first;
+    sc.free_count += count;
+  }
+
+  /// Called with sc.mutex held.
+  void refill(SizeClass& sc, std::size_t buffer_size)
+  {
+    char*  slab = static_cast< char* >(::operator new(slab_size));
+    {
+      boost::mutex::scoped_lock  lock(slabs_mutex_);
+      slabs_.push_back(slab);
+    }
+    for (std::size_t offset = 0; offset + buffer_size <= slab_size;
+         offset += buffer_size)
+    {
+      FreeNode*  node = reinterpret_cast< FreeNode* >(slab + offset);
+      node->next = sc.head;
+      sc.head = node;
+      ++sc.free_count;
+    }
+  }
+
+private:
+  SizeClass  classes_[class_count];
+  boost::mutex  slabs_mutex_;
+  std::vector< void* >  slabs_;
+};
+
+
+
+
+/**
+* Standard allocator drawing from ChatBufferPool. Used for shared_ptr
+* control blocks and queue nodes which are created for every message.
+*/
+template< typename T >
+class ChatPoolAllocator
+{
+public:
+  typedef T  value_type;
+  typedef T*  pointer;
+  typedef const T*  const_pointer;
+  typedef T&  reference;
+  typedef const T&  const_reference;
+  typedef std::size_t  size_type;
+  typedef std::ptrdiff_t  difference_type;
+
+  template< typename U >
+  struct rebind
+  {
+    typedef ChatPoolAllocator< U >  other;
+  };
+
+  ChatPoolAllocator() {}
+
+  template< typename U >
+  ChatPoolAllocator(const ChatPoolAllocator< U >&) {}
+
+  T* allocate(std::size_t n)
+  {
+    return static_cast< T* >(
+        ChatBufferPool::instance().allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n)
+  {
+    ChatBufferPool::instance().deallocate(p, n * sizeof(T));
+  }
+
+  template< typename U >
+  bool operator==(const ChatPoolAllocator< U >&) const
+  {
+    return true;
+  }
+
+  template< typename U >
+  bool operator!=(const ChatPoolAllocator< U >&) const
+  {
+    return false;
+  }
+};
+
+#endif // CHAT_BUFFER_POOL_HPP
@@ -0,0 +1,329 @@
+//
+// compression.h
+// ~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_COMPRESSION_HPP
+#define CHAT_COMPRESSION_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#if defined(CHAT_DEFLATE)
+#include <zlib.h>
+#endif
+#include "message.h"
+
+
+/**
+* Compression of room traffic for the clients that ask for it
+* (ChatMessage::hello_deflate); off with level 0.
+*/
+struct ChatCompressionSettings
+{
+  ChatCompressionSettings()
+    : level(0),
+      dictionary_size(8 * 1024),
+      retrain_interval(4096)
+  {
+  }
+
+  bool enabled() const
+  {
+    return level > 0;
+  }
+
+  /// zlib level, 1 (fastest) to 9.
+  int  level;
+  /// Longest preset dictionary of a room, bytes; at most window_size.
+  std::size_t  dictionary_size;
+  /// Messages of a room between two dictionaries.
+  std::size_t  retrain_interval;
+};
+
+//----------------------------------------------------------------------
+
+/**
+* Deflates messages one at a time, each as a raw deflate stream of its
+* own made with the same preset dictionary, so any of them can be
+* inflated alone by a client that has the dictionary.
+*
+* Setting the dictionary of a fresh stream costs in proportion to its
+* size, so it is set once, on a primed stream, and each message is
+* deflated by a copy of that stream. The window is sized to the
+* dictionary: messages are short and the dictionary is all there is to
+* refer back to. zlib takes the memory of both streams from the
+* deflater's Blocks, which keep what deflateEnd() frees for the next
+* copy: after the first message, deflating one takes nothing from the
+* heap.
+*
+* Built without CHAT_DEFLATE (zlib), nothing is ever compressed.
+*
+* Not thread-safe: a room uses its deflater on its home strand only.
+*/
+class ChatDeflater
+  : private boost::noncopyable
+{
+public:
+  /// Raw deflate streams refer back at most this far.
+  enum { window_bits = 13 };
+  enum { window_size = 1 << window_bits };
+
+  /// Shorter bodies are not worth a try.
+  enum { min_length = 32 };
+
+#if defined(CHAT_DEFLATE)
+  explicit ChatDeflater(int level)
+    : level_(level),
+      primed_valid_(false)
+  {
+    dictionary(0, 0);
+  }
+
+  ~ChatDeflater()
+  {
+    if (primed_valid_)
+    {
+      deflateEnd(&primed_);
+    }
+  }
+
+  /// Deflates the messages from here on with these bytes preset.
+  void dictionary(const char* data, std::size_t length)
+  {
+    if (primed_valid_)
+    {
+      deflateEnd(&primed_);
+    }
+    std::memset(&primed_, 0, sizeof(primed_));
+    // deflateCopy() passes the allocator on to the copies.
+    primed_.zalloc = &Blocks::allocate;
+    primed_.zfree = &Blocks::free;
+    primed_.opaque = &blocks_;
+    primed_valid_ = (deflateInit2(&primed_, level_, Z_DEFLATED,
+        -int(window_bits), mem_level, Z_DEFAULT_STRATEGY) == Z_OK);
+    if (primed_valid_ && (length > 0))
+    {
+      deflateSetDictionary(&primed_,
+          reinterpret_cast< const Bytef* >(data), uInt(length));
+    }
+  }
+
+  /**
+  * Makes 'out' the message with its body deflated and flag_deflate set.
+  * Returns false, leaving 'out' undefined, unless that is shorter.
+  */
+  bool compress(const ChatMessage& msg, ChatMessage& out)
+  {
+    const std::size_t  length = msg.body_length();
+    if (!primed_valid_ || (length < min_length))
+    {
+      return false;
+    }
+    z_stream  stream;
+    if (deflateCopy(&stream, &primed_) != Z_OK)
+    {
+      return false;
+    }
+    out.body_length(length - 1);
+    stream.next_in = reinterpret_cast< Bytef* >(
+        const_cast< char* >(msg.body()));
+    stream.avail_in = uInt(length);
+    stream.next_out = reinterpret_cast< Bytef* >(out.body());
+    stream.avail_out = uInt(length - 1);
+    const bool  done = (deflate(&stream, Z_FINISH) == Z_STREAM_END);
+    const std::size_t  compressed = length - 1 - stream.avail_out;
+    deflateEnd(&stream);
+    if (!done)
+    {
+      return false;
+    }
+    out.body_length(compressed);
+    out.type(msg.type());
+    out.flags(msg.flags() | ChatMessage::flag_deflate);
+    out.room(msg.room());
+    out.encode_headers();
+    return true;
+  }
+
+private:
+  /// Small hash chains: the input of one call is short.
+  enum { mem_level = 4 };
+
+  /**
+  * zlib's allocator: a block freed is kept and handed out again for a
+  * request of the same size. A stream takes a handful of blocks, so the
+  * primed stream and a copy fit in max_blocks.
+  */
+  class Blocks
+    : private boost::noncopyable
+  {
+  public:
+    Blocks()
+      : count_(0)
+    {
+    }
+
+    ~Blocks()
+    {
+      for (std::size_t i = 0; i < count_; ++i)
+      {
+        ::operator delete(blocks_[i].data);
+      }
+    }
+
+    static voidpf allocate(voidpf opaque, uInt items, uInt size)
+    {
+      return static_cast< Blocks* >(opaque)->take(std::size_t(items) * size);
+    }
+
+    static void free(voidpf opaque, voidpf address)
+    {
+      static_cast< Blocks* >(opaque)->give_back(address);
+    }
+
+  private:
+    /// Z_NULL, which zlib reports as Z_MEM_ERROR, once all are taken.
+    void* take(std::size_t size)
+    {
+      for (std::size_t i = 0; i < count_; ++i)
+      {
+        if (!blocks_[i].used && (blocks_[i].size == size))
+        {
+          blocks_[i].used = true;
+          return blocks_[i].data;
+        }
+      }
+      if (count_ == max_blocks)
+      {
+        return Z_NULL;
+      }
+      Block&  block = blocks_[count_];
+      block.data = ::operator new(size, std::nothrow);
+      if (!block.data)
+      {
+        return Z_NULL;
+      }
+      block.size = size;
+      block.used = true;
+      ++count_;
+      return block.data;
+    }
+
+    void give_back(void* data)
+    {
+      for (std::size_t i = 0; i < count_; ++i)
+      {
+        if (blocks_[i].data == data)
+        {
+          blocks_[i].used = false;
+          return;
+        }
+      }
+    }
+
+  private:
+    enum { max_blocks = 16 };
+
+    struct Block
+    {
+      void*  data;
+      std::size_t  size;
+      bool  used;
+    };
+
+    Block  blocks_[max_blocks];
+    std::size_t  count_;
+  };
+
+  const int  level_;
+  /// Declared before the streams, whose blocks it holds.
+  Blocks  blocks_;
+  z_stream  primed_;
+  bool  primed_valid_;
+#else
+  explicit ChatDeflater(int)
+  {
+  }
+
+  void dictionary(const char*, std::size_t)
+  {
+  }
+
+  bool compress(const ChatMessage&, ChatMessage&)
+  {
+    return false;
+  }
+#endif
+
+public:
+  /**
+  * Builds a dictionary of at most max_length bytes from the bodies of
+  * the messages [first, last), a range of ChatMessage pointers, oldest
+  * first. Deflate finds the end of the dictionary at the shortest
+  * distances, so the newest bodies go last; a body seen more than once
+  * goes in once.
+  */
+  template< typename Iterator >
+  static void train(Iterator first, Iterator last, std::size_t max_length,
+      std::string& dictionary)
+  {
+    if (max_length > std::size_t(window_size))
+    {
+      max_length = window_size;
+    }
+    std::vector< const ChatMessage* >  picked;
+    std::size_t  length = 0;
+    while ((first != last) && (length < max_length))
+    {
+      const ChatMessage&  msg = **--last;
+      if ((msg.flags() & ChatMessage::flag_deflate)
+          || (msg.body_length() < std::size_t(min_length))
+          || seen(picked, msg))
+      {
+        continue;
+      }
+      picked.push_back(&msg);
+      length += msg.body_length();
+    }
+
+    dictionary.clear();
+    dictionary.reserve(std::min(length, max_length));
+    for (std::size_t i = picked.size(); i > 0; --i)
+    {
+      const ChatMessage&  msg = *picked[i - 1];
+      dictionary.append(msg.body(), msg.body_length());
+    }
+    if (dictionary.size() > max_length)
+    {
+      // The oldest body is cut from the front.
+      dictionary.erase(0, dictionary.size() - max_length);
+    }
+  }
+
+private:
+  static bool seen(const std::vector< const ChatMessage* >& picked,
+      const ChatMessage& msg)
+  {
+    for (std::size_t i = 0; i < picked.size(); ++i)
+    {
+      if ((picked[i]->body_length() == msg.body_length())
+          && (std::memcmp(picked[i]->body(), msg.body(),
+                msg.body_length()) == 0))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+#endif // CHAT_COMPRESSION_HPP
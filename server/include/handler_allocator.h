@@ -0,0 +1,321 @@
+//
+// handler_allocator.h
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// @source http://www.boost.org/doc/libs/1_74_0/doc/html/boost_asio/example/cpp11/allocation/server.cpp
+
+
+#ifndef CHAT_HANDLER_ALLOCATOR_HPP
+#define CHAT_HANDLER_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/noncopyable.hpp>
+#include "buffer_pool.h"
+
+
+/**
+* Memory for the state of one asynchronous operation at a time.
+*
+* An object that never has more than one operation of a kind in flight
+* (a session's read, its write, a listener's accept) keeps one of these
+* per kind: Asio then builds every operation of that kind in the same
+* block instead of on the heap. A second, small block takes what a strand
+* allocates with the same allocator while the operation is alive (its
+* invoker), or an operation small enough. A request which does not fit,
+* or arrives while the blocks are taken, falls back to operator new.
+*
+* The blocks are taken from ChatBufferPool on first use and kept until
+* release(), so an object whose I/O has gone quiet can give them back.
+*/
+class ChatHandlerMemory
+  : private boost::noncopyable
+{
+public:
+  enum { size = 1024 };
+  enum { small_size = 128 };
+
+  ChatHandlerMemory()
+    : storage_(0),
+      small_storage_(0),
+      in_use_(false),
+      small_in_use_(false)
+  {
+  }
+
+  ~ChatHandlerMemory()
+  {
+    release();
+  }
+
+  void* allocate(std::size_t length)
+  {
+    if (!small_in_use_ && (length <= small_size))
+    {
+      small_in_use_ = true;
+      return take(small_storage_, small_size);
+    }
+    if (!in_use_ && (length <= size))
+    {
+      in_use_ = true;
+      return take(storage_, size);
+    }
+    return ::operator new(length);
+  }
+
+  void deallocate(void* pointer)
+  {
+    if (pointer && (pointer == small_storage_))
+    {
+      small_in_use_ = false;
+    }
+    else if (pointer && (pointer == storage_))
+    {
+      in_use_ = false;
+    }
+    else
+    {
+      ::operator delete(pointer);
+    }
+  }
+
+  /**
+  * Returns the blocks no operation is in to the pool. Must not race with
+  * allocate(): call it from where the operations are started.
+  */
+  void release()
+  {
+    if (!small_in_use_)
+    {
+      give_back(small_storage_, small_size);
+    }
+    if (!in_use_)
+    {
+      give_back(storage_, size);
+    }
+  }
+
+private:
+  static void* take(void*& block, std::size_t length)
+  {
+    if (!block)
+    {
+      block = ChatBufferPool::instance().allocate(length);
+    }
+    return block;
+  }
+
+  static void give_back(void*& block, std::size_t length)
+  {
+    ChatBufferPool::instance().deallocate(block, length);
+    block = 0;
+  }
+
+private:
+  void*  storage_;
+  void*  small_storage_;
+  bool  in_use_;
+  bool  small_in_use_;
+};
+
+
+
+
+/**
+* Standard allocator over ChatHandlerMemory, which is what Asio asks a
+* handler for through get_allocator().
+*/
+template< typename T >
+class ChatHandlerAllocator
+{
+public:
+  typedef T  value_type;
+
+  explicit ChatHandlerAllocator(ChatHandlerMemory& memory)
+    : memory_(&memory)
+  {
+  }
+
+  template< typename U >
+  ChatHandlerAllocator(const ChatHandlerAllocator< U >& other)
+    : memory_(other.memory_)
+  {
+  }
+
+  T* allocate(std::size_t n) const
+  {
+    return static_cast< T* >(memory_->allocate(sizeof(T) * n));
+  }
+
+  void deallocate(T* pointer, std::size_t /*n*/) const
+  {
+    memory_->deallocate(pointer);
+  }
+
+  bool operator==(const ChatHandlerAllocator& other) const
+  {
+    return memory_ == other.memory_;
+  }
+
+  bool operator!=(const ChatHandlerAllocator& other) const
+  {
+    return memory_ != other.memory_;
+  }
+
+private:
+  template< typename > friend class ChatHandlerAllocator;
+
+  ChatHandlerMemory*  memory_;
+};
+
+
+
+
+/**
+* Completion handler carrying the allocator of its memory. Wrap it in
+* bind_executor(), not the other way round, so the executor stays
+* visible to Asio.
+*/
+template< typename Handler >
+class ChatAllocHandler
+{
+public:
+  typedef ChatHandlerAllocator< Handler >  allocator_type;
+
+  ChatAllocHandler(ChatHandlerMemory& memory, const Handler& handler)
+    : memory_(memory),
+      handler_(handler)
+  {
+  }
+
+  ChatAllocHandler(ChatHandlerMemory& memory, Handler&& handler)
+    : memory_(memory),
+      handler_(std::move(handler))
+  {
+  }
+
+  allocator_type get_allocator() const
+  {
+    return allocator_type(memory_);
+  }
+
+  template< typename... Args >
+  void operator()(Args&&... args)
+  {
+    handler_(std::forward< Args >(args)...);
+  }
+
+private:
+  ChatHandlerMemory&  memory_;
+  Handler  handler_;
+};
+
+template< typename Handler >
+inline ChatAllocHandler< Handler > make_alloc_handler(
+    ChatHandlerMemory& memory, const Handler& handler)
+{
+  return ChatAllocHandler< Handler >(memory, handler);
+}
+
+
+
+
+/**
+* Completion token for what 'Token' makes a handler of, e.g. a coroutine
+* resumed by use_awaitable: that handler is wrapped in a ChatAllocHandler
+* on its own executor, so the operation is built in 'memory' too.
+*/
+template< typename Token >
+class ChatAllocToken
+{
+public:
+  ChatAllocToken(ChatHandlerMemory& memory, const Token& token)
+    : memory_(memory),
+      token_(token)
+  {
+  }
+
+  ChatHandlerMemory& memory() const
+  {
+    return memory_;
+  }
+
+  Token& token()
+  {
+    return token_;
+  }
+
+private:
+  ChatHandlerMemory&  memory_;
+  Token  token_;
+};
+
+template< typename Token >
+inline ChatAllocToken< Token > make_alloc_token(ChatHandlerMemory& memory,
+    const Token& token)
+{
+  return ChatAllocToken< Token >(memory, token);
+}
+
+/// Passes the operation a handler carrying the allocator of 'memory'.
+template< typename Initiation >
+class ChatAllocInitiation
+{
+public:
+  ChatAllocInitiation(ChatHandlerMemory& memory, Initiation&& initiation)
+    : memory_(memory),
+      initiation_(std::move(initiation))
+  {
+  }
+
+  template< typename Handler, typename... Args >
+  void operator()(Handler&& handler, Args&&... args)
+  {
+    typedef typename std::decay< Handler >::type  handler_t;
+    const typename boost::asio::associated_executor< handler_t >::type
+        executor = boost::asio::get_associated_executor(handler);
+    std::move(initiation_)(boost::asio::bind_executor(executor,
+          ChatAllocHandler< handler_t >(memory_,
+            std::forward< Handler >(handler))),
+        std::forward< Args >(args)...);
+  }
+
+private:
+  ChatHandlerMemory&  memory_;
+  Initiation  initiation_;
+};
+
+namespace boost {
+namespace asio {
+
+template< typename Token, typename Signature >
+class async_result< ChatAllocToken< Token >, Signature >
+{
+public:
+  typedef typename async_result< Token, Signature >::return_type
+      return_type;
+
+  template< typename Initiation, typename... Args >
+  static return_type initiate(Initiation&& initiation,
+      ChatAllocToken< Token > token, Args&&... args)
+  {
+    typedef typename std::decay< Initiation >::type  initiation_t;
+    return async_initiate< Token, Signature >(
+        ChatAllocInitiation< initiation_t >(token.memory(),
+          initiation_t(std::forward< Initiation >(initiation))),
+        token.token(), std::forward< Args >(args)...);
+  }
+};
+
+} // namespace asio
+} // namespace boost
+
+#endif // CHAT_HANDLER_ALLOCATOR_HPP
@@ -0,0 +1,177 @@
+//
+// histogram.h
+// ~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_HISTOGRAM_HPP
+#define CHAT_HISTOGRAM_HPP
+
+#include <cstddef>
+#include <boost/cstdint.hpp>
+
+
+/**
+* HDR-style log-linear histogram of 64-bit values (latencies in ns).
+*
+* Values below sub_bucket_count are counted exactly; above, every power of
+* two is split into sub_bucket_count linear buckets, so any recorded
+* value is reported within 1 / sub_bucket_count (about 3%) of itself.
+* Recording is an index computation and an increment; histograms of
+* different threads are combined with merge().
+*/
+class ChatHistogram
+{
+public:
+  enum { sub_bucket_bits = 5 };
+  enum { sub_bucket_count = 1 << sub_bucket_bits };
+  enum { bucket_count = (64 - sub_bucket_bits + 1) * sub_bucket_count };
+
+  ChatHistogram()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+      counts_[i] = 0;
+    }
+    total_ = 0;
+    sum_ = 0;
+    max_ = 0;
+  }
+
+  void record(boost::uint64_t value)
+  {
+    ++counts_[index_of(value)];
+    ++total_;
+    sum_ += value;
+    if (value > max_)
+    {
+      max_ = value;
+    }
+  }
+
+  void merge(const ChatHistogram& other)
+  {
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+      counts_[i] += other.counts_[i];
+    }
+    total_ += other.total_;
+    sum_ += other.sum_;
+    if (other.max_ > max_)
+    {
+      max_ = other.max_;
+    }
+  }
+
+  boost::uint64_t count() const
+  {
+    return total_;
+  }
+
+  boost::uint64_t sum() const
+  {
+    return sum_;
+  }
+
+  boost::uint64_t max() const
+  {
+    return max_;
+  }
+
+  double mean() const
+  {
+    return (total_ == 0) ? 0.0 : double(sum_) / double(total_);
+  }
+
+  /// Value below which the given fraction (0..1) of the records fall.
+  boost::uint64_t percentile(double fraction) const
+  {
+    if (total_ == 0)
+    {
+      return 0;
+    }
+    boost::uint64_t  rank =
+        static_cast< boost::uint64_t >(fraction * double(total_) + 0.5);
+    if (rank == 0)
+    {
+      rank = 1;
+    }
+    boost::uint64_t  seen = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+      seen += counts_[i];
+      if (seen >= rank)
+      {
+        const boost::uint64_t  value = highest_of(i);
+        return (value < max_) ? value : max_;
+      }
+    }
+    return max_;
+  }
+
+  /// Number of records up to and including 'value' (Prometheus buckets).
+  boost::uint64_t count_below(boost::uint64_t value) const
+  {
+    const std::size_t  last = index_of(value);
+    boost::uint64_t  seen = 0;
+    for (std::size_t i = 0; i <= last; ++i)
+    {
+      seen += counts_[i];
+    }
+    return seen;
+  }
+
+  static std::size_t index_of(boost::uint64_t value)
+  {
+    if (value < boost::uint64_t(sub_bucket_count))
+    {
+      return std::size_t(value);
+    }
+    const unsigned  shift = most_significant_bit(value) - sub_bucket_bits;
+    return std::size_t((shift + 1) * sub_bucket_count
+        + ((value >> shift) - sub_bucket_count));
+  }
+
+  /// Highest value counted in the bucket.
+  static boost::uint64_t highest_of(std::size_t index)
+  {
+    if (index < std::size_t(sub_bucket_count))
+    {
+      return index;
+    }
+    const unsigned  shift = unsigned(index / sub_bucket_count - 1);
+    const boost::uint64_t  sub = index % sub_bucket_count + sub_bucket_count;
+    return ((sub + 1) << shift) - 1;
+  }
+
+private:
+  static unsigned most_significant_bit(boost::uint64_t value)
+  {
+#if defined(__GNUC__)
+    return 63u - unsigned(__builtin_clzll(value));
+#else
+    unsigned  bit = 0;
+    while (value >>= 1)
+    {
+      ++bit;
+    }
+    return bit;
+#endif
+  }
+
+private:
+  boost::uint64_t  counts_[bucket_count];
+  boost::uint64_t  total_;
+  boost::uint64_t  sum_;
+  boost::uint64_t  max_;
+};
+
+#endif // CHAT_HISTOGRAM_HPP
@@ -0,0 +1,757 @@
+//
+// history_log.h
+// ~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_HISTORY_LOG_HPP
+#define CHAT_HISTORY_LOG_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include "message.h"
+
+
+/**
+* Where and how durably rooms keep their history.
+*/
+struct ChatHistorySettings
+{
+  ChatHistorySettings()
+    : sync_interval(1000),
+      max_segments(16)
+  {
+  }
+
+  bool enabled() const
+  {
+    return !prefix.empty();
+  }
+
+  /// The files of room N are <prefix>N-<segment>.log and .idx. Empty: the
+  /// rooms keep their recent messages in memory only.
+  std::string  prefix;
+
+  /// Longest time an appended message waits for msync, ms; 0 syncs after
+  /// every batch.
+  long  sync_interval;
+
+  /// Segments a room keeps; the oldest is deleted as a new one starts.
+  /// 0 keeps them all.
+  std::size_t  max_segments;
+};
+
+
+
+
+/**
+* The thread the logs msync on, and open, create and delete their files
+* on, so that an event loop appending to a log never waits for the disk.
+* Jobs run one at a time in the order they were posted. The process
+* waits for what is queued on exit.
+*/
+class ChatHistorySyncer
+  : private boost::noncopyable
+{
+public:
+  static ChatHistorySyncer& instance()
+  {
+    static ChatHistorySyncer  syncer;
+    return syncer;
+  }
+
+  ~ChatHistorySyncer()
+  {
+    pool_.join();
+  }
+
+  template< typename Function >
+  void post(const Function& f)
+  {
+    boost::asio::post(pool_, f);
+  }
+
+private:
+  ChatHistorySyncer()
+    : pool_(1)
+  {
+  }
+
+  boost::asio::thread_pool  pool_;
+};
+
+
+
+
+/**
+* Segments mapped by the logs of the process, at most max_segments. Each
+* takes two of the kernel's vm.max_map_count mappings (65530 by default),
+* which the rest of the process needs some of too.
+*/
+class ChatHistoryMappings
+  : private boost::noncopyable
+{
+public:
+  enum { max_segments = 16384 };
+
+  static ChatHistoryMappings& instance()
+  {
+    static ChatHistoryMappings  mappings;
+    return mappings;
+  }
+
+  /// False when max_segments are mapped already.
+  bool acquire()
+  {
+    std::size_t  count = count_.load(boost::memory_order_relaxed);
+    do
+    {
+      if (count >= max_segments)
+      {
+        return false;
+      }
+    }
+    while (!count_.compare_exchange_weak(count, count + 1,
+          boost::memory_order_relaxed));
+    return true;
+  }
+
+  void release()
+  {
+    count_.fetch_sub(1, boost::memory_order_relaxed);
+  }
+
+  std::size_t size() const
+  {
+    return count_.load(boost::memory_order_relaxed);
+  }
+
+private:
+  ChatHistoryMappings()
+    : count_(0)
+  {
+  }
+
+  boost::atomic< std::size_t >  count_;
+};
+
+
+
+
+/**
+* Append-only message log of one room, in memory-mapped segment files.
+*
+* Messages are numbered from 0 in the order the room delivered them.
+* Segment k holds a run of them in <path>-k.log as records
+*   [0..3]  size of the rest of the record
+*   [4..7]  checksum of the rest of the record
+*   [8..]   binary header and body of the message
+* and, in <path>-k.idx, the end offset of every record, so message n is
+* found without a scan. Both are in host byte order.
+*
+* Appending is a memcpy to the tail of the mapping; the pages reach the
+* disk once sync() has handed them to ChatHistorySyncer, at the latest
+* when max_dirty_bytes are waiting, or whenever the kernel decides. On
+* open the index is checked against the records it points to and
+* completed from the log, so whatever a crash left torn at the tail is
+* dropped; a file shorter than a segment's is an error, and a last
+* segment without a record is deleted.
+*
+* The log creates no file itself. Once wants_segment(), the owner has
+* create_segment() make the next one, sparse at its full size, on
+* ChatHistorySyncer's thread and hands it over with add_spare(); until
+* then append() takes nothing that needs it. A log nothing was ever
+* appended to has no file, and the last segment asks for its successor
+* when half full, so appending does not wait for the disk either.
+*
+* With max_segments, starting a segment deletes the oldest beyond that.
+* <path>.head then records the first segment kept and the sequence
+* number of its first message; both are written on ChatHistorySyncer's
+* thread.
+*
+* Opening reads the files: the owner does it on ChatHistorySyncer's
+* thread too. Otherwise not thread-safe: the room calls it from its
+* strand.
+*/
+class ChatHistoryLog
+  : private boost::noncopyable
+{
+public:
+  enum { segment_size = 16 * 1024 * 1024 };
+  enum { max_segment_msgs = 256 * 1024 };
+  enum { record_header_length = 8 };
+  /// Appended bytes sync() is called for at the latest.
+  enum { max_dirty_bytes = 1024 * 1024 };
+
+  /// Segment files and their mappings; opaque to the owner of the log.
+  struct Segment
+    : private boost::noncopyable
+  {
+    /// Throws when ChatHistoryMappings has no room for it.
+    explicit Segment(std::size_t number_)
+      : number(number_),
+        first(0),
+        count(0)
+    {
+      if (!ChatHistoryMappings::instance().acquire())
+      {
+        throw std::runtime_error("too many mapped history segments");
+      }
+    }
+
+    ~Segment()
+    {
+      ChatHistoryMappings::instance().release();
+    }
+
+    char* data() const
+    {
+      return static_cast< char* >(log.get_address());
+    }
+
+    boost::uint32_t* ends() const
+    {
+      return static_cast< boost::uint32_t* >(index.get_address());
+    }
+
+    /// Of the file names.
+    const std::size_t  number;
+    boost::uint64_t  first;
+    std::size_t  count;
+    boost::interprocess::mapped_region  log;
+    boost::interprocess::mapped_region  index;
+  };
+
+  typedef boost::shared_ptr< Segment >  segmentPTR;
+
+  /**
+  * Opens the log at 'path' as far as it exists, keeping at most
+  * max_segments (0: all).
+  */
+  explicit ChatHistoryLog(const std::string& path,
+      std::size_t max_segments = 0)
+    : path_(path),
+      max_segments_(max_segments),
+      first_segment_(0),
+      tail_(0),
+      end_(0),
+      synced_tail_(0),
+      synced_count_(0)
+  {
+    read_head();
+    for (std::size_t k = first_segment_;
+         file_exists(segment_path(path_, k, ".log")); ++k)
+    {
+      open_segment(k);
+    }
+    // Made for a message which never reached the disk.
+    while (!segments_.empty() && (segments_.back()->count == 0))
+    {
+      remove_segment(path_, segments_.back()->number);
+      segments_.pop_back();
+    }
+    if (!segments_.empty())
+    {
+      const Segment&  last = *segments_.back();
+      tail_ = start_of(last.ends(), last.count);
+      synced_count_ = last.count;
+    }
+    synced_tail_ = tail_;
+  }
+
+  ~ChatHistoryLog()
+  {
+    // An unused spare stays: the log may be open again by now, and the
+    // next open removes an empty last segment.
+    sync();
+  }
+
+  /**
+  * Makes segment k of the log at 'path': creates its files and maps
+  * them. For ChatHistorySyncer's thread.
+  */
+  static segmentPTR create_segment(const std::string& path, std::size_t k)
+  {
+    const segmentPTR  segment = boost::make_shared< Segment >(k);
+    const std::string  log_path = segment_path(path, k, ".log");
+    const std::string  index_path = segment_path(path, k, ".idx");
+    create_file(log_path, segment_size);
+    create_file(index_path, max_segment_msgs * sizeof(boost::uint32_t));
+    map(*segment, log_path, index_path);
+    return segment;
+  }
+
+  const std::string& path() const
+  {
+    return path_;
+  }
+
+  /// Number of the segment to create_segment() next.
+  std::size_t next_segment() const
+  {
+    return first_segment_ + segments_.size();
+  }
+
+  /**
+  * The next segment should be made: the log is empty and a message is to
+  * be appended, or the last segment is half full.
+  */
+  bool wants_segment() const
+  {
+    if (spare_)
+    {
+      return false;
+    }
+    return segments_.empty() || (tail_ >= segment_size / 2)
+        || (segments_.back()->count >= max_segment_msgs / 2);
+  }
+
+  /// Takes the segment made for next_segment().
+  void add_spare(const segmentPTR& segment)
+  {
+    spare_ = segment;
+  }
+
+  /// Sequence number of the oldest message kept.
+  boost::uint64_t begin() const
+  {
+    return segments_.empty() ? end_ : segments_.front()->first;
+  }
+
+  /// Sequence number the next message will get.
+  boost::uint64_t end() const
+  {
+    return end_;
+  }
+
+  /**
+  * Appends a message, or returns false if it does not fit the last
+  * segment and there is no spare one: it is up to the owner to append it
+  * again once add_spare() was called.
+  */
+  bool append(const ChatMessage& msg)
+  {
+    const std::size_t  size =
+        ChatMessage::binary_header_length + msg.body_length();
+    if (segments_.empty()
+        || (tail_ + record_header_length + size > segment_size)
+        || (segments_.back()->count == max_segment_msgs))
+    {
+      if (!spare_)
+      {
+        return false;
+      }
+      roll();
+    }
+
+    Segment&  segment = *segments_.back();
+    char*  record = segment.data() + tail_;
+    char*  payload = record + record_header_length;
+    std::memcpy(payload, msg.header(ChatMessage::binary_framing),
+        ChatMessage::binary_header_length);
+    std::memcpy(payload + ChatMessage::binary_header_length, msg.body(),
+        msg.body_length());
+    const boost::uint32_t  size32 = boost::uint32_t(size);
+    const boost::uint32_t  crc = checksum(payload, size);
+    std::memcpy(record, &size32, sizeof(size32));
+    std::memcpy(record + 4, &crc, sizeof(crc));
+
+    tail_ += record_header_length + size;
+    segment.ends()[segment.count++] = boost::uint32_t(tail_);
+    ++end_;
+    if (tail_ - synced_tail_ >= max_dirty_bytes)
+    {
+      sync();
+    }
+    return true;
+  }
+
+  /// Reads message 'seq' into 'msg'; false if the log does not have it.
+  bool read(boost::uint64_t seq, ChatMessage& msg) const
+  {
+    if ((seq < begin()) || (seq >= end_))
+    {
+      return false;
+    }
+
+    // The last segment whose first message is not after 'seq'.
+    std::size_t  lo = 0;
+    std::size_t  hi = segments_.size();
+    while (hi - lo > 1)
+    {
+      const std::size_t  mid = (lo + hi) / 2;
+      (segments_[mid]->first <= seq) ? (lo = mid) : (hi = mid);
+    }
+    const Segment&  segment = *segments_[lo];
+    const std::size_t  n = std::size_t(seq - segment.first);
+    const char*  record = segment.data() + start_of(segment.ends(), n);
+
+    const char*  payload = record + record_header_length;
+    std::memcpy(msg.header(ChatMessage::binary_framing), payload,
+        ChatMessage::binary_header_length);
+    msg.decode_header(ChatMessage::binary_framing);
+    std::memcpy(msg.body(), payload + ChatMessage::binary_header_length,
+        msg.body_length());
+    msg.encode_headers();
+    return true;
+  }
+
+  /// Something was appended since the last sync().
+  bool dirty() const
+  {
+    return tail_ != synced_tail_;
+  }
+
+  /**
+  * Has what was appended since the last call written to the disk, on
+  * ChatHistorySyncer's thread; returns at once.
+  */
+  void sync()
+  {
+    if (!dirty())
+    {
+      return;
+    }
+    const segmentPTR&  segment = segments_.back();
+    ChatHistorySyncer::instance().post(Flush(segment, synced_tail_, tail_,
+        synced_count_, segment->count));
+    synced_tail_ = tail_;
+    synced_count_ = segment->count;
+  }
+
+private:
+  /// An msync of a segment's new records and index entries. It holds
+  /// the segment, so the mappings outlive it whatever the log does.
+  struct Flush
+  {
+    Flush(const segmentPTR& segment_, std::size_t from_, std::size_t to_,
+        std::size_t first_, std::size_t last_)
+      : segment(segment_),
+        from(from_),
+        to(to_),
+        first(first_),
+        last(last_)
+    {
+    }
+
+    void operator()() const
+    {
+      flush(segment->log, from, to);
+      flush(segment->index, first * sizeof(boost::uint32_t),
+          last * sizeof(boost::uint32_t));
+    }
+
+    segmentPTR  segment;
+    std::size_t  from;
+    std::size_t  to;
+    std::size_t  first;
+    std::size_t  last;
+  };
+
+  static std::string segment_path(const std::string& path, std::size_t k,
+      const char* extension)
+  {
+    char  suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "-%lu",
+        static_cast< unsigned long >(k));
+    return path + suffix + extension;
+  }
+
+  static void remove_segment(const std::string& path, std::size_t k)
+  {
+    // A Flush still queued keeps its mappings until it has run.
+    std::remove(segment_path(path, k, ".log").c_str());
+    std::remove(segment_path(path, k, ".idx").c_str());
+  }
+
+  static bool file_exists(const std::string& path)
+  {
+    std::filebuf  file;
+    return file.open(path.c_str(), std::ios::in | std::ios::binary) != 0;
+  }
+
+  /// Size of an existing file, which mapping beyond would fault on.
+  static std::size_t file_size(const std::string& path)
+  {
+    std::filebuf  file;
+    if (!file.open(path.c_str(), std::ios::in | std::ios::binary))
+    {
+      throw std::runtime_error("cannot open " + path);
+    }
+    const std::streamoff  size = file.pubseekoff(0, std::ios::end);
+    if (size < 0)
+    {
+      throw std::runtime_error("cannot size " + path);
+    }
+    return std::size_t(size);
+  }
+
+  /// Where the first segment kept starts, as trim() left it.
+  void read_head()
+  {
+    std::ifstream  head((path_ + ".head").c_str());
+    unsigned long  k = 0;
+    unsigned long long  first = 0;
+    if (head >> k >> first)
+    {
+      first_segment_ = k;
+      end_ = first;
+    }
+  }
+
+  /// Replaces <path>.head in one rename, so it is never seen torn.
+  static void write_head(const std::string& path, std::size_t k,
+      boost::uint64_t first)
+  {
+    const std::string  head_path = path + ".head";
+    const std::string  temp_path = head_path + ".tmp";
+    {
+      std::ofstream  head(temp_path.c_str(),
+          std::ios::out | std::ios::trunc);
+      head << static_cast< unsigned long >(k) << ' '
+          << static_cast< unsigned long long >(first) << '\n';
+      if (!head.flush())
+      {
+        throw std::runtime_error("cannot write " + temp_path);
+      }
+    }
+    if (std::rename(temp_path.c_str(), head_path.c_str()) != 0)
+    {
+      throw std::runtime_error("cannot write " + head_path);
+    }
+  }
+
+  /**
+  * Deletes segments [first, first + count) of the log at 'path', once
+  * its head says they are gone. For ChatHistorySyncer's thread.
+  */
+  static void retire(const std::string& path, std::size_t first,
+      std::size_t count, boost::uint64_t first_kept)
+  {
+    try
+    {
+      write_head(path, first + count, first_kept);
+    }
+    catch (const std::exception&)
+    {
+      // Kept on the disk, the segments are opened again next time.
+      return;
+    }
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      remove_segment(path, first + i);
+    }
+  }
+
+  /// Drops the oldest segments beyond max_segments_.
+  void trim()
+  {
+    if ((max_segments_ == 0) || (segments_.size() <= max_segments_))
+    {
+      return;
+    }
+    const std::size_t  count = segments_.size() - max_segments_;
+    ChatHistorySyncer::instance().post(boost::bind(&ChatHistoryLog::retire,
+        path_, first_segment_, count, segments_[count]->first));
+    segments_.erase(segments_.begin(), segments_.begin() + count);
+    first_segment_ += count;
+  }
+
+  /// A file of 'size' zero bytes, sparse where the system allows.
+  static void create_file(const std::string& path, std::size_t size)
+  {
+    std::filebuf  file;
+    if (!file.open(path.c_str(),
+          std::ios::out | std::ios::binary | std::ios::trunc)
+        || (file.pubseekoff(size - 1, std::ios::beg) < 0)
+        || (file.sputc(0) != 0)
+        || !file.close())
+    {
+      throw std::runtime_error("cannot create " + path);
+    }
+  }
+
+  static boost::interprocess::mapped_region map(const std::string& path,
+      std::size_t size)
+  {
+    using namespace boost::interprocess;
+    const file_mapping  file(path.c_str(), read_write);
+    return mapped_region(file, read_write, 0, size);
+  }
+
+  static void map(Segment& segment, const std::string& log_path,
+      const std::string& index_path)
+  {
+    segment.log = map(log_path, segment_size);
+    segment.index = map(index_path,
+        max_segment_msgs * sizeof(boost::uint32_t));
+    segment.log.advise(boost::interprocess::mapped_region::advice_sequential);
+  }
+
+  /// msync of [from, to) of a mapping, widened to whole pages.
+  static void flush(boost::interprocess::mapped_region& region,
+      std::size_t from, std::size_t to)
+  {
+    const std::size_t  page =
+        boost::interprocess::mapped_region::get_page_size();
+    const std::size_t  first = from - from % page;
+    region.flush(first, to - first, false);
+  }
+
+  /**
+  * Catches torn and stale records, not tampering: a multiply-xorshift
+  * over 8-byte words, several times faster than a table-driven CRC.
+  */
+  static boost::uint32_t checksum(const char* data, std::size_t size)
+  {
+    boost::uint64_t  h = 0x9e3779b97f4a7c15ull ^ size;
+    std::size_t  i = 0;
+    for ( ; i + 8 <= size; i += 8)
+    {
+      boost::uint64_t  word;
+      std::memcpy(&word, data + i, 8);
+      h = (h ^ word) * 0xff51afd7ed558ccdull;
+      h ^= h >> 32;
+    }
+    boost::uint64_t  tail = 0;
+    std::memcpy(&tail, data + i, size - i);
+    h = (h ^ tail) * 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 29;
+    return boost::uint32_t(h);
+  }
+
+  void open_segment(std::size_t k)
+  {
+    const std::string  log_path = segment_path(path_, k, ".log");
+    const std::string  index_path = segment_path(path_, k, ".idx");
+    if ((file_size(log_path) < std::size_t(segment_size))
+        || (file_size(index_path)
+          < max_segment_msgs * sizeof(boost::uint32_t)))
+    {
+      throw std::runtime_error("truncated segment " + log_path);
+    }
+
+    const segmentPTR  segment = boost::make_shared< Segment >(k);
+    segment->first = end_;
+    map(*segment, log_path, index_path);
+    recover(*segment);
+
+    segments_.push_back(segment);
+    end_ = segment->first + segment->count;
+  }
+
+  /**
+  * Counts the records of a segment and sets tail_ behind them. Index
+  * entries are trusted as far as their records check out; records past
+  * the index are added to it. Anything after the last good record is
+  * cleared.
+  */
+  void recover(Segment& segment)
+  {
+    boost::uint32_t*  ends = segment.ends();
+    std::size_t  count = 0;
+    while ((count < max_segment_msgs) && (ends[count] != 0))
+    {
+      ++count;
+    }
+    while ((count > 0)
+        && (record_end(segment, start_of(ends, count - 1))
+          != ends[count - 1]))
+    {
+      --count;
+    }
+
+    std::size_t  position = count ? ends[count - 1] : 0;
+    for (std::size_t end; (count < max_segment_msgs)
+           && ((end = record_end(segment, position)) != 0); ++count)
+    {
+      ends[count] = boost::uint32_t(end);
+      position = end;
+    }
+
+    std::fill(ends + count,
+        std::find(ends + count, ends + max_segment_msgs, boost::uint32_t(0)),
+        boost::uint32_t(0));
+    if (position + record_header_length <= segment_size)
+    {
+      std::memset(segment.data() + position, 0, record_header_length);
+    }
+    segment.count = count;
+    tail_ = position;
+  }
+
+  static std::size_t start_of(const boost::uint32_t* ends, std::size_t n)
+  {
+    return n ? ends[n - 1] : 0;
+  }
+
+  /// End of the record at 'position', or 0 if there is no valid one.
+  static std::size_t record_end(const Segment& segment, std::size_t position)
+  {
+    if (position + record_header_length > segment_size)
+    {
+      return 0;
+    }
+    const char*  record = segment.data() + position;
+    boost::uint32_t  size, crc;
+    std::memcpy(&size, record, sizeof(size));
+    std::memcpy(&crc, record + 4, sizeof(crc));
+    const std::size_t  end = position + record_header_length + size;
+    if ((size < ChatMessage::binary_header_length) || (end > segment_size)
+        || (checksum(record + record_header_length, size) != crc))
+    {
+      return 0;
+    }
+    return end;
+  }
+
+  /// Seals the current segment and continues in the spare one.
+  void roll()
+  {
+    sync();
+    spare_->first = end_;
+    segments_.push_back(spare_);
+    spare_.reset();
+    tail_ = 0;
+    synced_tail_ = 0;
+    synced_count_ = 0;
+    trim();
+  }
+
+private:
+  const std::string  path_;
+  const std::size_t  max_segments_;
+  /// Number of segments_.front() in the file names.
+  std::size_t  first_segment_;
+  std::vector< segmentPTR >  segments_;
+  /// The segment to roll over to, once made.
+  segmentPTR  spare_;
+  /// Offset of the next record in the last segment.
+  std::size_t  tail_;
+  boost::uint64_t  end_;
+  std::size_t  synced_tail_;
+  std::size_t  synced_count_;
+};
+
+typedef boost::shared_ptr< ChatHistoryLog >  chatHistoryLogPTR;
+
+#endif // CHAT_HISTORY_LOG_HPP
@@ -0,0 +1,346 @@
+//
+// log.h
+// ~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_LOG_HPP
+#define CHAT_LOG_HPP
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+
+enum ChatLogLevel
+{
+  log_debug,
+  log_info,
+  log_warning,
+  log_error,
+  log_off,
+  log_level_count
+};
+
+
+
+
+/**
+* Asynchronous log sink.
+*
+* Callers format a record straight into a slot of a bounded lock-free
+* MPSC ring (no allocation, no lock, no I/O) and a background thread
+* writes the records to stdout. When the ring is full the record is
+* dropped and counted; the writer reports the drops as soon as it catches
+* up.
+*/
+class ChatLog
+  : private boost::noncopyable
+{
+public:
+  enum { capacity = 4096 };
+  enum { max_text_length = 240 };
+
+  static ChatLog& instance()
+  {
+    static ChatLog log;
+    return log;
+  }
+
+  ~ChatLog()
+  {
+    stop();
+  }
+
+  void start()
+  {
+    if (!writer_)
+    {
+      running_ = true;
+      writer_.reset(new boost::thread(boost::bind(&ChatLog::run, this)));
+    }
+  }
+
+  /// Flushes what is queued and stops the writer.
+  void stop()
+  {
+    if (writer_)
+    {
+      running_ = false;
+      writer_->join();
+      writer_.reset();
+    }
+  }
+
+  ChatLogLevel level() const
+  {
+    return level_.load(boost::memory_order_relaxed);
+  }
+
+  void level(ChatLogLevel new_level)
+  {
+    level_.store(new_level, boost::memory_order_relaxed);
+  }
+
+  bool enabled(ChatLogLevel record_level) const
+  {
+    return record_level >= level();
+  }
+
+  std::size_t dropped() const
+  {
+    return dropped_.load(boost::memory_order_relaxed);
+  }
+
+  static const char* level_name(ChatLogLevel level)
+  {
+    static const char* const names[log_level_count] =
+        { "debug", "info", "warning", "error", "off" };
+    return names[level];
+  }
+
+  /// Returns log_level_count for an unknown name.
+  static ChatLogLevel parse_level(const std::string& name)
+  {
+    for (int i = log_debug; i < log_level_count; ++i)
+    {
+      if (name == level_name(ChatLogLevel(i)))
+      {
+        return ChatLogLevel(i);
+      }
+    }
+    return log_level_count;
+  }
+
+  /// printf-like; returns false when the record was dropped.
+  bool print(ChatLogLevel record_level, const char* format, ...)
+  {
+    std::size_t  pos = enqueue_pos_.load(boost::memory_order_relaxed);
+    Cell*  cell = 0;
+    for ( ; ; )
+    {
+      cell = &cells_[pos & (capacity - 1)];
+      const std::size_t  sequence =
+          cell->sequence.load(boost::memory_order_acquire);
+      const std::ptrdiff_t  diff =
+          std::ptrdiff_t(sequence) - std::ptrdiff_t(pos);
+      if (diff == 0)
+      {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+              boost::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (diff < 0)
+      {
+        dropped_.fetch_add(1, boost::memory_order_relaxed);
+        return false;
+      }
+      else
+      {
+        pos = enqueue_pos_.load(boost::memory_order_relaxed);
+      }
+    }
+
+    Record&  record = cell->record;
+    record.level = record_level;
+    record.time = boost::posix_time::microsec_clock::universal_time();
+    va_list  args;
+    va_start(args, format);
+    const int  length =
+        std::vsnprintf(record.text, sizeof(record.text), format, args);
+    va_end(args);
+    record.length = (length < 0) ? 0
+        : std::min< std::size_t >(length, max_text_length);
+
+    cell->sequence.store(pos + 1, boost::memory_order_release);
+    return true;
+  }
+
+private:
+  struct Record
+  {
+    ChatLogLevel  level;
+    boost::posix_time::ptime  time;
+    std::size_t  length;
+    char  text[max_text_length + 1];
+  };
+
+  struct Cell
+  {
+    boost::atomic< std::size_t >  sequence;
+    Record  record;
+  };
+
+  ChatLog()
+    : level_(log_info),
+      dropped_(0),
+      enqueue_pos_(0),
+      dequeue_pos_(0),
+      reported_drops_(0),
+      running_(false)
+  {
+    for (std::size_t i = 0; i < capacity; ++i)
+    {
+      cells_[i].sequence.store(i, boost::memory_order_relaxed);
+    }
+  }
+
+  void run()
+  {
+    for ( ; ; )
+    {
+      const bool  keep_running = running_.load(boost::memory_order_acquire);
+      const std::size_t  written = drain();
+      if (written == 0)
+      {
+        if (!keep_running)
+        {
+          break;
+        }
+        boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+      }
+    }
+    std::fflush(stdout);
+  }
+
+  /// Single consumer side of the ring.
+  std::size_t drain()
+  {
+    std::size_t  written = 0;
+    for ( ; ; )
+    {
+      Cell&  cell = cells_[dequeue_pos_ & (capacity - 1)];
+      if (cell.sequence.load(boost::memory_order_acquire)
+            != dequeue_pos_ + 1)
+      {
+        break;
+      }
+
+      const Record&  record = cell.record;
+      std::printf("%s level=%s %.*s\n",
+          boost::posix_time::to_iso_extended_string(record.time).c_str(),
+          level_name(record.level),
+          int(record.length), record.text);
+
+      cell.sequence.store(dequeue_pos_ + capacity,
+          boost::memory_order_release);
+      ++dequeue_pos_;
+      ++written;
+    }
+
+    const std::size_t  drops = dropped();
+    if (drops != reported_drops_)
+    {
+      std::printf("%s level=warning event=log_dropped count=%lu total=%lu\n",
+          boost::posix_time::to_iso_extended_string(
+            boost::posix_time::microsec_clock::universal_time()).c_str(),
+          static_cast< unsigned long >(drops - reported_drops_),
+          static_cast< unsigned long >(drops));
+      reported_drops_ = drops;
+      ++written;
+    }
+    if (written > 0)
+    {
+      std::fflush(stdout);
+    }
+    return written;
+  }
+
+private:
+  boost::atomic< ChatLogLevel >  level_;
+  boost::atomic< std::size_t >  dropped_;
+
+  Cell  cells_[capacity];
+  boost::atomic< std::size_t >  enqueue_pos_;
+  std::size_t  dequeue_pos_;
+  std::size_t  reported_drops_;
+
+  boost::atomic< bool >  running_;
+  boost::scoped_ptr< boost::thread >  writer_;
+};
+
+
+
+
+/**
+* Peer-supplied text made safe to quote in a record: quotes and
+* backslashes are escaped, control bytes written as \xNN, so a message
+* cannot end its field or forge a record. Text beyond max_length bytes of
+* output is cut and marked with "...".
+*/
+class ChatLogEscaped
+  : private boost::noncopyable
+{
+public:
+  enum { max_length = 96 };
+
+  ChatLogEscaped(const char* data, std::size_t length)
+  {
+    static const char  digits[] = "0123456789abcdef";
+    std::size_t  n = 0;
+    for (std::size_t i = 0; i < length; ++i)
+    {
+      const unsigned char  c = static_cast< unsigned char >(data[i]);
+      const std::size_t  needed = ((c < 0x20) || (c == 0x7f)) ? 4
+          : ((c == '"') || (c == '\\')) ? 2 : 1;
+      if (n + needed > max_length)
+      {
+        std::memcpy(text_ + n, "...", 3);
+        n += 3;
+        break;
+      }
+      if (needed == 4)
+      {
+        text_[n++] = '\\';
+        text_[n++] = 'x';
+        text_[n++] = digits[c >> 4];
+        text_[n++] = digits[c & 0xf];
+      }
+      else
+      {
+        if (needed == 2)
+        {
+          text_[n++] = '\\';
+        }
+        text_[n++] = static_cast< char >(c);
+      }
+    }
+    text_[n] = '\0';
+  }
+
+  const char* c_str() const
+  {
+    return text_;
+  }
+
+private:
+  char  text_[max_length + 4];
+};
+
+
+
+/**
+* Formats the record only when its level is enabled.
+*/
+#define CHAT_LOG(level, ...) \
+  do \
+  { \
+    if (ChatLog::instance().enabled(level)) \
+      ChatLog::instance().print((level), __VA_ARGS__); \
+  } while (false)
+
+#endif // CHAT_LOG_HPP
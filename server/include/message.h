@@ -16,42 +16,188 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <string>
+#include <boost/cstdint.hpp>
+#include "buffer_pool.h"
 
 
+/**
+* A chat message can travel in two framings:
+*   - legacy: 4 ASCII characters with the body length ("%4d"), as spoken
+*     by the original clients;
+*   - binary: 12 bytes, little-endian
+*       [0..3]  body length
+*       [4]     type, see Type
+*       [5]     flags
+*       [6..7]  reserved, must be 0
+*       [8..11] room
+*
+* A legacy message always belongs to room 0.
+*
+* The binary framing is negotiated at connect: the client opens with
+* protocol_preface() and the server echoes it back. A legacy client never
+* sends it (its first byte is always a space or a digit).
+*
+* A binary client may follow the preface with a type_hello whose body is
+* one byte of hello_* capabilities. With hello_deflate the server may
+* send a room's messages with flag_deflate: the body is then a raw
+* deflate stream (RFC 1951) made with the room's preset dictionary, which
+* the room sends as a type_dictionary frame before the first message
+* that uses it and again whenever it changes.
+*
+* Both headers are kept side by side so that one message read from any
+* client can be written to clients of either framing without re-encoding.
+*
+* The body lives in a buffer of ChatBufferPool sized to the message, so a
+* short line costs a 64-byte buffer while the binary framing carries up
+* to max_binary_body_length bytes. Legacy clients only accept
+* max_body_length bytes: the legacy header announces the body truncated
+* to that length.
+*/
 class ChatMessage
 {
 public:
+  enum Framing
+  {
+    legacy_framing,
+    binary_framing
+  };
+
+  enum Type
+  {
+    /// A line for everybody in the room.
+    type_publish = 0,
+    /// Capabilities of the client, right after the preface.
+    type_hello   = 1,
+    /// Subscribes the sender to the room; the body is empty.
+    type_join    = 2,
+    /// Unsubscribes the sender from the room; the body is empty.
+    type_leave   = 3,
+    /// Asks the room for part of its history, see
+    /// encode_history_request().
+    type_history = 4,
+    /// Server to client: the preset dictionary of the room's compressed
+    /// messages from here on; empty for none.
+    type_dictionary = 5
+  };
+
+  enum Flag
+  {
+    /// The body is deflated with the room's dictionary.
+    flag_deflate = 0x01
+  };
+
+  enum Hello
+  {
+    /// The client inflates messages with flag_deflate.
+    hello_deflate = 0x01
+  };
+
   enum { header_length = 4 };
+  enum { binary_header_length = 12 };
+  enum { preface_length = 4 };
+  enum { protocol_version = 3 };
+  enum { default_room = 0 };
   enum { max_body_length = 512 };
+  enum { max_binary_body_length = ChatBufferPool::max_buffer_size };
+  enum { history_request_length = 12 };
 
   ChatMessage()
-    : body_length_(0)
+    : body_(0),
+      capacity_(0),
+      body_length_(0),
+      type_(type_publish),
+      flags_(0),
+      room_(default_room)
+  {
+  }
+
+  ChatMessage(const ChatMessage& other)
+    : body_(0),
+      capacity_(0),
+      body_length_(0),
+      type_(other.type_),
+      flags_(other.flags_),
+      room_(other.room_)
   {
+    std::memcpy(legacy_header_, other.legacy_header_, header_length);
+    std::memcpy(binary_header_, other.binary_header_, binary_header_length);
+    body_length(other.body_length_);
+    if (body_length_ > 0)
+      std::memcpy(body_, other.body_, body_length_);
   }
 
-  const char* data() const
+  ChatMessage& operator=(ChatMessage other)
   {
-    return data_;
+    swap(other);
+    return *this;
   }
 
-  char* data()
+  ~ChatMessage()
   {
-    return data_;
+    ChatBufferPool::instance().deallocate(body_, capacity_);
   }
 
-  size_t length() const
+  void swap(ChatMessage& other)
   {
-    return header_length + body_length_;
+    char  header[binary_header_length];
+    std::memcpy(header, legacy_header_, header_length);
+    std::memcpy(legacy_header_, other.legacy_header_, header_length);
+    std::memcpy(other.legacy_header_, header, header_length);
+    std::memcpy(header, binary_header_, binary_header_length);
+    std::memcpy(binary_header_, other.binary_header_, binary_header_length);
+    std::memcpy(other.binary_header_, header, binary_header_length);
+    std::swap(body_, other.body_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(body_length_, other.body_length_);
+    std::swap(type_, other.type_);
+    std::swap(flags_, other.flags_);
+    std::swap(room_, other.room_);
+  }
+
+  /// The 4 bytes a binary client sends first and the server echoes back.
+  static const char* protocol_preface()
+  {
+    static const char preface[preface_length] =
+        { '\0', 'C', 'B', char(protocol_version) };
+    return preface;
+  }
+
+  static bool is_protocol_preface(const char* data)
+  {
+    return std::memcmp(data, protocol_preface(), preface_length) == 0;
+  }
+
+  static size_t header_size(Framing framing)
+  {
+    return (framing == binary_framing)
+        ? size_t(binary_header_length) : size_t(header_length);
+  }
+
+  const char* header(Framing framing) const
+  {
+    return (framing == binary_framing) ? binary_header_ : legacy_header_;
+  }
+
+  char* header(Framing framing)
+  {
+    return (framing == binary_framing) ? binary_header_ : legacy_header_;
+  }
+
+  size_t length(Framing framing) const
+  {
+    return header_size(framing) + body_length(framing);
   }
 
   const char* body() const
   {
-    return data_ + header_length;
+    return body_;
   }
 
   char* body()
   {
-    return data_ + header_length;
+    return body_;
   }
 
   size_t body_length() const
@@ -59,46 +205,219 @@ public:
     return body_length_;
   }
 
+  /// Length of the body as sent in the given framing.
+  size_t body_length(Framing framing) const
+  {
+    return ((framing == legacy_framing) && (body_length_ > max_body_length))
+        ? size_t(max_body_length) : body_length_;
+  }
+
+  /// Resizes the body; the content is kept only while it fits the buffer.
   void body_length(size_t new_length)
   {
+    if (new_length > max_binary_body_length)
+      new_length = max_binary_body_length;
+    reserve(new_length);
     body_length_ = new_length;
-    if (body_length_ > max_body_length)
-      body_length_ = max_body_length;
   }
 
-  bool decode_header()
+  unsigned char type() const
   {
-    using namespace std; // For strncat and atoi.
-    char header[header_length + 1] = "";
-    strncat(header, data_, header_length);
-    body_length_ = atoi(header);
-    if (body_length_ > max_body_length)
-    {
-      body_length_ = 0;
+    return type_;
+  }
+
+  void type(unsigned char new_type)
+  {
+    type_ = new_type;
+  }
+
+  unsigned char flags() const
+  {
+    return flags_;
+  }
+
+  void flags(unsigned char new_flags)
+  {
+    flags_ = new_flags;
+  }
+
+  boost::uint32_t room() const
+  {
+    return room_;
+  }
+
+  void room(boost::uint32_t new_room)
+  {
+    room_ = new_room;
+  }
+
+  /**
+  * Validates the header and makes room for the announced body. Bodies
+  * longer than max_length (and, for the legacy framing, max_body_length)
+  * are rejected.
+  */
+  bool decode_header(Framing framing = legacy_framing,
+      size_t max_length = max_binary_body_length)
+  {
+    const bool valid = (framing == binary_framing)
+        ? decode_binary_header(max_length)
+        : decode_legacy_header(max_length);
+    reserve(body_length_);
+    return valid;
+  }
+
+  void encode_header(Framing framing = legacy_framing)
+  {
+    if (framing == binary_framing)
+      encode_binary_header();
+    else
+      encode_legacy_header();
+  }
+
+  /// Encodes both headers, so the message can go to any client.
+  void encode_headers()
+  {
+    encode_legacy_header();
+    encode_binary_header();
+  }
+
+  /// First message of a history request for the latest ones.
+  static boost::uint64_t latest_history()
+  {
+    return ~boost::uint64_t(0);
+  }
+
+  /**
+  * Makes this a request for 'count' messages of the room's history from
+  * sequence number 'first' on (or the last 'count' ones for
+  * latest_history()). The body holds both, little-endian:
+  *   [0..7]   first
+  *   [8..11]  count
+  */
+  void encode_history_request(boost::uint64_t first, boost::uint32_t count)
+  {
+    type_ = type_history;
+    body_length(history_request_length);
+    unsigned char* b = reinterpret_cast< unsigned char* >(body_);
+    for (size_t i = 0; i < 8; ++i)
+      b[i] = static_cast< unsigned char >(first >> (8 * i));
+    for (size_t i = 0; i < 4; ++i)
+      b[8 + i] = static_cast< unsigned char >(count >> (8 * i));
+  }
+
+  /// Reads the range of a history request; false if the body is not one.
+  bool decode_history_request(boost::uint64_t& first,
+      boost::uint32_t& count) const
+  {
+    if (body_length_ != history_request_length)
       return false;
-    }
+    const unsigned char* b = reinterpret_cast< const unsigned char* >(body_);
+    first = 0;
+    for (size_t i = 8; i > 0; --i)
+      first = (first << 8) | b[i - 1];
+    count = 0;
+    for (size_t i = 4; i > 0; --i)
+      count = (count << 8) | b[8 + i - 1];
     return true;
   }
 
-  void encode_header()
+  std::string str() const {
+    return std::string(legacy_header_, header_length)
+        + std::string(body_, body_length(legacy_framing));
+  }
+
+private:
+  /// Grows the pooled body buffer to hold at least 'length' bytes.
+  void reserve(size_t length)
   {
-    using namespace std; // For sprintf and memcpy.
-    char header[header_length + 1] = "";
-    sprintf(header, "%4d", body_length_);
-    memcpy(data_, header, header_length);
+    if (length <= capacity_)
+      return;
+    ChatBufferPool&  pool = ChatBufferPool::instance();
+    pool.deallocate(body_, capacity_);
+    capacity_ = ChatBufferPool::capacity(length);
+    body_ = static_cast< char* >(pool.allocate(capacity_));
   }
 
-  std::string str() const {
-    const char* last = data_ + header_length + body_length_;
-    if (last > (data_ + header_length + max_body_length)) {
-        last = data_ + max_body_length - header_length;
+  /// Right-aligned decimal padded with spaces, as "%4d" but locale-free.
+  bool decode_legacy_header(size_t max_length)
+  {
+    size_t length = 0;
+    bool valid = true;
+    for (size_t i = 0; i < header_length; ++i)
+    {
+      const unsigned char c = legacy_header_[i];
+      const unsigned digit = c - '0';
+      const bool is_digit = (digit < 10);
+      valid &= is_digit || ((c == ' ') && (length == 0));
+      length = is_digit ? (length * 10 + digit) : length;
     }
-    return std::string( data_,  last );
+    valid &= (length <= max_body_length) & (length <= max_length);
+    body_length_ = valid ? length : 0;
+    type_ = type_publish;
+    flags_ = 0;
+    room_ = default_room;
+    return valid;
+  }
+
+  void encode_legacy_header()
+  {
+    size_t length = std::min(body_length_, size_t(max_body_length));
+    for (size_t i = header_length; i > 0; --i)
+    {
+      legacy_header_[i - 1] = ((length == 0) && (i < header_length))
+          ? ' ' : char('0' + length % 10);
+      length /= 10;
+    }
+  }
+
+  bool decode_binary_header(size_t max_length)
+  {
+    const unsigned char* h =
+        reinterpret_cast< const unsigned char* >(binary_header_);
+    const size_t length =
+        size_t(h[0])
+        | (size_t(h[1]) << 8)
+        | (size_t(h[2]) << 16)
+        | (size_t(h[3]) << 24);
+    const bool valid =
+        (length <= max_length) & ((h[6] | h[7]) == 0);
+    body_length_ = valid ? length : 0;
+    type_ = h[4];
+    flags_ = h[5];
+    room_ =
+        boost::uint32_t(h[8])
+        | (boost::uint32_t(h[9]) << 8)
+        | (boost::uint32_t(h[10]) << 16)
+        | (boost::uint32_t(h[11]) << 24);
+    return valid;
+  }
+
+  void encode_binary_header()
+  {
+    unsigned char* h = reinterpret_cast< unsigned char* >(binary_header_);
+    h[0] = static_cast< unsigned char >(body_length_);
+    h[1] = static_cast< unsigned char >(body_length_ >> 8);
+    h[2] = static_cast< unsigned char >(body_length_ >> 16);
+    h[3] = static_cast< unsigned char >(body_length_ >> 24);
+    h[4] = type_;
+    h[5] = flags_;
+    h[6] = 0;
+    h[7] = 0;
+    h[8] = static_cast< unsigned char >(room_);
+    h[9] = static_cast< unsigned char >(room_ >> 8);
+    h[10] = static_cast< unsigned char >(room_ >> 16);
+    h[11] = static_cast< unsigned char >(room_ >> 24);
   }
 
 private:
-  char data_[header_length + max_body_length];
+  char legacy_header_[header_length];
+  char binary_header_[binary_header_length];
+  char* body_;
+  size_t capacity_;
   size_t body_length_;
+  unsigned char type_;
+  unsigned char flags_;
+  boost::uint32_t room_;
 };
 
 #endif // CHAT_MESSAGE_HPP
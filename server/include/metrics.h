@@ -0,0 +1,355 @@
+//
+// metrics.h
+// ~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_METRICS_HPP
+#define CHAT_METRICS_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include "histogram.h"
+
+
+/**
+* Metrics of one thread. Only the owning thread writes them; the
+* exporter reads them from another.
+*
+* Counters and gauges are atomics updated with a plain load and store,
+* which costs no more than an ordinary increment. Histograms are larger
+* than what an atomic can cover and are guarded by a mutex which nobody
+* but a scrape ever contends.
+*/
+struct ChatThreadMetrics
+  : private boost::noncopyable
+{
+  enum Counter
+  {
+    accepted,
+    closed,
+    messages_in,
+    bytes_in,
+    messages_out,
+    bytes_out,
+    /// Messages a room handed to its participants.
+    broadcasts,
+    /// Copies of those messages queued to sessions.
+    deliveries,
+    /// Messages, joins and leaves a room passed to its part on a shard.
+    forwards,
+    /// Passes of a room's part over its participants, one per run of
+    /// messages drained at once.
+    fan_outs,
+    /// TLS handshakes completed, and those resuming from a ticket.
+    tls_handshakes,
+    tls_resumptions,
+    /// TLS sessions whose records the kernel writes and reads (kTLS).
+    tls_ktls_send,
+    tls_ktls_recv,
+    /// Bodies rooms deflated once for their compressing participants,
+    /// bytes before and after.
+    deflate_in,
+    deflate_out,
+    /// io_uring_enter calls of the io_uring transport, and the
+    /// completions it reaped.
+    uring_enters,
+    uring_completions,
+    counter_count
+  };
+
+  /// Sums over the sessions; the last update of a session may come from
+  /// another thread than its shard's, so only the total over all threads
+  /// is meaningful.
+  enum Gauge
+  {
+    queued_msgs,
+    queued_bytes,
+    /// Sessions in rooms, once per room each is in.
+    room_participants,
+    gauge_count
+  };
+
+  enum Timer
+  {
+    /// Accept handler: setting up the session and re-arming the acceptor.
+    accept_time,
+    /// Read handler: parsing a read and handing its frames to the rooms.
+    read_time,
+    /// A room delivering one batch to all of its participants.
+    broadcast_time,
+    /// A gathered write, from its start to its completion.
+    write_time,
+    timer_count
+  };
+
+  ChatThreadMetrics()
+  {
+    for (std::size_t i = 0; i < counter_count; ++i)
+    {
+      counters[i].store(0, boost::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < gauge_count; ++i)
+    {
+      gauges[i].store(0, boost::memory_order_relaxed);
+    }
+  }
+
+  boost::atomic< boost::uint64_t >  counters[counter_count];
+  boost::atomic< boost::int64_t >  gauges[gauge_count];
+
+  boost::mutex  timers_mutex;
+  ChatHistogram  timers[timer_count];
+};
+
+
+
+
+/**
+* Registry of the per-thread metrics. A thread's block is created on its
+* first update and lives as long as the process, so the exporter never
+* sees one disappear.
+*/
+class ChatMetrics
+  : private boost::noncopyable
+{
+public:
+  typedef ChatThreadMetrics::Counter  Counter;
+  typedef ChatThreadMetrics::Gauge  Gauge;
+  typedef ChatThreadMetrics::Timer  Timer;
+
+  static ChatMetrics& instance()
+  {
+    static ChatMetrics metrics;
+    return metrics;
+  }
+
+  /// Monotonic time, ns.
+  static boost::uint64_t now()
+  {
+    return std::chrono::duration_cast< std::chrono::nanoseconds >(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static void count(Counter counter, boost::uint64_t n = 1)
+  {
+    boost::atomic< boost::uint64_t >&  value = local().counters[counter];
+    value.store(value.load(boost::memory_order_relaxed) + n,
+        boost::memory_order_relaxed);
+  }
+
+  static void adjust(Gauge gauge, boost::int64_t delta)
+  {
+    boost::atomic< boost::int64_t >&  value = local().gauges[gauge];
+    value.store(value.load(boost::memory_order_relaxed) + delta,
+        boost::memory_order_relaxed);
+  }
+
+  static void record(Timer timer, boost::uint64_t ns)
+  {
+    ChatThreadMetrics&  metrics = local();
+    boost::mutex::scoped_lock  lock(metrics.timers_mutex);
+    metrics.timers[timer].record(ns);
+  }
+
+  std::size_t thread_count()
+  {
+    boost::mutex::scoped_lock  lock(mutex_);
+    return threads_.size();
+  }
+
+  boost::uint64_t counter(std::size_t thread, Counter counter)
+  {
+    return block(thread).counters[counter].load(boost::memory_order_relaxed);
+  }
+
+  boost::int64_t gauge(Gauge gauge)
+  {
+    boost::int64_t  total = 0;
+    for (std::size_t i = 0, n = thread_count(); i < n; ++i)
+    {
+      total += block(i).gauges[gauge].load(boost::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  /// All threads' histograms of the timer merged into 'total'.
+  void timer(Timer timer, ChatHistogram& total)
+  {
+    total.reset();
+    for (std::size_t i = 0, n = thread_count(); i < n; ++i)
+    {
+      ChatThreadMetrics&  metrics = block(i);
+      boost::mutex::scoped_lock  lock(metrics.timers_mutex);
+      total.merge(metrics.timers[timer]);
+    }
+  }
+
+  /// Counters per thread, gauges and timers in the Prometheus text format.
+  void write(std::ostream& os)
+  {
+    static const char* const counter_names[][2] =
+    {
+      { "chat_connections_accepted_total", "Connections accepted." },
+      { "chat_connections_closed_total", "Sessions ended." },
+      { "chat_messages_in_total", "Messages published by clients." },
+      { "chat_bytes_in_total", "Bytes read from clients." },
+      { "chat_messages_out_total", "Messages written to clients." },
+      { "chat_bytes_out_total", "Bytes written to clients." },
+      { "chat_broadcasts_total", "Messages delivered by rooms." },
+      { "chat_deliveries_total", "Message copies queued to sessions." },
+      { "chat_shard_forwards_total",
+        "Messages, joins and leaves passed from rooms to shards." },
+      { "chat_fan_outs_total",
+        "Passes of rooms over their participants on a shard." },
+      { "chat_tls_handshakes_total", "TLS handshakes completed." },
+      { "chat_tls_resumptions_total",
+        "TLS handshakes resuming a session from a ticket." },
+      { "chat_tls_ktls_send_total",
+        "TLS sessions whose records the kernel writes." },
+      { "chat_tls_ktls_recv_total",
+        "TLS sessions whose records the kernel reads." },
+      { "chat_deflate_in_bytes_total",
+        "Message bytes rooms deflated for compressing clients." },
+      { "chat_deflate_out_bytes_total",
+        "Bytes those messages deflated to." },
+      { "chat_uring_enters_total",
+        "io_uring_enter calls of the io_uring transport." },
+      { "chat_uring_completions_total",
+        "Completions reaped from the io_uring transport." }
+    };
+    static const char* const gauge_names[][2] =
+    {
+      { "chat_queued_messages", "Messages in the write queues of sessions." },
+      { "chat_queued_bytes", "Bytes in the write queues of sessions." },
+      { "chat_room_participants", "Sessions in rooms, once per room." }
+    };
+    static const char* const timer_names[][2] =
+    {
+      { "chat_accept_seconds", "Time in the accept handler." },
+      { "chat_read_seconds", "Time in the read handler." },
+      { "chat_broadcast_seconds", "Time of a room delivering one batch." },
+      { "chat_write_seconds", "Duration of gathered writes." }
+    };
+
+    const std::size_t  threads = thread_count();
+    for (std::size_t c = 0; c < ChatThreadMetrics::counter_count; ++c)
+    {
+      os << "# HELP " << counter_names[c][0] << ' ' << counter_names[c][1]
+         << "\n# TYPE " << counter_names[c][0] << " counter\n";
+      for (std::size_t t = 0; t < threads; ++t)
+      {
+        os << counter_names[c][0] << "{thread=\"" << t << "\"} "
+           << counter(t, Counter(c)) << '\n';
+      }
+    }
+    for (std::size_t g = 0; g < ChatThreadMetrics::gauge_count; ++g)
+    {
+      os << "# HELP " << gauge_names[g][0] << ' ' << gauge_names[g][1]
+         << "\n# TYPE " << gauge_names[g][0] << " gauge\n"
+         << gauge_names[g][0] << ' ' << gauge(Gauge(g)) << '\n';
+    }
+    ChatHistogram  histogram;
+    for (std::size_t i = 0; i < ChatThreadMetrics::timer_count; ++i)
+    {
+      timer(Timer(i), histogram);
+      write_histogram(os, timer_names[i][0], timer_names[i][1], histogram);
+    }
+  }
+
+  /**
+  * Writes a histogram of nanoseconds in the Prometheus text format, in
+  * seconds. Bucket bounds are as precise as ChatHistogram, about 3%.
+  */
+  static void write_histogram(std::ostream& os, const char* name,
+      const char* help, const ChatHistogram& histogram)
+  {
+    static const boost::uint64_t  bounds[] =
+    {
+      1000, 5000, 10000, 50000, 100000, 500000,
+      1000000, 5000000, 10000000, 50000000, 100000000, 500000000,
+      1000000000
+    };
+
+    os << "# HELP " << name << ' ' << help << '\n'
+       << "# TYPE " << name << " histogram\n";
+    for (std::size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); ++i)
+    {
+      os << name << "_bucket{le=\"" << double(bounds[i]) / 1e9 << "\"} "
+         << histogram.count_below(bounds[i]) << '\n';
+    }
+    os << name << "_bucket{le=\"+Inf\"} " << histogram.count() << '\n'
+       << name << "_sum " << double(histogram.sum()) / 1e9 << '\n'
+       << name << "_count " << histogram.count() << '\n';
+  }
+
+private:
+  ChatMetrics()
+  {
+  }
+
+  static ChatThreadMetrics& local()
+  {
+    static thread_local ChatThreadMetrics*  metrics = 0;
+    if (!metrics)
+    {
+      metrics = instance().add_thread();
+    }
+    return *metrics;
+  }
+
+  ChatThreadMetrics* add_thread()
+  {
+    boost::mutex::scoped_lock  lock(mutex_);
+    threads_.push_back(new ChatThreadMetrics());
+    return threads_.back();
+  }
+
+  ChatThreadMetrics& block(std::size_t thread)
+  {
+    boost::mutex::scoped_lock  lock(mutex_);
+    return *threads_[thread];
+  }
+
+private:
+  boost::mutex  mutex_;
+  /// Never freed: a block outlives its thread until the process ends.
+  std::vector< ChatThreadMetrics* >  threads_;
+};
+
+
+
+
+/**
+* Records the time from construction to destruction into a timer.
+*/
+class ChatScopedTimer
+  : private boost::noncopyable
+{
+public:
+  explicit ChatScopedTimer(ChatMetrics::Timer timer)
+    : timer_(timer),
+      start_(ChatMetrics::now())
+  {
+  }
+
+  ~ChatScopedTimer()
+  {
+    ChatMetrics::record(timer_, ChatMetrics::now() - start_);
+  }
+
+private:
+  const ChatMetrics::Timer  timer_;
+  const boost::uint64_t  start_;
+};
+
+#endif // CHAT_METRICS_HPP
@@ -0,0 +1,130 @@
+//
+// ring_buffer.h
+// ~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_RING_BUFFER_HPP
+#define CHAT_RING_BUFFER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <boost/array.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/noncopyable.hpp>
+#include "buffer_pool.h"
+
+
+/**
+* Receive buffer of a session. The socket reads into the free space
+* (which may wrap around the end, hence two buffers) and the frame
+* parser copies complete pieces out of the filled space.
+*
+* The capacity is a power of two so positions are plain counters masked
+* on access. The memory comes from ChatBufferPool on allocate() and goes
+* back on release(), so an idle session does not hold it.
+*/
+class ChatRingBuffer
+  : private boost::noncopyable
+{
+public:
+  typedef boost::array< boost::asio::mutable_buffer, 2 >  mutableBuffers_t;
+
+  explicit ChatRingBuffer(std::size_t capacity)
+    : capacity_(ChatBufferPool::capacity(capacity)),
+      data_(0),
+      head_(0),
+      tail_(0)
+  {
+  }
+
+  ~ChatRingBuffer()
+  {
+    ChatBufferPool::instance().deallocate(data_, capacity_);
+  }
+
+  bool allocated() const
+  {
+    return data_ != 0;
+  }
+
+  void allocate()
+  {
+    if (!data_)
+    {
+      data_ = static_cast< char* >(
+          ChatBufferPool::instance().allocate(capacity_));
+    }
+  }
+
+  /// Gives the memory back to the pool; the buffer must be empty.
+  void release()
+  {
+    ChatBufferPool::instance().deallocate(data_, capacity_);
+    data_ = 0;
+    head_ = 0;
+    tail_ = 0;
+  }
+
+  /// Bytes received and not consumed yet.
+  std::size_t size() const
+  {
+    return tail_ - head_;
+  }
+
+  std::size_t space() const
+  {
+    return capacity_ - size();
+  }
+
+  /// Free space to read into; the buffer must be allocated.
+  mutableBuffers_t prepare()
+  {
+    const std::size_t  begin = tail_ & (capacity_ - 1);
+    const std::size_t  first = std::min(space(), capacity_ - begin);
+    const mutableBuffers_t  buffers = {{
+        boost::asio::buffer(data_ + begin, first),
+        boost::asio::buffer(data_, space() - first)
+    }};
+    return buffers;
+  }
+
+  /// Makes 'n' bytes written into prepare() readable.
+  void commit(std::size_t n)
+  {
+    tail_ += n;
+  }
+
+  /// Copies the first 'n' readable bytes out, n <= size().
+  void peek(char* dst, std::size_t n) const
+  {
+    const std::size_t  begin = head_ & (capacity_ - 1);
+    const std::size_t  first = std::min(n, capacity_ - begin);
+    std::memcpy(dst, data_ + begin, first);
+    std::memcpy(dst + first, data_, n - first);
+  }
+
+  void consume(std::size_t n)
+  {
+    head_ += n;
+  }
+
+  /// Copies out and consumes 'n' bytes.
+  void read(char* dst, std::size_t n)
+  {
+    peek(dst, n);
+    consume(n);
+  }
+
+private:
+  const std::size_t  capacity_;
+  char*  data_;
+  std::size_t  head_;
+  std::size_t  tail_;
+};
+
+#endif // CHAT_RING_BUFFER_HPP
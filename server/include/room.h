@@ -0,0 +1,1030 @@
+//
+// room.h
+// ~~~~~~
+//
+// Copyright (c) 2003-2012 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// @source http://www.boost.org/doc/libs/1_53_0/doc/html/boost_asio/example/chat/ChatServer.cpp
+
+
+#ifndef CHAT_ROOM_HPP
+#define CHAT_ROOM_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/intrusive/list_hook.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include "backlog.h"
+#include "buffer_pool.h"
+#include "compression.h"
+#include "handler_allocator.h"
+#include "history_log.h"
+#include "log.h"
+#include "message.h"
+#include "metrics.h"
+#include "shard.h"
+#include "slot_map.h"
+#include "spsc_queue.h"
+
+
+/**
+* Messages are immutable once read from the wire: the room and every
+* participant's write queue share the same buffer instead of copying it.
+*/
+typedef boost::shared_ptr< const ChatMessage >  chatMessagePTR;
+
+typedef std::deque< chatMessagePTR, ChatPoolAllocator< chatMessagePTR > >
+    chatMessageQueue_t;
+
+/// Messages parsed from one read of a session, delivered to the room at once.
+typedef std::vector< chatMessagePTR, ChatPoolAllocator< chatMessagePTR > >
+    chatMessageBatch_t;
+
+/// Message and its control block come from ChatBufferPool in one piece.
+inline boost::shared_ptr< ChatMessage > make_message()
+{
+  return boost::allocate_shared< ChatMessage >(
+      ChatPoolAllocator< ChatMessage >());
+}
+
+/**
+* A participant's place in one room. The participant sets its shard,
+* and whether it takes deflated messages, before joining and otherwise
+* only keeps the object alive; the room marks it joined on its strand,
+* and fills the handle in on join and clears it on leave on the strand
+* of its part on that shard.
+*/
+struct ChatMembership
+{
+  ChatMembership()
+    : shard(0),
+      compressed(false),
+      joined(false)
+  {
+  }
+
+  std::size_t  shard;
+  bool  compressed;
+  bool  joined;
+  ChatSlotHandle  handle;
+};
+
+typedef boost::shared_ptr< ChatMembership >  chatMembershipPTR;
+
+/**
+* Where a participant builds the handler taking its batches to a room's
+* strand, which usually runs on another thread. One batch at a time uses
+* the memory: the room clears 'pending' on its strand, after Asio gave
+* the block back, and a batch sent before then goes on the heap.
+*/
+struct ChatDeliveryMemory
+  : private boost::noncopyable
+{
+  ChatDeliveryMemory()
+    : pending(false)
+  {
+  }
+
+  boost::atomic< bool >  pending;
+  ChatHandlerMemory  memory;
+};
+
+//----------------------------------------------------------------------
+
+/**
+* The room is split over the shards (ChatShards). The room itself lives
+* on the strand of its home shard, which numbers the messages, keeps the
+* recent ones and the history, and knows how many participants each
+* shard has. The participants of a shard are held by the room's part
+* there and only touched on that part's strand; a part is made on the
+* first join from its shard, so a room costs nothing on the others.
+*
+* Delivering a batch, the room pushes a handle to each message onto the
+* ChatSpscQueue of every part with participants and posts one drain to
+* the part; the parts then fan out to their local participants in
+* parallel, without a lock shared between shards. Joins and leaves take
+* the same queues, so a participant gets exactly the messages after its
+* backlog.
+*
+* A drain takes everything queued since the last one, which under load
+* is every batch the room got from its sessions in the meantime. The
+* messages between two membership changes go out together: one pass
+* over the participants, each handed the whole run in one call.
+*
+* Participants are kept in a ChatSlotMap: a broadcast walks one contiguous
+* array, and join and leave are O(1). The room is a template over the
+* participant type, so delivering is a direct call. A Participant
+* provides
+*   void deliver(const chatMessageBatch_t&);
+*   void deliver(const chatBacklogPTR&);
+*
+* The last takes the recent messages of the room at once when the
+* participant joins: the room keeps them serialized in the participant's
+* framing (ChatBacklogBuilder), so joining costs one call whatever the
+* size of the history.
+*
+* Messages are numbered from 0 in the order the room delivers them. With
+* history enabled the room appends each of them to its ChatHistoryLog and
+* picks the numbering and the recent messages up from there when it is
+* created again; any range of the log can be replayed to a participant.
+* The log is opened, and its segments made, on ChatHistorySyncer's
+* thread: start() sets the opening off, and the joins, leaves and
+* messages that reach the room before it is done wait for it. Messages
+* for a segment not made yet wait in order behind the log.
+*
+* With compression enabled, participants may join compressed: while it
+* has any, the room deflates each message once on its strand
+* (ChatDeflater) and forwards both versions, and the parts hand the
+* deflated one to those participants. The preset dictionary is trained
+* from the recent messages when the first of them joins and again every
+* retrain_interval messages; it goes out as a type_dictionary message,
+* in order with the messages, and to each of them on joining. Backlogs
+* and replays are not compressed.
+*
+* Rooms are held by shared_ptr, and every handler a room posts holds one,
+* so a room ChatRoomDirectory lets go lives until its last handler ran.
+* The directory holds the room for each session it hands it to (hold()),
+* and leave() lets go of it, on the session's thread. Once nobody holds
+* the room and no delivery or history work of theirs is in flight, the
+* room tells the directory it is idle, from whichever thread did the
+* last of it.
+*/
+template< typename Participant >
+class ChatRoom
+  : public boost::enable_shared_from_this< ChatRoom< Participant > >
+{
+public:
+  typedef boost::shared_ptr< Participant >  participantPTR;
+  /// Called with the room when it becomes idle.
+  typedef boost::function< void (ChatRoom*) >  idleHandler_t;
+
+private:
+  /// A participant as the part of its shard holds it.
+  struct Member
+  {
+    Member()
+      : compressed(false)
+    {
+    }
+
+    Member(const participantPTR& participant_, bool compressed_)
+      : participant(participant_),
+        compressed(compressed_)
+    {
+    }
+
+    participantPTR  participant;
+    bool  compressed;
+  };
+
+  typedef ChatSlotMap< Member >  participants_t;
+
+  /// What the home strand passes to a part.
+  struct Event
+  {
+    enum Kind
+    {
+      message,
+      /// A new dictionary, for the compressed participants only.
+      dictionary,
+      join,
+      leave
+    };
+
+    explicit Event(Kind kind_ = message)
+      : kind(kind_)
+    {
+    }
+
+    Kind  kind;
+    chatMessagePTR  msg;
+    /// Message: the deflated version, or null to send msg as is. Join
+    /// of a compressed participant: the current dictionary.
+    chatMessagePTR  compressed;
+    participantPTR  participant;
+    chatMembershipPTR  membership;
+    chatBacklogPTR  backlog;
+  };
+
+  /// The room on one shard.
+  struct Part
+    : private boost::noncopyable
+  {
+    explicit Part(boost::asio::io_service& io_service)
+      : strand(boost::asio::make_strand(io_service)),
+        members(0),
+        drain_scheduled(false),
+        compressed_members(0)
+    {
+    }
+
+    boost::asio::strand< boost::asio::io_service::executor_type >  strand;
+    /// Participants on the shard, as the home strand counts them.
+    std::size_t  members;
+    /// Home strand to part strand.
+    ChatSpscQueue< Event >  events;
+    boost::atomic< bool >  drain_scheduled;
+    ChatHandlerMemory  drain_memory;
+    /// Part strand only.
+    participants_t  participants;
+    std::size_t  compressed_members;
+    /// The messages of a drain not yet fanned out, as the participants
+    /// and as the compressed ones get them.
+    chatMessageBatch_t  pending;
+    chatMessageBatch_t  pending_compressed;
+  };
+
+  typedef boost::shared_ptr< Part >  partPTR;
+
+public:
+  ChatRoom(ChatShards& shards, boost::uint32_t id,
+      const ChatHistorySettings& history = ChatHistorySettings(),
+      const ChatCompressionSettings& compression = ChatCompressionSettings())
+    : shards_(shards),
+      strand_(boost::asio::make_strand(shards[id % shards.size()])),
+      id_(id),
+      parts_(shards.size()),
+      participant_count_(0),
+      holders_(0),
+      in_flight_(0),
+      message_count_(0),
+      compression_(compression),
+      compressed_members_(0),
+      untrained_msgs_(0),
+      trained_from_(0),
+      history_settings_(history),
+      history_opening_(false),
+      segment_requested_(false),
+      sync_interval_(history.sync_interval),
+      sync_timer_(shards[id % shards.size()]),
+      sync_scheduled_(false),
+      evicted(false)
+  {
+  }
+
+  /// Opens the history of the room, if it keeps one.
+  void start(const idleHandler_t& on_idle)
+  {
+    on_idle_ = on_idle;
+    if (history_settings_.enabled())
+    {
+      history_opening_ = true;
+      ChatHistorySyncer::instance().post(boost::bind(
+          &ChatRoom::open_history, this->shared_from_this()));
+    }
+  }
+
+  boost::uint32_t id() const
+  {
+    return id_;
+  }
+
+  /// For the metrics; may lag behind the strand.
+  std::size_t participant_count() const
+  {
+    return participant_count_.load(boost::memory_order_relaxed);
+  }
+
+  boost::uint64_t message_count() const
+  {
+    return message_count_.load(boost::memory_order_relaxed);
+  }
+
+  /// A session got the room to join; its leave() lets go of it.
+  void hold()
+  {
+    holders_.fetch_add(1);
+  }
+
+  /**
+  * Nobody holds the room and nothing they sent is still to be logged:
+  * ChatRoomDirectory may let it go, with joins and leaves still in
+  * flight. Only meaningful where hold() cannot be called meanwhile.
+  */
+  bool unused() const
+  {
+    return (holders_.load() == 0) && (in_flight_.load() == 0);
+  }
+
+  void join(const participantPTR& participant,
+      const chatMembershipPTR& membership, ChatMessage::Framing framing)
+  {
+    boost::asio::dispatch(strand_, boost::bind(&ChatRoom::do_join,
+        this->shared_from_this(), participant, membership, framing));
+  }
+
+  void leave(const chatMembershipPTR& membership)
+  {
+    boost::asio::dispatch(strand_, boost::bind(&ChatRoom::do_leave,
+        this->shared_from_this(), membership));
+    if (holders_.fetch_sub(1) == 1)
+    {
+      check_idle();
+    }
+  }
+
+  void deliver(const chatMessageBatch_t& batch)
+  {
+    in_flight_.fetch_add(1);
+    boost::asio::dispatch(strand_, boost::bind(&ChatRoom::do_deliver,
+        this->shared_from_this(), batch));
+  }
+
+  /// As deliver(batch), building the handler in the sender's memory.
+  void deliver(const chatMessageBatch_t& batch,
+      const participantPTR& sender, ChatDeliveryMemory& memory)
+  {
+    if (memory.pending.exchange(true, boost::memory_order_acquire))
+    {
+      deliver(batch);
+      return;
+    }
+    in_flight_.fetch_add(1);
+    boost::asio::dispatch(strand_, make_alloc_handler(memory.memory,
+        boost::bind(&ChatRoom::do_deliver_from, this->shared_from_this(),
+          batch, sender, &memory)));
+  }
+
+  /**
+  * Delivers messages [first, first + count) to one participant, or the
+  * last 'count' ones for ChatMessage::latest_history(), at most
+  * max_replay_msgs. Without a log only the recent messages are there.
+  */
+  void replay(const participantPTR& participant, boost::uint64_t first,
+      std::size_t count)
+  {
+    boost::asio::dispatch(strand_, boost::bind(&ChatRoom::do_replay,
+        this->shared_from_this(), participant, first, count));
+  }
+
+private:
+  /**
+  * Continues the log of the room where the last run left it, on
+  * ChatHistorySyncer's thread. If it cannot be opened the room goes on
+  * without one.
+  */
+  void open_history()
+  {
+    char  name[16];
+    std::snprintf(name, sizeof(name), "%lu",
+        static_cast< unsigned long >(id_));
+    chatHistoryLogPTR  history;
+    chatMessageBatch_t  recent;
+    try
+    {
+      history = boost::make_shared< ChatHistoryLog >(
+          history_settings_.prefix + name, history_settings_.max_segments);
+      const boost::uint64_t  end = history->end();
+      for (boost::uint64_t seq = end - std::min< boost::uint64_t >(
+             end - history->begin(), max_recent_msgs); seq < end; ++seq)
+      {
+        boost::shared_ptr< ChatMessage >  msg = make_message();
+        history->read(seq, *msg);
+        recent.push_back(msg);
+      }
+    }
+    catch (const std::exception& e)
+    {
+      CHAT_LOG(log_error, "event=history_unavailable room=%lu error=\"%s\"",
+          static_cast< unsigned long >(id_), e.what());
+      history.reset();
+      recent.clear();
+    }
+    boost::asio::post(strand_, boost::bind(&ChatRoom::history_opened,
+        this->shared_from_this(), history, recent));
+  }
+
+  /// Takes the log over, then what waited for it.
+  void history_opened(const chatHistoryLogPTR& history,
+      const chatMessageBatch_t& recent)
+  {
+    history_ = history;
+    history_opening_ = false;
+    if (history_)
+    {
+      const boost::uint64_t  end = history_->end();
+      message_count_.store(end, boost::memory_order_relaxed);
+      recent_msgs_.assign(recent.begin(), recent.end());
+      CHAT_LOG(log_info, "event=history_open room=%lu messages=%lu",
+          static_cast< unsigned long >(id_),
+          static_cast< unsigned long >(end));
+    }
+
+    deferred_t  deferred;
+    deferred.swap(deferred_);
+    for (typename deferred_t::const_iterator itr = deferred.begin();
+         itr != deferred.end(); ++itr)
+    {
+      (*itr)();
+    }
+  }
+
+  /// True, keeping 'f' for later, while the history is being opened.
+  template< typename Function >
+  bool defer(const Function& f)
+  {
+    if (history_opening_)
+    {
+      deferred_.push_back(f);
+    }
+    return history_opening_;
+  }
+
+  void do_join(const participantPTR& participant,
+      const chatMembershipPTR& membership, ChatMessage::Framing framing)
+  {
+    if (defer(boost::bind(&ChatRoom::do_join, this->shared_from_this(),
+          participant, membership, framing)))
+    {
+      return;
+    }
+    if (membership->joined)
+    {
+      return;
+    }
+    membership->joined = true;
+    partPTR&  slot = parts_[membership->shard];
+    if (!slot)
+    {
+      // Its strand and queue only where the room has participants.
+      slot = boost::make_shared< Part >(
+          boost::ref(shards_[membership->shard]));
+    }
+    Part&  part = *slot;
+    ++part.members;
+    const std::size_t  count =
+        participant_count_.load(boost::memory_order_relaxed) + 1;
+    participant_count_.store(count, boost::memory_order_relaxed);
+    ChatMetrics::adjust(ChatThreadMetrics::room_participants, 1);
+    CHAT_LOG(log_info, "event=join room=%lu participants=%lu",
+        static_cast< unsigned long >(id_),
+        static_cast< unsigned long >(count));
+
+    Event  event(Event::join);
+    event.participant = participant;
+    event.membership = membership;
+    if (!recent_msgs_.empty())
+    {
+      event.backlog = backlog(framing).snapshot();
+    }
+    if (membership->compressed)
+    {
+      if (compressed_members_++ == 0)
+      {
+        deflater_.reset(new ChatDeflater(compression_.level));
+        train();
+      }
+      event.compressed = dictionary_;
+    }
+    forward(part, event);
+    schedule_drain(part);
+  }
+
+  /// The serialized recent messages in a framing, built on first use.
+  ChatBacklogBuilder& backlog(ChatMessage::Framing framing)
+  {
+    boost::scoped_ptr< ChatBacklogBuilder >&  backlog = backlogs_[framing];
+    if (!backlog)
+    {
+      backlog.reset(new ChatBacklogBuilder(framing));
+      for (typename chatMessageQueue_t::const_iterator
+             itr = recent_msgs_.begin(); itr != recent_msgs_.end(); ++itr)
+      {
+        backlog->push_back(**itr);
+      }
+    }
+    return *backlog;
+  }
+
+  void do_leave(const chatMembershipPTR& membership)
+  {
+    if (defer(boost::bind(&ChatRoom::do_leave, this->shared_from_this(),
+          membership)))
+    {
+      return;
+    }
+    if (!membership->joined)
+    {
+      return;
+    }
+    membership->joined = false;
+    Part&  part = *parts_[membership->shard];
+    --part.members;
+    const std::size_t  count =
+        participant_count_.load(boost::memory_order_relaxed) - 1;
+    participant_count_.store(count, boost::memory_order_relaxed);
+    ChatMetrics::adjust(ChatThreadMetrics::room_participants, -1);
+    CHAT_LOG(log_info, "event=leave room=%lu participants=%lu",
+        static_cast< unsigned long >(id_),
+        static_cast< unsigned long >(count));
+
+    if (membership->compressed && (--compressed_members_ == 0))
+    {
+      // Trained again for the next one.
+      deflater_.reset();
+      dictionary_.reset();
+    }
+
+    Event  event(Event::leave);
+    event.membership = membership;
+    forward(part, event);
+    schedule_drain(part);
+  }
+
+  /// A delivery or segment request was done.
+  void done()
+  {
+    if (in_flight_.fetch_sub(1) == 1)
+    {
+      check_idle();
+    }
+  }
+
+  /**
+  * Tells the directory the room may go, after the last holder or work in
+  * flight went. Both sides look at the other after counting down, so
+  * one of them sees the room unused; the directory checks again before
+  * it lets the room go.
+  */
+  void check_idle()
+  {
+    if (unused() && on_idle_)
+    {
+      on_idle_(this);
+    }
+  }
+
+  /// The sender is bound only to keep its memory alive until here.
+  void do_deliver_from(const chatMessageBatch_t& batch,
+      const participantPTR& /*sender*/, ChatDeliveryMemory* memory)
+  {
+    memory->pending.store(false, boost::memory_order_release);
+    do_deliver(batch);
+  }
+
+  void do_deliver(const chatMessageBatch_t& batch)
+  {
+    if (defer(boost::bind(&ChatRoom::do_deliver, this->shared_from_this(),
+          batch)))
+    {
+      return;
+    }
+    ChatMetrics::count(ChatThreadMetrics::broadcasts, batch.size());
+    ChatMetrics::count(ChatThreadMetrics::deliveries, batch.size()
+        * participant_count_.load(boost::memory_order_relaxed));
+    message_count_.store(message_count_.load(boost::memory_order_relaxed)
+        + batch.size(), boost::memory_order_relaxed);
+
+    for (chatMessageBatch_t::const_iterator itr = batch.begin();
+         itr != batch.end(); ++itr)
+    {
+      const chatMessagePTR&  msg = *itr;
+      CHAT_LOG(log_debug, "event=message room=%lu length=%lu body=\"%s\"",
+          static_cast< unsigned long >(id_),
+          static_cast< unsigned long >(msg->body_length()),
+          ChatLogEscaped(msg->body(),
+            msg->body_length(ChatMessage::legacy_framing)).c_str());
+
+      if (history_)
+      {
+        append_history(msg);
+      }
+      recent_msgs_.push_back(msg);
+      for (std::size_t f = 0; f < framing_count; ++f)
+      {
+        if (backlogs_[f])
+        {
+          backlogs_[f]->push_back(*msg);
+        }
+      }
+      while (recent_msgs_.size() > max_recent_msgs)
+      {
+        for (std::size_t f = 0; f < framing_count; ++f)
+        {
+          if (backlogs_[f])
+          {
+            backlogs_[f]->pop_front(*recent_msgs_.front());
+          }
+        }
+        recent_msgs_.pop_front();
+      }
+
+      Event  event(Event::message);
+      event.msg = msg;
+      if (compressed_members_ > 0)
+      {
+        if (training_due())
+        {
+          train();
+        }
+        event.compressed = compress(*msg);
+        ++untrained_msgs_;
+      }
+      for (std::size_t i = 0; i < parts_.size(); ++i)
+      {
+        if (parts_[i] && (parts_[i]->members > 0))
+        {
+          forward(*parts_[i], event);
+        }
+      }
+    }
+
+    for (std::size_t i = 0; i < parts_.size(); ++i)
+    {
+      if (parts_[i] && (parts_[i]->members > 0))
+      {
+        schedule_drain(*parts_[i]);
+      }
+    }
+    if (history_)
+    {
+      request_segment();
+      schedule_sync();
+    }
+    done();
+  }
+
+  /// Appends to the log, or keeps the message until the log can take it.
+  void append_history(const chatMessagePTR& msg)
+  {
+    if (!unlogged_msgs_.empty() || !history_->append(*msg))
+    {
+      unlogged_msgs_.push_back(msg);
+    }
+  }
+
+  /// Has the next segment of the log made if it wants one.
+  void request_segment()
+  {
+    if (segment_requested_ || !history_->wants_segment())
+    {
+      return;
+    }
+    segment_requested_ = true;
+    in_flight_.fetch_add(1);
+    ChatHistorySyncer::instance().post(boost::bind(&ChatRoom::make_segment,
+        this->shared_from_this(), history_->path(),
+        history_->next_segment()));
+  }
+
+  /// On ChatHistorySyncer's thread.
+  void make_segment(const std::string& path, std::size_t k)
+  {
+    ChatHistoryLog::segmentPTR  segment;
+    try
+    {
+      segment = ChatHistoryLog::create_segment(path, k);
+    }
+    catch (const std::exception& e)
+    {
+      CHAT_LOG(log_error, "event=history_unavailable room=%lu error=\"%s\"",
+          static_cast< unsigned long >(id_), e.what());
+    }
+    boost::asio::post(strand_, boost::bind(&ChatRoom::segment_made,
+        this->shared_from_this(), segment));
+  }
+
+  /**
+  * Hands the segment to the log and appends what waited for it. Without
+  * one the room goes on without a log.
+  */
+  void segment_made(const ChatHistoryLog::segmentPTR& segment)
+  {
+    segment_requested_ = false;
+    if (!segment)
+    {
+      history_.reset();
+      unlogged_msgs_.clear();
+      done();
+      return;
+    }
+    history_->add_spare(segment);
+    while (!unlogged_msgs_.empty()
+        && history_->append(*unlogged_msgs_.front()))
+    {
+      unlogged_msgs_.pop_front();
+    }
+    request_segment();
+    schedule_sync();
+    done();
+  }
+
+  /**
+  * A young room trains again once its recent messages are all there,
+  * then every retrain_interval messages.
+  */
+  bool training_due() const
+  {
+    return ((trained_from_ < max_recent_msgs)
+            && (recent_msgs_.size() >= max_recent_msgs))
+        || ((compression_.retrain_interval > 0)
+            && (untrained_msgs_ >= compression_.retrain_interval));
+  }
+
+  /**
+  * Makes a dictionary of the recent messages and, if there is one in
+  * use, passes it on to the parts ahead of the messages deflated with
+  * it.
+  */
+  void train()
+  {
+    std::string  dictionary;
+    ChatDeflater::train(recent_msgs_.begin(), recent_msgs_.end(),
+        compression_.dictionary_size, dictionary);
+    deflater_->dictionary(dictionary.data(), dictionary.size());
+    untrained_msgs_ = 0;
+    trained_from_ = recent_msgs_.size();
+
+    boost::shared_ptr< ChatMessage >  frame = make_message();
+    frame->type(ChatMessage::type_dictionary);
+    frame->room(id_);
+    frame->body_length(dictionary.size());
+    if (!dictionary.empty())
+    {
+      // An empty body has no buffer.
+      std::memcpy(frame->body(), dictionary.data(), dictionary.size());
+    }
+    frame->encode_headers();
+    const bool  replaced = (dictionary_.get() != 0);
+    dictionary_ = frame;
+    CHAT_LOG(log_debug, "event=dictionary room=%lu length=%lu",
+        static_cast< unsigned long >(id_),
+        static_cast< unsigned long >(dictionary.size()));
+    if (!replaced)
+    {
+      return;
+    }
+
+    Event  event(Event::dictionary);
+    event.msg = dictionary_;
+    for (std::size_t i = 0; i < parts_.size(); ++i)
+    {
+      if (parts_[i] && (parts_[i]->members > 0))
+      {
+        forward(*parts_[i], event);
+      }
+    }
+  }
+
+  /// The deflated message, or null if it would not be shorter.
+  chatMessagePTR compress(const ChatMessage& msg)
+  {
+    boost::shared_ptr< ChatMessage >  compressed = make_message();
+    const bool  shorter = deflater_->compress(msg, *compressed);
+    ChatMetrics::count(ChatThreadMetrics::deflate_in, msg.body_length());
+    ChatMetrics::count(ChatThreadMetrics::deflate_out,
+        shorter ? compressed->body_length() : msg.body_length());
+    return shorter ? chatMessagePTR(compressed) : chatMessagePTR();
+  }
+
+  void forward(Part& part, const Event& event)
+  {
+    part.events.push(event);
+    ChatMetrics::count(ChatThreadMetrics::forwards);
+  }
+
+  /// Makes sure a drain of the part is on its way after a push.
+  void schedule_drain(Part& part)
+  {
+    if (!part.drain_scheduled.exchange(true, boost::memory_order_acq_rel))
+    {
+      boost::asio::post(part.strand, make_alloc_handler(part.drain_memory,
+          boost::bind(&ChatRoom::drain, this->shared_from_this(), &part)));
+    }
+  }
+
+  /**
+  * Carries out on the part's strand what the room queued for it. The
+  * flag is cleared first: whatever is pushed from then on either is
+  * taken by this drain or posts the next one.
+  */
+  void drain(Part* part)
+  {
+    part->drain_scheduled.exchange(false, boost::memory_order_acq_rel);
+    ChatScopedTimer  timer(ChatThreadMetrics::broadcast_time);
+    participants_t&  participants = part->participants;
+    Event  event;
+    while (part->events.pop(event))
+    {
+      if (event.kind == Event::message)
+      {
+        part->pending.push_back(event.msg);
+        if (part->compressed_members > 0)
+        {
+          part->pending_compressed.push_back(
+              event.compressed ? event.compressed : event.msg);
+        }
+        continue;
+      }
+      if (event.kind == Event::dictionary)
+      {
+        if (part->compressed_members > 0)
+        {
+          part->pending_compressed.push_back(event.msg);
+        }
+        continue;
+      }
+      // The membership changes between two messages, not under them.
+      fan_out(*part);
+      const bool  compressed = event.membership->compressed;
+      switch (event.kind)
+      {
+        case Event::join:
+          event.membership->handle = participants.insert(
+              Member(event.participant, compressed));
+          part->compressed_members += compressed;
+          if (event.backlog)
+          {
+            event.participant->deliver(event.backlog);
+          }
+          if (event.compressed)
+          {
+            event.participant->deliver(
+                chatMessageBatch_t(1, event.compressed));
+          }
+          break;
+
+        case Event::leave:
+          participants.erase(event.membership->handle);
+          event.membership->handle = ChatSlotHandle();
+          part->compressed_members -= compressed;
+          break;
+
+        default:
+          break;
+      }
+    }
+    fan_out(*part);
+  }
+
+  /// Hands the pending messages of a part to each of its participants.
+  void fan_out(Part& part)
+  {
+    if (part.pending.empty() && part.pending_compressed.empty())
+    {
+      return;
+    }
+    participants_t&  participants = part.participants;
+    for (typename participants_t::iterator member = participants.begin();
+         member != participants.end(); ++member)
+    {
+      const chatMessageBatch_t&  batch =
+          member->compressed ? part.pending_compressed : part.pending;
+      if (!batch.empty())
+      {
+        member->participant->deliver(batch);
+      }
+    }
+    ChatMetrics::count(ChatThreadMetrics::fan_outs);
+    part.pending.clear();
+    part.pending_compressed.clear();
+  }
+
+  void do_replay(const participantPTR& participant, boost::uint64_t first,
+      std::size_t count)
+  {
+    if (defer(boost::bind(&ChatRoom::do_replay, this->shared_from_this(),
+          participant, first, count)))
+    {
+      return;
+    }
+    count = std::min< std::size_t >(count, max_replay_msgs);
+    const boost::uint64_t  end =
+        message_count_.load(boost::memory_order_relaxed);
+    const boost::uint64_t  recent_begin = end - recent_msgs_.size();
+    const boost::uint64_t  begin = history_ ? history_->begin() : recent_begin;
+    if (first == ChatMessage::latest_history())
+    {
+      first = end - std::min< boost::uint64_t >(count, end - begin);
+    }
+    first = std::max(first, begin);
+    const boost::uint64_t  last =
+        (first < end) ? std::min< boost::uint64_t >(end, first + count) : end;
+    if (first >= last)
+    {
+      return;
+    }
+
+    chatMessageBatch_t  batch;
+    batch.reserve(std::size_t(last - first));
+    for (boost::uint64_t seq = first; seq < last; ++seq)
+    {
+      if (seq >= recent_begin)
+      {
+        batch.push_back(recent_msgs_[std::size_t(seq - recent_begin)]);
+      }
+      else
+      {
+        // Not there while it waits for its segment.
+        boost::shared_ptr< ChatMessage >  msg = make_message();
+        if (history_->read(seq, *msg))
+        {
+          batch.push_back(msg);
+        }
+      }
+    }
+    participant->deliver(batch);
+  }
+
+  /**
+  * Gets the appended messages to the disk within sync_interval_, with
+  * one msync for all that arrive meanwhile, done off the event loop by
+  * ChatHistorySyncer.
+  */
+  void schedule_sync()
+  {
+    if (sync_interval_ <= 0)
+    {
+      history_->sync();
+      return;
+    }
+    if (sync_scheduled_)
+    {
+      return;
+    }
+    sync_scheduled_ = true;
+    sync_timer_.expires_from_now(
+        boost::posix_time::milliseconds(sync_interval_));
+    sync_timer_.async_wait(boost::asio::bind_executor(strand_,
+        boost::bind(&ChatRoom::handle_sync, this->shared_from_this(),
+          boost::asio::placeholders::error)));
+  }
+
+  void handle_sync(const boost::system::error_code& error)
+  {
+    sync_scheduled_ = false;
+    if (!error && history_)
+    {
+      history_->sync();
+    }
+  }
+
+private:
+  ChatShards&  shards_;
+  boost::asio::strand< boost::asio::io_service::executor_type >  strand_;
+  const boost::uint32_t  id_;
+  /// By shard; null until a participant of that shard joins.
+  std::vector< partPTR >  parts_;
+  boost::atomic< std::size_t >  participant_count_;
+  /// Sessions the directory handed the room to, not gone yet.
+  boost::atomic< std::size_t >  holders_;
+  /// Deliveries and segment requests not done yet.
+  boost::atomic< std::size_t >  in_flight_;
+  idleHandler_t  on_idle_;
+  boost::atomic< boost::uint64_t >  message_count_;
+  enum { max_recent_msgs = 100 };
+  chatMessageQueue_t  recent_msgs_;
+
+  /// Per framing, built when the first participant of it joins.
+  enum { framing_count = 2 };
+  boost::scoped_ptr< ChatBacklogBuilder >  backlogs_[framing_count];
+
+  const ChatCompressionSettings  compression_;
+  /// While there are compressed participants: the deflater, and its
+  /// dictionary as a message.
+  std::size_t  compressed_members_;
+  boost::scoped_ptr< ChatDeflater >  deflater_;
+  chatMessagePTR  dictionary_;
+  /// Messages since the last training, and the number trained from.
+  std::size_t  untrained_msgs_;
+  std::size_t  trained_from_;
+
+  enum { max_replay_msgs = 1000 };
+  const ChatHistorySettings  history_settings_;
+  /// Null unless history is enabled and the log could be opened.
+  chatHistoryLogPTR  history_;
+  /// While the log is opened: what reached the room meanwhile.
+  bool  history_opening_;
+  typedef std::vector< boost::function< void () > >  deferred_t;
+  deferred_t  deferred_;
+  /// Messages behind the log, waiting for the segment requested.
+  bool  segment_requested_;
+  chatMessageQueue_t  unlogged_msgs_;
+  const long  sync_interval_;
+  boost::asio::deadline_timer  sync_timer_;
+  bool  sync_scheduled_;
+
+public:
+  /// Kept by ChatRoomDirectory under the lock of its idle rooms.
+  boost::intrusive::list_member_hook<>  idle_hook;
+  bool  evicted;
+};
+
+#endif // CHAT_ROOM_HPP
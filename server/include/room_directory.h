@@ -0,0 +1,257 @@
+//
+// room_directory.h
+// ~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_ROOM_DIRECTORY_HPP
+#define CHAT_ROOM_DIRECTORY_HPP
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/intrusive/list.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include "room.h"
+
+
+/**
+* Rooms of one listener by ID, created on first join, at most max_rooms
+* of them. A room tells the directory when the last session it was
+* handed to left it and nothing those sent is still to be logged; it
+* then waits in a list of idle rooms, oldest first, and the next room
+* created beyond max_rooms takes the place of the first of them. A join
+* refused for the limit costs a look at that list. A room let go keeps
+* its history on the disk, where it is read again if the room comes
+* back; without history its recent messages are gone with it.
+*
+* The directory is split into shard_count shards by a hash of the room
+* ID, each with its own lock, so sessions on different threads looking up
+* different rooms rarely meet. The lock is only held for the lookup;
+* everything else happens on the room's strand.
+*
+* With history enabled a room opens its log when it is created, on
+* ChatHistorySyncer's thread rather than under the shard lock.
+*/
+template< typename Participant >
+class ChatRoomDirectory
+  : private boost::noncopyable
+{
+public:
+  typedef ChatRoom< Participant >  room_t;
+  typedef boost::shared_ptr< room_t >  roomPTR;
+
+  enum { shard_bits = 6 };
+  enum { shard_count = 1 << shard_bits };
+
+  enum { default_max_rooms = 65536 };
+
+  explicit ChatRoomDirectory(ChatShards& shards,
+      const ChatHistorySettings& history = ChatHistorySettings(),
+      const ChatCompressionSettings& compression = ChatCompressionSettings(),
+      std::size_t max_rooms = default_max_rooms)
+    : event_loops_(shards),
+      history_(history),
+      compression_(compression),
+      max_rooms_(max_rooms),
+      room_count_(0)
+  {
+  }
+
+  ~ChatRoomDirectory()
+  {
+    // The rooms may outlive the directory in a handler.
+    boost::mutex::scoped_lock  lock(idle_mutex_);
+    idle_rooms_.clear();
+  }
+
+  /**
+  * Null when the room does not exist, max_rooms do and none of them is
+  * idle. The caller must join() the room it gets, and leave() it.
+  */
+  roomPTR find_or_create(boost::uint32_t id)
+  {
+    Shard&  shard = shard_of(id);
+    {
+      boost::mutex::scoped_lock  lock(shard.mutex);
+      const roomPTR  room = find_for_join(shard, id);
+      if (room)
+      {
+        return room;
+      }
+    }
+    if (!reserve())
+    {
+      return roomPTR();
+    }
+    boost::mutex::scoped_lock  lock(shard.mutex);
+    const roomPTR  room = find_for_join(shard, id);
+    if (room)
+    {
+      // Made by another session meanwhile.
+      room_count_.fetch_sub(1, boost::memory_order_relaxed);
+      return room;
+    }
+    return create(shard, id);
+  }
+
+  /// Null when nobody has joined the room yet.
+  roomPTR find(boost::uint32_t id)
+  {
+    Shard&  shard = shard_of(id);
+    boost::mutex::scoped_lock  lock(shard.mutex);
+    const typename rooms_t::const_iterator  itr = shard.rooms.find(id);
+    return (itr == shard.rooms.end()) ? roomPTR() : itr->second;
+  }
+
+  /// Without a lock: counts the places taken for rooms being created.
+  std::size_t size() const
+  {
+    return room_count_.load(boost::memory_order_relaxed);
+  }
+
+private:
+  typedef boost::unordered_map< boost::uint32_t, roomPTR >  rooms_t;
+
+  struct Shard
+  {
+    boost::mutex  mutex;
+    rooms_t  rooms;
+  };
+
+  typedef boost::intrusive::list< room_t,
+      boost::intrusive::member_hook< room_t,
+        boost::intrusive::list_member_hook<>, &room_t::idle_hook > >
+      idleRooms_t;
+
+  /**
+  * Under the shard's lock, which keeps the room from being let go before
+  * it is held.
+  */
+  roomPTR find_for_join(Shard& shard, boost::uint32_t id)
+  {
+    const typename rooms_t::const_iterator  itr = shard.rooms.find(id);
+    if (itr == shard.rooms.end())
+    {
+      return roomPTR();
+    }
+    const roomPTR&  room = itr->second;
+    room->hold();
+    boost::mutex::scoped_lock  lock(idle_mutex_);
+    if (room->idle_hook.is_linked())
+    {
+      idle_rooms_.erase(idle_rooms_.iterator_to(*room));
+    }
+    return room;
+  }
+
+  /// Under the shard's lock, with a place reserved.
+  roomPTR create(Shard& shard, boost::uint32_t id)
+  {
+    const roomPTR  room = boost::make_shared< room_t >(
+        boost::ref(event_loops_), id, boost::cref(history_),
+        boost::cref(compression_));
+    room->hold();
+    room->start(boost::bind(&ChatRoomDirectory::handle_idle, this, _1));
+    shard.rooms[id] = room;
+    return room;
+  }
+
+  /// Takes a place for a new room, letting idle ones go if need be.
+  bool reserve()
+  {
+    while (room_count_.fetch_add(1, boost::memory_order_relaxed)
+        >= max_rooms_)
+    {
+      room_count_.fetch_sub(1, boost::memory_order_relaxed);
+      if (!evict_oldest())
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// From the thread that let the room go idle.
+  void handle_idle(room_t* room)
+  {
+    boost::mutex::scoped_lock  lock(idle_mutex_);
+    if (!room->evicted && !room->idle_hook.is_linked())
+    {
+      idle_rooms_.push_back(*room);
+    }
+  }
+
+  /**
+  * Lets the room idle for longest go; false if there is none. A room
+  * found in use since it became idle only leaves the list: it comes
+  * back when it is idle again.
+  */
+  bool evict_oldest()
+  {
+    for ( ; ; )
+    {
+      const room_t*  oldest;
+      boost::uint32_t  id;
+      {
+        boost::mutex::scoped_lock  lock(idle_mutex_);
+        if (idle_rooms_.empty())
+        {
+          return false;
+        }
+        oldest = &idle_rooms_.front();
+        id = oldest->id();
+        idle_rooms_.pop_front();
+      }
+
+      // Only an eviction erases a room, and only one holds it.
+      Shard&  shard = shard_of(id);
+      boost::mutex::scoped_lock  lock(shard.mutex);
+      const typename rooms_t::iterator  itr = shard.rooms.find(id);
+      if ((itr == shard.rooms.end()) || (itr->second.get() != oldest)
+          || !itr->second->unused())
+      {
+        continue;
+      }
+      {
+        boost::mutex::scoped_lock  idle_lock(idle_mutex_);
+        room_t&  room = *itr->second;
+        if (room.idle_hook.is_linked())
+        {
+          idle_rooms_.erase(idle_rooms_.iterator_to(room));
+        }
+        room.evicted = true;
+      }
+      shard.rooms.erase(itr);
+      room_count_.fetch_sub(1, boost::memory_order_relaxed);
+      return true;
+    }
+  }
+
+  Shard& shard_of(boost::uint32_t id)
+  {
+    // Fibonacci hashing spreads sequential IDs over all shards.
+    const boost::uint32_t  hash = id * 2654435769u;
+    return shards_[hash >> (32 - shard_bits)];
+  }
+
+private:
+  ChatShards&  event_loops_;
+  const ChatHistorySettings  history_;
+  const ChatCompressionSettings  compression_;
+  const std::size_t  max_rooms_;
+  boost::atomic< std::size_t >  room_count_;
+  Shard  shards_[shard_count];
+  /// Lock order: a shard's, then this one.
+  boost::mutex  idle_mutex_;
+  idleRooms_t  idle_rooms_;
+};
+
+#endif // CHAT_ROOM_DIRECTORY_HPP
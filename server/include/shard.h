@@ -0,0 +1,95 @@
+//
+// shard.h
+// ~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_SHARD_HPP
+#define CHAT_SHARD_HPP
+
+#include <cstddef>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+
+/**
+* The event loops of the process, one per worker thread.
+*
+* Each shard is an io_service run by one thread, and every session
+* belongs to one shard for its lifetime: its socket, its strand and the
+* part of each room that holds it live there, so delivering to it never
+* crosses threads. Rooms reach the other shards through ChatSpscQueue.
+*/
+class ChatShards
+  : private boost::noncopyable
+{
+public:
+  explicit ChatShards(std::size_t count)
+    : next_(0)
+  {
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      const ioServicePTR  io_service =
+          boost::make_shared< boost::asio::io_service >();
+      services_.push_back(io_service);
+      // A shard without sessions yet must not run out of work.
+      work_.push_back(boost::make_shared< boost::asio::io_service::work >(
+          boost::ref(*io_service)));
+    }
+  }
+
+  std::size_t size() const
+  {
+    return services_.size();
+  }
+
+  boost::asio::io_service& operator[](std::size_t i)
+  {
+    return *services_[i];
+  }
+
+  /// Shards taken in turn, for new sessions.
+  std::size_t next()
+  {
+    return next_.fetch_add(1, boost::memory_order_relaxed) % size();
+  }
+
+  /// Runs every shard on a thread of its own until stop().
+  void run()
+  {
+    boost::thread_group  threads;
+    for (std::size_t i = 0; i < size(); ++i)
+    {
+      threads.create_thread(boost::bind(&boost::asio::io_service::run,
+          services_[i].get()));
+    }
+    threads.join_all();
+  }
+
+  void stop()
+  {
+    for (std::size_t i = 0; i < size(); ++i)
+    {
+      services_[i]->stop();
+    }
+  }
+
+private:
+  typedef boost::shared_ptr< boost::asio::io_service >  ioServicePTR;
+  typedef boost::shared_ptr< boost::asio::io_service::work >  workPTR;
+
+  std::vector< ioServicePTR >  services_;
+  std::vector< workPTR >  work_;
+  boost::atomic< std::size_t >  next_;
+};
+
+#endif // CHAT_SHARD_HPP
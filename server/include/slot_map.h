@@ -0,0 +1,165 @@
+//
+// slot_map.h
+// ~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_SLOT_MAP_HPP
+#define CHAT_SLOT_MAP_HPP
+
+#include <algorithm>
+#include <vector>
+#include <boost/cstdint.hpp>
+
+
+/**
+* Handle of a value in ChatSlotMap. It stays valid until the value is
+* erased; a stale handle is recognized by its generation.
+*/
+struct ChatSlotHandle
+{
+  enum { invalid_index = 0xffffffff };
+
+  ChatSlotHandle()
+    : index(invalid_index),
+      generation(0)
+  {
+  }
+
+  ChatSlotHandle(boost::uint32_t index_, boost::uint32_t generation_)
+    : index(index_),
+      generation(generation_)
+  {
+  }
+
+  bool valid() const
+  {
+    return index != boost::uint32_t(invalid_index);
+  }
+
+  boost::uint32_t  index;
+  boost::uint32_t  generation;
+};
+
+
+
+
+/**
+* Values kept contiguous in insertion-independent order, so iterating
+* them is a linear scan. Insert and erase are O(1): erase moves the last
+* value into the hole.
+*
+* Handles point into a slot array which maps them to the current dense
+* position; freed slots are chained into a free list and reused with a
+* bumped generation.
+*/
+template< typename T >
+class ChatSlotMap
+{
+public:
+  typedef typename std::vector< T >::iterator  iterator;
+  typedef typename std::vector< T >::const_iterator  const_iterator;
+
+  ChatSlotMap()
+    : free_head_(no_slot)
+  {
+  }
+
+  ChatSlotHandle insert(const T& value)
+  {
+    boost::uint32_t  index;
+    if (free_head_ != no_slot)
+    {
+      index = free_head_;
+      free_head_ = slots_[index].dense;
+    }
+    else
+    {
+      index = static_cast< boost::uint32_t >(slots_.size());
+      slots_.push_back(Slot());
+    }
+
+    Slot&  slot = slots_[index];
+    slot.dense = static_cast< boost::uint32_t >(values_.size());
+    values_.push_back(value);
+    dense_slots_.push_back(index);
+    return ChatSlotHandle(index, slot.generation);
+  }
+
+  /// Returns false for a stale handle.
+  bool erase(const ChatSlotHandle& handle)
+  {
+    if (!contains(handle))
+    {
+      return false;
+    }
+
+    Slot&  slot = slots_[handle.index];
+    const boost::uint32_t  dense = slot.dense;
+    const boost::uint32_t  last =
+        static_cast< boost::uint32_t >(values_.size() - 1);
+    if (dense != last)
+    {
+      using std::swap;
+      swap(values_[dense], values_[last]);
+      dense_slots_[dense] = dense_slots_[last];
+      slots_[dense_slots_[dense]].dense = dense;
+    }
+    values_.pop_back();
+    dense_slots_.pop_back();
+
+    ++slot.generation;
+    slot.dense = free_head_;
+    free_head_ = handle.index;
+    return true;
+  }
+
+  bool contains(const ChatSlotHandle& handle) const
+  {
+    return (handle.index < slots_.size())
+        && (slots_[handle.index].generation == handle.generation);
+  }
+
+  /// Null for a stale handle.
+  T* find(const ChatSlotHandle& handle)
+  {
+    return contains(handle) ? &values_[slots_[handle.index].dense] : 0;
+  }
+
+  std::size_t size() const
+  {
+    return values_.size();
+  }
+
+  bool empty() const
+  {
+    return values_.empty();
+  }
+
+  iterator begin() { return values_.begin(); }
+  iterator end() { return values_.end(); }
+  const_iterator begin() const { return values_.begin(); }
+  const_iterator end() const { return values_.end(); }
+
+private:
+  enum { no_slot = 0xffffffff };
+
+  struct Slot
+  {
+    Slot() : dense(0), generation(0) {}
+    /// Position in values_, or the next free slot.
+    boost::uint32_t  dense;
+    boost::uint32_t  generation;
+  };
+
+  std::vector< T >  values_;
+  /// Slot index of every value, parallel to values_.
+  std::vector< boost::uint32_t >  dense_slots_;
+  std::vector< Slot >  slots_;
+  boost::uint32_t  free_head_;
+};
+
+#endif // CHAT_SLOT_MAP_HPP
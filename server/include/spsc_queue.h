@@ -0,0 +1,158 @@
+//
+// spsc_queue.h
+// ~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_SPSC_QUEUE_HPP
+#define CHAT_SPSC_QUEUE_HPP
+
+#include <cstddef>
+#include <new>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include "buffer_pool.h"
+
+
+/**
+* Unbounded lock-free queue between one producer and one consumer; each
+* side may move between threads as long as its calls do not overlap (a
+* strand qualifies).
+*
+* Items live in chunks of chunk_capacity linked in order. The producer
+* constructs an item in the tail chunk and publishes it by bumping the
+* chunk's count; the consumer takes items up to that count and follows
+* the link once a chunk is used up. The chunk left behind is kept as the
+* producer's spare, so a steady stream allocates nothing; chunks come
+* from ChatBufferPool.
+*/
+template< typename T >
+class ChatSpscQueue
+  : private boost::noncopyable
+{
+public:
+  enum { chunk_capacity = 32 };
+
+  ChatSpscQueue()
+    : head_(new_chunk()),
+      read_(0),
+      tail_(head_),
+      spare_(0)
+  {
+  }
+
+  ~ChatSpscQueue()
+  {
+    T  item;
+    while (pop(item))
+    {
+    }
+    free_chunk(head_);
+    free_chunk(spare_.load(boost::memory_order_acquire));
+  }
+
+  /// Producer side.
+  void push(const T& item)
+  {
+    Chunk*  chunk = tail_;
+    std::size_t  count = chunk->count.load(boost::memory_order_relaxed);
+    if (count == chunk_capacity)
+    {
+      Chunk*  next = spare_.exchange(0, boost::memory_order_acquire);
+      if (next)
+      {
+        next->count.store(0, boost::memory_order_relaxed);
+        next->next.store(0, boost::memory_order_relaxed);
+      }
+      else
+      {
+        next = new_chunk();
+      }
+      chunk->next.store(next, boost::memory_order_release);
+      tail_ = chunk = next;
+      count = 0;
+    }
+    new (chunk->slot(count)) T(item);
+    chunk->count.store(count + 1, boost::memory_order_release);
+  }
+
+  /// Consumer side: takes the oldest item; false if there is none.
+  bool pop(T& item)
+  {
+    Chunk*  chunk = head_;
+    if (read_ == chunk_capacity)
+    {
+      Chunk*  next = chunk->next.load(boost::memory_order_acquire);
+      if (!next)
+      {
+        return false;
+      }
+      // The producer has moved on for good once it linked the next one.
+      recycle(chunk);
+      head_ = chunk = next;
+      read_ = 0;
+    }
+    if (read_ == chunk->count.load(boost::memory_order_acquire))
+    {
+      return false;
+    }
+    T*  slot = chunk->slot(read_++);
+    item = *slot;
+    slot->~T();
+    return true;
+  }
+
+private:
+  struct Chunk
+  {
+    T* slot(std::size_t i)
+    {
+      return static_cast< T* >(storage.address()) + i;
+    }
+
+    boost::atomic< std::size_t >  count;
+    boost::atomic< Chunk* >  next;
+    boost::aligned_storage< sizeof(T) * chunk_capacity,
+        boost::alignment_of< T >::value >  storage;
+  };
+
+  static Chunk* new_chunk()
+  {
+    Chunk*  chunk = static_cast< Chunk* >(
+        ChatBufferPool::instance().allocate(sizeof(Chunk)));
+    new (&chunk->count) boost::atomic< std::size_t >(0);
+    new (&chunk->next) boost::atomic< Chunk* >(0);
+    return chunk;
+  }
+
+  static void free_chunk(Chunk* chunk)
+  {
+    ChatBufferPool::instance().deallocate(chunk, sizeof(Chunk));
+  }
+
+  void recycle(Chunk* chunk)
+  {
+    Chunk*  expected = 0;
+    if (!spare_.compare_exchange_strong(expected, chunk,
+          boost::memory_order_release, boost::memory_order_relaxed))
+    {
+      free_chunk(chunk);
+    }
+  }
+
+private:
+  /// Consumer's: the chunk being read and the items taken from it.
+  Chunk*  head_;
+  std::size_t  read_;
+  /// Producer's: the chunk being written.
+  Chunk*  tail_;
+  /// A used-up chunk handed back from the consumer to the producer.
+  boost::atomic< Chunk* >  spare_;
+};
+
+#endif // CHAT_SPSC_QUEUE_HPP
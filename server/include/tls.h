@@ -0,0 +1,440 @@
+//
+// tls.h
+// ~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_TLS_HPP
+#define CHAT_TLS_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/noncopyable.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include "buffer_pool.h"
+
+
+/**
+* The certificate of the listeners; TLS is off without one.
+*/
+struct ChatTlsSettings
+{
+  ChatTlsSettings()
+    : kernel_offload(true)
+  {
+  }
+
+  bool enabled() const
+  {
+    return !certificate_chain.empty();
+  }
+
+  /// PEM files; the key may be in the certificate chain file.
+  std::string  certificate_chain;
+  std::string  private_key;
+  /// Lets OpenSSL hand the record layer to the kernel (kTLS) after the
+  /// handshake, where the kernel supports it.
+  bool  kernel_offload;
+};
+
+//----------------------------------------------------------------------
+
+/**
+* Server side TLS configuration, one for the process, so a ticket
+* issued on one listener or thread resumes on any other.
+*
+* Resumption is by stateless tickets (RFC 5077, and the TLS 1.3
+* equivalent): the session state travels with the client, encrypted
+* under a key of the context, so there is no server-side cache to
+* share between threads. One ticket is issued per handshake.
+*
+* OpenSSL drops the record buffers of a connection while it has nothing
+* buffered, so an idle TLS session costs little more than a plain one.
+*/
+class ChatTlsContext
+  : private boost::noncopyable
+{
+public:
+  /// Throws boost::system::system_error if the files cannot be used.
+  explicit ChatTlsContext(const ChatTlsSettings& settings)
+    : context_(boost::asio::ssl::context::tls_server)
+  {
+    context_.set_options(boost::asio::ssl::context::default_workarounds
+        | boost::asio::ssl::context::no_sslv2
+        | boost::asio::ssl::context::no_sslv3
+        | boost::asio::ssl::context::no_tlsv1
+        | boost::asio::ssl::context::no_tlsv1_1);
+    context_.use_certificate_chain_file(settings.certificate_chain);
+    context_.use_private_key_file(settings.private_key.empty()
+        ? settings.certificate_chain : settings.private_key,
+        boost::asio::ssl::context::pem);
+
+    SSL_CTX*  context = context_.native_handle();
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE
+        | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets(context, 1);
+#if defined(SSL_OP_ENABLE_KTLS)
+    if (settings.kernel_offload)
+    {
+      SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+  }
+
+  SSL_CTX* native_handle()
+  {
+    return context_.native_handle();
+  }
+
+private:
+  boost::asio::ssl::context  context_;
+};
+
+//----------------------------------------------------------------------
+
+/**
+* The server end of TLS on a connected, non-blocking socket. OpenSSL
+* reads and writes the socket itself, which lets it move the keys into
+* the kernel once the handshake is done: with kTLS for a direction the
+* session goes back to plain reads or gathered writes on the socket for
+* it, and the kernel does the records.
+*
+* Otherwise the records are done here. Reads go through read_some()
+* once the socket is readable. Writes go through async_write_some(),
+* which copies the buffer sequence into one staging buffer and writes
+* it as full-sized records; Asio's ssl::stream would instead make one
+* record of each buffer, header and body apart.
+*
+* Not thread-safe: every call has to come from the session's strand.
+*/
+class ChatTlsStream
+  : private boost::noncopyable
+{
+public:
+  typedef boost::asio::ip::tcp::socket  socket_t;
+  typedef socket_t::executor_type  executor_type;
+
+  /// The socket has to outlive the stream.
+  ChatTlsStream(ChatTlsContext& context, socket_t& socket)
+    : socket_(socket),
+      ssl_(SSL_new(context.native_handle())),
+      read_wait_(socket_t::wait_read),
+      write_wait_(socket_t::wait_write),
+      send_offloaded_(false),
+      recv_offloaded_(false),
+      stage_(0),
+      staged_(0),
+      stage_offset_(0)
+  {
+    if (!ssl_ || !SSL_set_fd(ssl_, int(socket.native_handle())))
+    {
+      SSL_free(ssl_);
+      throw boost::system::system_error(last_error());
+    }
+    SSL_set_accept_state(ssl_);
+  }
+
+  ~ChatTlsStream()
+  {
+    if (stage_)
+    {
+      ChatBufferPool::instance().deallocate(stage_, stage_size);
+    }
+    SSL_free(ssl_);
+  }
+
+  executor_type get_executor()
+  {
+    return socket_.get_executor();
+  }
+
+  /**
+  * Takes the handshake as far as the socket allows. Returns true once it
+  * is done; otherwise error is set, to would_block if the socket has to
+  * become ready for read_wait() first.
+  */
+  bool handshake(boost::system::error_code& error)
+  {
+    ERR_clear_error();
+    const int  result = SSL_do_handshake(ssl_);
+    if (result != 1)
+    {
+      error = translate(result, read_wait_);
+      return false;
+    }
+    error = boost::system::error_code();
+#if !defined(OPENSSL_NO_KTLS)
+    send_offloaded_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+    recv_offloaded_ = BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+#endif
+    return true;
+  }
+
+  /// The handshake is over.
+  bool established() const
+  {
+    return SSL_is_init_finished(ssl_) == 1;
+  }
+
+  bool resumed() const
+  {
+    return SSL_session_reused(ssl_) == 1;
+  }
+
+  const char* version() const
+  {
+    return SSL_get_version(ssl_);
+  }
+
+  /// The kernel writes the records; write to the socket directly.
+  bool send_offloaded() const
+  {
+    return send_offloaded_;
+  }
+
+  /// The kernel reads the records; read from the socket directly.
+  bool recv_offloaded() const
+  {
+    return recv_offloaded_;
+  }
+
+  /// What to wait for before calling read_some() again after would_block.
+  socket_t::wait_type read_wait() const
+  {
+    return read_wait_;
+  }
+
+  /**
+  * Data OpenSSL has taken off the socket but not handed out yet, when
+  * the last read_some() had not the room for a whole record: read it
+  * without waiting for the socket.
+  */
+  bool pending() const
+  {
+    return SSL_has_pending(ssl_) == 1;
+  }
+
+  /// Decrypts what the socket has into the buffers, without blocking.
+  template< typename MutableBufferSequence >
+  std::size_t read_some(const MutableBufferSequence& buffers,
+      boost::system::error_code& error)
+  {
+    error = boost::system::error_code();
+    std::size_t  total = 0;
+    for (typename MutableBufferSequence::const_iterator
+           itr = buffers.begin(); itr != buffers.end(); ++itr)
+    {
+      const boost::asio::mutable_buffer  buffer(*itr);
+      if (buffer.size() == 0)
+      {
+        continue;
+      }
+      std::size_t  n = 0;
+      ERR_clear_error();
+      const int  result = SSL_read_ex(ssl_, buffer.data(), buffer.size(), &n);
+      if (result != 1)
+      {
+        if (total == 0)
+        {
+          error = translate(result, read_wait_);
+        }
+        break;
+      }
+      total += n;
+      if (n < buffer.size())
+      {
+        break;
+      }
+    }
+    return total;
+  }
+
+  /**
+  * Encrypts and writes as much of the buffers as the socket takes,
+  * without blocking. Bytes taken into the staging buffer but not yet
+  * written are not counted: the next call has to start with the same
+  * bytes, as a write_some() caller's next call does.
+  */
+  template< typename ConstBufferSequence >
+  std::size_t write_some(const ConstBufferSequence& buffers,
+      boost::system::error_code& error)
+  {
+    error = boost::system::error_code();
+    if (staged_ == 0)
+    {
+      if (!stage_)
+      {
+        stage_ = static_cast< char* >(
+            ChatBufferPool::instance().allocate(stage_size));
+      }
+      staged_ = boost::asio::buffer_copy(
+          boost::asio::buffer(stage_, stage_size), buffers);
+      stage_offset_ = 0;
+    }
+
+    std::size_t  total = 0;
+    while (stage_offset_ < staged_)
+    {
+      // One record per call: the mode allows partial writes.
+      std::size_t  n = 0;
+      ERR_clear_error();
+      const int  result = SSL_write_ex(ssl_, stage_ + stage_offset_,
+          staged_ - stage_offset_, &n);
+      if (result != 1)
+      {
+        if (total == 0)
+        {
+          error = translate(result, write_wait_);
+        }
+        break;
+      }
+      stage_offset_ += n;
+      total += n;
+    }
+    if (stage_offset_ == staged_)
+    {
+      staged_ = 0;
+    }
+    return total;
+  }
+
+  /**
+  * AsyncWriteStream for async_write(). Writes at once and waits for the
+  * socket only when OpenSSL asks for it; a write finished without a
+  * wait completes through a post, so the handler never runs inside the
+  * initiating call.
+  */
+  template< typename ConstBufferSequence, typename WriteHandler >
+  BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler,
+      void (boost::system::error_code, std::size_t))
+  async_write_some(const ConstBufferSequence& buffers,
+      BOOST_ASIO_MOVE_ARG(WriteHandler) handler)
+  {
+    return boost::asio::async_compose< WriteHandler,
+        void (boost::system::error_code, std::size_t) >(
+          WriteOp< ConstBufferSequence >(*this, buffers), handler, socket_);
+  }
+
+  /// Gives the staging buffer back to the pool if nothing is in it.
+  void release()
+  {
+    if (stage_ && (staged_ == 0))
+    {
+      ChatBufferPool::instance().deallocate(stage_, stage_size);
+      stage_ = 0;
+    }
+  }
+
+private:
+  template< typename ConstBufferSequence >
+  struct WriteOp
+  {
+    enum State { initiating, waiting, posted };
+
+    WriteOp(ChatTlsStream& stream_, const ConstBufferSequence& buffers_)
+      : stream(stream_),
+        buffers(buffers_),
+        state(initiating),
+        written(0)
+    {
+    }
+
+    template< typename Self >
+    void operator()(Self& self,
+        boost::system::error_code error = boost::system::error_code())
+    {
+      if (state == posted)
+      {
+        self.complete(result, written);
+        return;
+      }
+      if (!error)
+      {
+        written = stream.write_some(buffers, error);
+        if (error == boost::asio::error::would_block)
+        {
+          state = waiting;
+          stream.socket_.async_wait(stream.write_wait_, std::move(self));
+          return;
+        }
+      }
+      if (state == initiating)
+      {
+        state = posted;
+        result = error;
+        boost::asio::post(std::move(self));
+        return;
+      }
+      self.complete(error, written);
+    }
+
+    ChatTlsStream&  stream;
+    ConstBufferSequence  buffers;
+    State  state;
+    std::size_t  written;
+    boost::system::error_code  result;
+  };
+
+  /// The error of a failed call; for would_block, what to wait for.
+  boost::system::error_code translate(int result, socket_t::wait_type& wait)
+  {
+    switch (SSL_get_error(ssl_, result))
+    {
+      case SSL_ERROR_WANT_READ:
+        wait = socket_t::wait_read;
+        return boost::asio::error::would_block;
+
+      case SSL_ERROR_WANT_WRITE:
+        wait = socket_t::wait_write;
+        return boost::asio::error::would_block;
+
+      case SSL_ERROR_ZERO_RETURN:
+        return boost::asio::error::eof;
+
+      case SSL_ERROR_SYSCALL:
+        if (errno != 0)
+        {
+          return boost::system::error_code(errno,
+              boost::asio::error::get_system_category());
+        }
+        return boost::asio::error::eof;
+
+      default:
+        return last_error();
+    }
+  }
+
+  static boost::system::error_code last_error()
+  {
+    return boost::system::error_code(int(ERR_get_error()),
+        boost::asio::error::get_ssl_category());
+  }
+
+private:
+  /// Enough for a gathered write of a session in one go.
+  enum { stage_size = 64 * 1024 };
+
+  socket_t&  socket_;
+  SSL*  ssl_;
+  socket_t::wait_type  read_wait_;
+  socket_t::wait_type  write_wait_;
+  bool  send_offloaded_;
+  bool  recv_offloaded_;
+
+  /// Plaintext of the write in progress, from ChatBufferPool while there
+  /// is one; [stage_offset_, staged_) is not written yet.
+  char*  stage_;
+  std::size_t  staged_;
+  std::size_t  stage_offset_;
+};
+
+#endif // CHAT_TLS_HPP
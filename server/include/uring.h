@@ -0,0 +1,1250 @@
+//
+// uring.h
+// ~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+
+#ifndef CHAT_URING_HPP
+#define CHAT_URING_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include "handler_allocator.h"
+#include "log.h"
+#include "metrics.h"
+
+
+/**
+* The io_uring transport; off by default, sessions use Asio's reactor.
+*/
+struct ChatUringSettings
+{
+  ChatUringSettings()
+    : enabled(false),
+      queue_depth(4096),
+      buffer_count(512),
+      buffer_size(4096),
+      stream_buffers(32)
+  {
+  }
+
+  bool  enabled;
+  /// Submission queue entries; the completion queue has four times as
+  /// many.
+  unsigned  queue_depth;
+  /// Receive buffers of a shard, which the kernel hands out to its
+  /// sessions as data arrives: a power of two, at most 32768.
+  unsigned  buffer_count;
+  unsigned  buffer_size;
+  /// Of those, what one session may hold before its receive pauses.
+  unsigned  stream_buffers;
+};
+
+class ChatUringStream;
+
+/**
+* Base of an io_context service defined in a header: the static id Asio
+* looks the service up by is a template's, so it needs no translation
+* unit.
+*/
+template< typename Service >
+class ChatServiceBase
+  : public boost::asio::io_context::service
+{
+public:
+  static boost::asio::io_context::id  id;
+
+protected:
+  explicit ChatServiceBase(boost::asio::io_context& io_context)
+    : boost::asio::io_context::service(io_context)
+  {
+  }
+};
+
+template< typename Service >
+boost::asio::io_context::id  ChatServiceBase< Service >::id;
+
+//----------------------------------------------------------------------
+
+/**
+* One io_uring per shard (ChatShards), as a service of its io_service.
+* The ring is driven by the shard's own event loop: Asio waits for the
+* ring's descriptor among the others, and the completions are reaped in
+* one handler whenever it becomes readable. Requests queued while the
+* shard runs its handlers go to the kernel together, with one
+* io_uring_enter from a posted handler.
+*
+* Receiving takes no buffer of a session: the shard registers a ring of
+* provided buffers with the kernel (IORING_REGISTER_PBUF_RING), and each
+* session keeps one multishot receive armed on its socket, which picks a
+* buffer only when data arrives. A session out of buffers (ENOBUFS) is
+* armed again once a quarter of them are back. A session whose reader
+* falls behind cannot take them all: holding settings.stream_buffers,
+* its receive is cancelled until the reader has given half of them back,
+* and the peer waits on TCP flow control meanwhile.
+*
+* Needs Linux 6.0 for multishot receive; the constructor checks, and
+* valid() is false where the ring cannot be used.
+*
+* Only the shard's thread touches the ring, but for release(), which
+* may be called from any thread.
+*/
+class ChatUring
+  : public ChatServiceBase< ChatUring >
+{
+public:
+  explicit ChatUring(boost::asio::io_context& io_context,
+      const ChatUringSettings& settings = ChatUringSettings());
+  ~ChatUring();
+
+  bool valid() const
+  {
+    return valid_;
+  }
+
+  /// Why valid() is false.
+  const std::string& failure() const
+  {
+    return failure_;
+  }
+
+  /**
+  * Ends a stream its session is done with, from any thread: the stream
+  * cancels what it has in flight and is deleted once the kernel is done
+  * with it, on the shard's thread.
+  */
+  void release(ChatUringStream* stream);
+
+private:
+  friend class ChatUringStream;
+
+  enum { buffer_group = 0 };
+  /// Low bit of user_data: which operation of a stream completed.
+  enum { recv_tag = 0, send_tag = 1, tag_mask = 1 };
+
+  virtual void shutdown();
+
+  void fail(const char* what, int error);
+  bool setup_ring();
+  bool setup_buffers();
+  bool probe_multishot();
+
+  /// The next free submission entry, cleared and queued for submit();
+  /// null if the kernel takes none, which fails the request.
+  io_uring_sqe* get_sqe();
+  bool submission_queue_full() const;
+  void schedule_submit();
+  void handle_submit();
+  int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+  void submit();
+
+  void start_wait();
+  void handle_events(const boost::system::error_code& error);
+  void handle_reap();
+  bool completions_ready() const;
+  void reap();
+  void complete(boost::uint64_t user_data, int result, unsigned flags);
+
+  char* buffer(unsigned short id)
+  {
+    return buffers_ + std::size_t(id) * buffer_size_;
+  }
+
+  void take_buffer()
+  {
+    --free_buffers_;
+  }
+
+  std::size_t stream_buffers() const
+  {
+    return std::max(std::min(settings_.stream_buffers, buffer_count_), 2u);
+  }
+
+  void recycle(unsigned short id);
+  void starve(ChatUringStream* stream);
+  void forget(ChatUringStream* stream);
+
+  void drain_released();
+  void close_stream(ChatUringStream* stream);
+  void destroy(ChatUringStream* stream);
+
+private:
+  boost::asio::io_context&  io_context_;
+  const ChatUringSettings  settings_;
+  bool  valid_;
+  std::string  failure_;
+
+  int  fd_;
+  void*  ring_;
+  std::size_t  ring_size_;
+  io_uring_sqe*  sqes_;
+  std::size_t  sqes_size_;
+  unsigned*  sq_head_;
+  unsigned*  sq_tail_;
+  unsigned*  sq_flags_;
+  unsigned  sq_mask_;
+  unsigned  sq_entries_;
+  /// Entries queued and not yet passed to the kernel.
+  unsigned  sq_local_tail_;
+  unsigned  sq_submitted_;
+  unsigned*  cq_head_;
+  unsigned*  cq_tail_;
+  unsigned  cq_mask_;
+  io_uring_cqe*  cqes_;
+
+  io_uring_buf_ring*  buffer_ring_;
+  std::size_t  buffer_ring_size_;
+  char*  buffers_;
+  std::size_t  buffer_size_;
+  unsigned  buffer_count_;
+  unsigned short  buffer_tail_;
+  unsigned  free_buffers_;
+  std::vector< ChatUringStream* >  starved_;
+
+  /// A duplicate of the ring's descriptor, for Asio's reactor.
+  boost::scoped_ptr< boost::asio::posix::stream_descriptor >  events_;
+  bool  waiting_;
+  bool  reap_scheduled_;
+  bool  submit_scheduled_;
+  ChatHandlerMemory  wait_memory_;
+  ChatHandlerMemory  reap_memory_;
+  ChatHandlerMemory  submit_memory_;
+
+  /// Streams their sessions released, guarded by release_mutex_, and
+  /// those waiting for their last completion.
+  boost::mutex  release_mutex_;
+  std::vector< ChatUringStream* >  released_;
+  bool  release_scheduled_;
+  bool  shut_down_;
+  std::vector< ChatUringStream* >  orphans_;
+};
+
+//----------------------------------------------------------------------
+
+/**
+* A connected socket on its shard's ChatUring. The stream takes the
+* socket's descriptor over and closes it when deleted, so the kernel
+* never sees the number again while a request of ours may still refer
+* to it.
+*
+* Reads: async_wait() completes when data (or the end of it) has
+* arrived, and read_some() then copies it out of the shard's buffers,
+* handing each back as soon as it is empty. Writes: async_write_some()
+* sends the buffer sequence with one IORING_OP_SENDMSG, so the stream is
+* an AsyncWriteStream for async_write().
+*
+* Not thread-safe: every call has to come from the session's strand,
+* which runs on the shard's thread.
+*/
+class ChatUringStream
+  : private boost::noncopyable
+{
+public:
+  typedef boost::asio::steady_timer::executor_type  executor_type;
+
+  /// Takes the descriptor of 'socket' over, and arms the receive.
+  template< typename Socket >
+  ChatUringStream(ChatUring& ring, Socket& socket)
+    : ring_(ring),
+      fd_(socket.release()),
+      read_wakeup_(socket.get_executor()),
+      write_wakeup_(socket.get_executor()),
+      recv_armed_(false),
+      recv_paused_(false),
+      read_waiting_(false),
+      first_chunk_(0),
+      send_in_flight_(false),
+      send_result_(0),
+      closed_(false),
+      orphaned_(false)
+  {
+    std::memset(&send_msg_, 0, sizeof(send_msg_));
+    arm_recv();
+  }
+
+  ~ChatUringStream()
+  {
+    // Off the ring's lists and closed before the buffers go back, or
+    // recycling them could arm this stream's receive again.
+    ring_.forget(this);
+    close();
+    for (std::size_t i = first_chunk_; i < chunks_.size(); ++i)
+    {
+      ring_.recycle(chunks_[i].id);
+    }
+    ::close(fd_);
+  }
+
+  executor_type get_executor()
+  {
+    return write_wakeup_.get_executor();
+  }
+
+  /// Data or an error is there for read_some().
+  bool readable() const
+  {
+    return (first_chunk_ < chunks_.size()) || recv_error_;
+  }
+
+  /**
+  * Waits until readable(). Completes through the handler's executor,
+  * never inside the call.
+  */
+  template< typename WaitHandler >
+  BOOST_ASIO_INITFN_RESULT_TYPE(WaitHandler, void (boost::system::error_code))
+  async_wait(BOOST_ASIO_MOVE_ARG(WaitHandler) handler)
+  {
+    return boost::asio::async_compose< WaitHandler,
+        void (boost::system::error_code) >(
+          WaitOp(*this), handler, read_wakeup_);
+  }
+
+  /// Copies what arrived into the buffers, without blocking.
+  template< typename MutableBufferSequence >
+  std::size_t read_some(const MutableBufferSequence& buffers,
+      boost::system::error_code& error)
+  {
+    error = boost::system::error_code();
+    std::size_t  total = 0;
+    for (typename MutableBufferSequence::const_iterator
+           itr = buffers.begin(); itr != buffers.end(); ++itr)
+    {
+      const boost::asio::mutable_buffer  buffer(*itr);
+      char*  out = static_cast< char* >(buffer.data());
+      std::size_t  room = buffer.size();
+      while ((room > 0) && (first_chunk_ < chunks_.size()))
+      {
+        Chunk&  chunk = chunks_[first_chunk_];
+        const std::size_t  n = std::min< std::size_t >(room,
+            chunk.length - chunk.offset);
+        std::memcpy(out, ring_.buffer(chunk.id) + chunk.offset, n);
+        out += n;
+        room -= n;
+        total += n;
+        chunk.offset += unsigned(n);
+        if (chunk.offset == chunk.length)
+        {
+          ring_.recycle(chunk.id);
+          ++first_chunk_;
+        }
+      }
+    }
+    if (first_chunk_ == chunks_.size())
+    {
+      chunks_.clear();
+      first_chunk_ = 0;
+    }
+    resume_recv();
+    if (total == 0)
+    {
+      error = recv_error_ ? recv_error_
+          : boost::system::error_code(boost::asio::error::would_block);
+    }
+    return total;
+  }
+
+  /**
+  * AsyncWriteStream for async_write(): one sendmsg of as much of the
+  * sequence as fits an iovec array.
+  */
+  template< typename ConstBufferSequence, typename WriteHandler >
+  BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler,
+      void (boost::system::error_code, std::size_t))
+  async_write_some(const ConstBufferSequence& buffers,
+      BOOST_ASIO_MOVE_ARG(WriteHandler) handler)
+  {
+    return boost::asio::async_compose< WriteHandler,
+        void (boost::system::error_code, std::size_t) >(
+          SendOp< ConstBufferSequence >(*this, buffers), handler,
+          write_wakeup_);
+  }
+
+  /**
+  * Cancels what is in flight: a waiting reader sees operation_aborted
+  * from read_some(), a send completes with it.
+  */
+  void close()
+  {
+    if (closed_)
+    {
+      return;
+    }
+    closed_ = true;
+    if (!recv_error_)
+    {
+      recv_error_ = boost::asio::error::operation_aborted;
+    }
+    if (recv_armed_)
+    {
+      cancel(ChatUring::recv_tag);
+    }
+    if (send_in_flight_)
+    {
+      cancel(ChatUring::send_tag);
+    }
+    wake_reader();
+  }
+
+  ChatUring& ring() const
+  {
+    return ring_;
+  }
+
+private:
+  friend class ChatUring;
+
+  /// Data the kernel put into one of the shard's buffers.
+  struct Chunk
+  {
+    unsigned short  id;
+    unsigned  length;
+    unsigned  offset;
+  };
+
+  struct WaitOp
+  {
+    explicit WaitOp(ChatUringStream& stream_)
+      : stream(stream_),
+        waited(false)
+    {
+    }
+
+    template< typename Self >
+    void operator()(Self& self,
+        boost::system::error_code = boost::system::error_code())
+    {
+      if (!waited)
+      {
+        waited = true;
+        if (stream.readable())
+        {
+          boost::asio::post(std::move(self));
+          return;
+        }
+        stream.read_waiting_ = true;
+        stream.read_wakeup_.expires_at(
+            boost::asio::steady_timer::time_point::max());
+        stream.read_wakeup_.async_wait(std::move(self));
+        return;
+      }
+      // The wake-up cancels the timer: not an error of ours.
+      self.complete(boost::system::error_code());
+    }
+
+    ChatUringStream&  stream;
+    bool  waited;
+  };
+
+  template< typename ConstBufferSequence >
+  struct SendOp
+  {
+    SendOp(ChatUringStream& stream_, const ConstBufferSequence& buffers_)
+      : stream(stream_),
+        buffers(buffers_),
+        started(false)
+    {
+    }
+
+    template< typename Self >
+    void operator()(Self& self,
+        boost::system::error_code = boost::system::error_code())
+    {
+      if (!started)
+      {
+        started = true;
+        if (stream.start_send(buffers))
+        {
+          stream.write_wakeup_.expires_at(
+              boost::asio::steady_timer::time_point::max());
+          stream.write_wakeup_.async_wait(std::move(self));
+        }
+        else
+        {
+          boost::asio::post(std::move(self));
+        }
+        return;
+      }
+      const int  result = stream.send_result_;
+      if (result < 0)
+      {
+        self.complete(boost::system::error_code(-result,
+            boost::asio::error::get_system_category()), 0);
+        return;
+      }
+      self.complete(boost::system::error_code(), std::size_t(result));
+    }
+
+    ChatUringStream&  stream;
+    ConstBufferSequence  buffers;
+    bool  started;
+  };
+
+  boost::uint64_t user_data(unsigned tag) const
+  {
+    return reinterpret_cast< boost::uint64_t >(this) | tag;
+  }
+
+  void arm_recv()
+  {
+    if (closed_)
+    {
+      return;
+    }
+    io_uring_sqe*  sqe = ring_.get_sqe();
+    if (!sqe)
+    {
+      recv_error_ = boost::asio::error::no_buffer_space;
+      wake_reader();
+      return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd_;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = ChatUring::buffer_group;
+    sqe->user_data = user_data(ChatUring::recv_tag);
+    recv_armed_ = true;
+    ring_.schedule_submit();
+  }
+
+  void cancel(unsigned tag)
+  {
+    if (!submit_cancel(tag))
+    {
+      // Ends the receive (with end of file) and fails the send all the
+      // same.
+      ::shutdown(fd_, SHUT_RDWR);
+    }
+  }
+
+  bool submit_cancel(unsigned tag)
+  {
+    io_uring_sqe*  sqe = ring_.get_sqe();
+    if (!sqe)
+    {
+      return false;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data(tag);
+    sqe->user_data = 0;
+    ring_.schedule_submit();
+    return true;
+  }
+
+  /// Buffers of the shard with data the reader has yet to take.
+  std::size_t held_buffers() const
+  {
+    return chunks_.size() - first_chunk_;
+  }
+
+  /**
+  * Stops the receive of a stream holding its share of the buffers; the
+  * kernel may still fill a few before the cancel is through. Tried
+  * again on the next receive if the ring takes no request.
+  */
+  void pause_recv()
+  {
+    if (!recv_paused_ && !closed_
+        && (held_buffers() >= ring_.stream_buffers())
+        && submit_cancel(ChatUring::recv_tag))
+    {
+      recv_paused_ = true;
+    }
+  }
+
+  /// Arms a paused receive again once the reader has caught up.
+  void resume_recv()
+  {
+    if (recv_paused_ && !recv_armed_ && !recv_error_
+        && (held_buffers() <= ring_.stream_buffers() / 2))
+    {
+      recv_paused_ = false;
+      arm_recv();
+    }
+  }
+
+  /// Queues the send; false, with send_result_ set, if there is none.
+  template< typename ConstBufferSequence >
+  bool start_send(const ConstBufferSequence& buffers)
+  {
+    if (closed_)
+    {
+      send_result_ = -ECANCELED;
+      return false;
+    }
+    std::size_t  count = 0;
+    for (typename ConstBufferSequence::const_iterator
+           itr = buffers.begin();
+         (itr != buffers.end()) && (count < max_iovecs); ++itr)
+    {
+      const boost::asio::const_buffer  buffer(*itr);
+      if (buffer.size() > 0)
+      {
+        send_iov_[count].iov_base = const_cast< void* >(buffer.data());
+        send_iov_[count].iov_len = buffer.size();
+        ++count;
+      }
+    }
+    if (count == 0)
+    {
+      send_result_ = 0;
+      return false;
+    }
+    send_msg_.msg_iov = send_iov_;
+    send_msg_.msg_iovlen = count;
+
+    io_uring_sqe*  sqe = ring_.get_sqe();
+    if (!sqe)
+    {
+      send_result_ = -EBUSY;
+      return false;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast< boost::uint64_t >(&send_msg_);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data(ChatUring::send_tag);
+    send_in_flight_ = true;
+    ring_.schedule_submit();
+    return true;
+  }
+
+  void wake_reader()
+  {
+    if (read_waiting_)
+    {
+      read_waiting_ = false;
+      read_wakeup_.cancel();
+    }
+  }
+
+  /// A completion of the multishot receive; the last unless F_MORE.
+  void on_recv(int result, unsigned flags)
+  {
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+      ring_.take_buffer();
+      const unsigned short  id =
+          static_cast< unsigned short >(flags >> IORING_CQE_BUFFER_SHIFT);
+      if (result > 0)
+      {
+        const Chunk  chunk = { id, unsigned(result), 0 };
+        chunks_.push_back(chunk);
+      }
+      else
+      {
+        ring_.recycle(id);
+      }
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+      recv_armed_ = false;
+      if (closed_)
+      {
+        // Cancelled by close(): stays down.
+      }
+      else if ((recv_paused_ && ((result > 0) || (result == -ENOBUFS)))
+          || (result == -ECANCELED))
+      {
+        // Cancelled by pause_recv(), or ended while it was; a cancel
+        // late enough hits the receive armed after it.
+        recv_paused_ = true;
+        resume_recv();
+      }
+      else if (result == -ENOBUFS)
+      {
+        ring_.starve(this);
+      }
+      else if (result == 0)
+      {
+        recv_error_ = boost::asio::error::eof;
+      }
+      else if (result < 0)
+      {
+        recv_error_ = boost::system::error_code(-result,
+            boost::asio::error::get_system_category());
+      }
+      else
+      {
+        arm_recv();
+      }
+    }
+    else
+    {
+      pause_recv();
+    }
+    wake_reader();
+  }
+
+  void on_send(int result)
+  {
+    send_in_flight_ = false;
+    send_result_ = result;
+    write_wakeup_.cancel();
+  }
+
+  /// Nothing of ours left with the kernel.
+  bool idle() const
+  {
+    return !recv_armed_ && !send_in_flight_;
+  }
+
+private:
+  enum { max_iovecs = 64 };
+
+  ChatUring&  ring_;
+  const int  fd_;
+  boost::asio::steady_timer  read_wakeup_;
+  boost::asio::steady_timer  write_wakeup_;
+
+  bool  recv_armed_;
+  /// Cancelled for holding too many buffers, or being cancelled.
+  bool  recv_paused_;
+  bool  read_waiting_;
+  std::vector< Chunk >  chunks_;
+  std::size_t  first_chunk_;
+  boost::system::error_code  recv_error_;
+
+  bool  send_in_flight_;
+  int  send_result_;
+  msghdr  send_msg_;
+  iovec  send_iov_[max_iovecs];
+
+  bool  closed_;
+  /// Released by its session, waiting for its last completion.
+  bool  orphaned_;
+};
+
+//----------------------------------------------------------------------
+
+inline ChatUring::ChatUring(boost::asio::io_context& io_context,
+    const ChatUringSettings& settings)
+  : ChatServiceBase< ChatUring >(io_context),
+    io_context_(io_context),
+    settings_(settings),
+    valid_(false),
+    fd_(-1),
+    ring_(MAP_FAILED),
+    ring_size_(0),
+    sqes_(static_cast< io_uring_sqe* >(MAP_FAILED)),
+    sqes_size_(0),
+    sq_local_tail_(0),
+    sq_submitted_(0),
+    buffer_ring_(static_cast< io_uring_buf_ring* >(MAP_FAILED)),
+    buffer_ring_size_(0),
+    buffers_(static_cast< char* >(MAP_FAILED)),
+    buffer_size_(settings.buffer_size),
+    buffer_count_(settings.buffer_count),
+    buffer_tail_(0),
+    free_buffers_(0),
+    waiting_(false),
+    reap_scheduled_(false),
+    submit_scheduled_(false),
+    release_scheduled_(false),
+    shut_down_(false)
+{
+  if (!setup_ring() || !setup_buffers() || !probe_multishot())
+  {
+    return;
+  }
+  const int  events = ::dup(fd_);
+  if (events < 0)
+  {
+    fail("dup", errno);
+    return;
+  }
+  events_.reset(new boost::asio::posix::stream_descriptor(io_context,
+      events));
+  valid_ = true;
+  start_wait();
+}
+
+inline ChatUring::~ChatUring()
+{
+  if (buffers_ != MAP_FAILED)
+  {
+    ::munmap(buffers_, std::size_t(buffer_count_) * buffer_size_);
+  }
+  if (buffer_ring_ != MAP_FAILED)
+  {
+    ::munmap(buffer_ring_, buffer_ring_size_);
+  }
+  if (sqes_ != MAP_FAILED)
+  {
+    ::munmap(sqes_, sqes_size_);
+  }
+  if (ring_ != MAP_FAILED)
+  {
+    ::munmap(ring_, ring_size_);
+  }
+  if (fd_ >= 0)
+  {
+    // Cancels whatever the kernel still has of ours.
+    ::close(fd_);
+  }
+}
+
+inline void ChatUring::release(ChatUringStream* stream)
+{
+  {
+    boost::mutex::scoped_lock  lock(release_mutex_);
+    if (!shut_down_)
+    {
+      released_.push_back(stream);
+      if (release_scheduled_)
+      {
+        return;
+      }
+      release_scheduled_ = true;
+      boost::asio::post(io_context_,
+          boost::bind(&ChatUring::drain_released, this));
+      return;
+    }
+  }
+  // No thread runs the shard any more.
+  delete stream;
+}
+
+inline void ChatUring::shutdown()
+{
+  std::vector< ChatUringStream* >  released;
+  {
+    boost::mutex::scoped_lock  lock(release_mutex_);
+    shut_down_ = true;
+    released.swap(released_);
+  }
+  for (std::size_t i = 0; i < released.size(); ++i)
+  {
+    delete released[i];
+  }
+  while (!orphans_.empty())
+  {
+    delete orphans_.back();
+  }
+  events_.reset();
+}
+
+inline void ChatUring::fail(const char* what, int error)
+{
+  failure_ = std::string(what) + ": " + std::strerror(error);
+}
+
+inline bool ChatUring::setup_ring()
+{
+  io_uring_params  params;
+  std::memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = 4 * settings_.queue_depth;
+  fd_ = int(::syscall(__NR_io_uring_setup, settings_.queue_depth, &params));
+  if (fd_ < 0)
+  {
+    fail("io_uring_setup", errno);
+    return false;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+      || !(params.features & IORING_FEAT_NODROP))
+  {
+    fail("io_uring features", ENOSYS);
+    return false;
+  }
+
+  ring_size_ = std::max< std::size_t >(
+      params.sq_off.array + params.sq_entries * sizeof(unsigned),
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  ring_ = ::mmap(0, ring_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast< io_uring_sqe* >(::mmap(0, sqes_size_,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+      IORING_OFF_SQES));
+  if ((ring_ == MAP_FAILED) || (sqes_ == MAP_FAILED))
+  {
+    fail("mmap", errno);
+    return false;
+  }
+
+  char*  ring = static_cast< char* >(ring_);
+  sq_head_ = reinterpret_cast< unsigned* >(ring + params.sq_off.head);
+  sq_tail_ = reinterpret_cast< unsigned* >(ring + params.sq_off.tail);
+  sq_flags_ = reinterpret_cast< unsigned* >(ring + params.sq_off.flags);
+  sq_mask_ = *reinterpret_cast< unsigned* >(ring + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  sq_local_tail_ = *sq_tail_;
+  sq_submitted_ = sq_local_tail_;
+  // Entry i of the queue is always SQE i.
+  unsigned*  array = reinterpret_cast< unsigned* >(ring + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; ++i)
+  {
+    array[i] = i;
+  }
+  cq_head_ = reinterpret_cast< unsigned* >(ring + params.cq_off.head);
+  cq_tail_ = reinterpret_cast< unsigned* >(ring + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast< unsigned* >(ring + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast< io_uring_cqe* >(ring + params.cq_off.cqes);
+  return true;
+}
+
+inline bool ChatUring::setup_buffers()
+{
+  if ((buffer_count_ == 0) || (buffer_count_ > 32768)
+      || (buffer_count_ & (buffer_count_ - 1)) || (buffer_size_ == 0))
+  {
+    fail("buffer ring", EINVAL);
+    return false;
+  }
+  buffer_ring_size_ = buffer_count_ * sizeof(io_uring_buf);
+  buffer_ring_ = static_cast< io_uring_buf_ring* >(::mmap(0,
+      buffer_ring_size_, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  buffers_ = static_cast< char* >(::mmap(0,
+      std::size_t(buffer_count_) * buffer_size_, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if ((buffer_ring_ == MAP_FAILED) || (buffers_ == MAP_FAILED))
+  {
+    fail("mmap", errno);
+    return false;
+  }
+
+  io_uring_buf_reg  reg;
+  std::memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast< boost::uint64_t >(buffer_ring_);
+  reg.ring_entries = buffer_count_;
+  reg.bgid = buffer_group;
+  if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING,
+        &reg, 1) < 0)
+  {
+    fail("IORING_REGISTER_PBUF_RING", errno);
+    return false;
+  }
+  for (unsigned i = 0; i < buffer_count_; ++i)
+  {
+    recycle(static_cast< unsigned short >(i));
+  }
+  return true;
+}
+
+/**
+* Arms a multishot receive on an idle socket pair and cancels it: a
+* kernel without multishot receive rejects it at once instead.
+*/
+inline bool ChatUring::probe_multishot()
+{
+  int  pair[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+  {
+    fail("socketpair", errno);
+    return false;
+  }
+  const boost::uint64_t  probe = 1;
+  io_uring_sqe*  sqe = get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = pair[0];
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->buf_group = buffer_group;
+  sqe->user_data = probe;
+  sqe = get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = probe;
+  sqe->user_data = 0;
+  const unsigned  to_submit = sq_local_tail_ - sq_submitted_;
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+  sq_submitted_ = sq_local_tail_;
+  int  result = -ENOSYS;
+  if (enter(to_submit, 2, IORING_ENTER_GETEVENTS) >= 0)
+  {
+    unsigned  head = *cq_head_;
+    const unsigned  tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; ++head)
+    {
+      const io_uring_cqe&  cqe = cqes_[head & cq_mask_];
+      if (cqe.user_data == probe)
+      {
+        result = cqe.res;
+      }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+  ::close(pair[0]);
+  ::close(pair[1]);
+  if (result != -ECANCELED)
+  {
+    fail("multishot receive", -result);
+    return false;
+  }
+  return true;
+}
+
+inline bool ChatUring::submission_queue_full() const
+{
+  return sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)
+      >= sq_entries_;
+}
+
+inline io_uring_sqe* ChatUring::get_sqe()
+{
+  if (submission_queue_full())
+  {
+    // An entry is free only once the kernel has taken it, which a failed
+    // or partial submit does not ensure.
+    submit();
+    if (submission_queue_full())
+    {
+      CHAT_LOG(log_error, "event=uring_queue_full entries=%u", sq_entries_);
+      return 0;
+    }
+  }
+  io_uring_sqe*  sqe = &sqes_[sq_local_tail_ & sq_mask_];
+  ++sq_local_tail_;
+  std::memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+inline void ChatUring::schedule_submit()
+{
+  if (!submit_scheduled_)
+  {
+    submit_scheduled_ = true;
+    boost::asio::post(io_context_, make_alloc_handler(submit_memory_,
+        boost::bind(&ChatUring::handle_submit, this)));
+  }
+}
+
+inline void ChatUring::handle_submit()
+{
+  submit_scheduled_ = false;
+  submit();
+}
+
+inline int ChatUring::enter(unsigned to_submit, unsigned min_complete,
+    unsigned flags)
+{
+  ChatMetrics::count(ChatThreadMetrics::uring_enters);
+  const int  result = int(::syscall(__NR_io_uring_enter, fd_, to_submit,
+      min_complete, flags, 0, 0));
+  return (result < 0) ? -errno : result;
+}
+
+/// Passes the queued requests to the kernel, in one call.
+inline void ChatUring::submit()
+{
+  if (sq_local_tail_ == sq_submitted_)
+  {
+    return;
+  }
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+  for (int attempt = 0; attempt < 2; ++attempt)
+  {
+    const int  result = enter(sq_local_tail_ - sq_submitted_, 0, 0);
+    if (result >= 0)
+    {
+      sq_submitted_ += unsigned(result);
+      if (sq_submitted_ == sq_local_tail_)
+      {
+        return;
+      }
+    }
+    else if ((result != -EBUSY) && (result != -EAGAIN))
+    {
+      CHAT_LOG(log_error, "event=uring_submit_failed error=\"%s\"",
+          std::strerror(-result));
+      return;
+    }
+    // The completion queue is full: make room.
+    reap();
+  }
+}
+
+inline void ChatUring::start_wait()
+{
+  if (!events_)
+  {
+    return;
+  }
+  if (!waiting_)
+  {
+    waiting_ = true;
+    events_->async_wait(boost::asio::posix::stream_descriptor::wait_read,
+        make_alloc_handler(wait_memory_, boost::bind(
+          &ChatUring::handle_events, this,
+          boost::asio::placeholders::error)));
+  }
+  // The reactor only reports new readiness: completions posted since the
+  // last reap would wait for the next one.
+  if (completions_ready() && !reap_scheduled_)
+  {
+    reap_scheduled_ = true;
+    boost::asio::post(io_context_, make_alloc_handler(reap_memory_,
+        boost::bind(&ChatUring::handle_reap, this)));
+  }
+}
+
+inline void ChatUring::handle_events(const boost::system::error_code& error)
+{
+  waiting_ = false;
+  if (error)
+  {
+    return;
+  }
+  reap();
+  start_wait();
+}
+
+inline void ChatUring::handle_reap()
+{
+  reap_scheduled_ = false;
+  reap();
+  start_wait();
+}
+
+inline bool ChatUring::completions_ready() const
+{
+  return *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+}
+
+/// Hands every completion to its stream.
+inline void ChatUring::reap()
+{
+  for ( ; ; )
+  {
+    unsigned  head = *cq_head_;
+    const unsigned  tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; ++head)
+    {
+      const io_uring_cqe&  cqe = cqes_[head & cq_mask_];
+      const boost::uint64_t  user_data = cqe.user_data;
+      const int  result = cqe.res;
+      const unsigned  flags = cqe.flags;
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+      ChatMetrics::count(ChatThreadMetrics::uring_completions);
+      complete(user_data, result, flags);
+    }
+    if (!(__atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+    {
+      return;
+    }
+    // Completions the kernel kept aside while the queue was full.
+    enter(0, 0, IORING_ENTER_GETEVENTS);
+  }
+}
+
+inline void ChatUring::complete(boost::uint64_t user_data, int result,
+    unsigned flags)
+{
+  if (user_data == 0)
+  {
+    return;
+  }
+  ChatUringStream*  stream = reinterpret_cast< ChatUringStream* >(
+      user_data & ~boost::uint64_t(tag_mask));
+  if ((user_data & tag_mask) == send_tag)
+  {
+    stream->on_send(result);
+  }
+  else
+  {
+    stream->on_recv(result, flags);
+  }
+  if (stream->orphaned_ && stream->idle())
+  {
+    destroy(stream);
+  }
+}
+
+inline void ChatUring::recycle(unsigned short id)
+{
+  // Not buffer_ring_->bufs: in C++ the kernel header's flexible array
+  // follows an empty struct, which takes a byte.
+  io_uring_buf&  buf = reinterpret_cast< io_uring_buf* >(buffer_ring_)[
+      buffer_tail_ & (buffer_count_ - 1)];
+  buf.addr = reinterpret_cast< boost::uint64_t >(buffer(id));
+  buf.len = unsigned(buffer_size_);
+  buf.bid = id;
+  ++buffer_tail_;
+  __atomic_store_n(&buffer_ring_->tail, buffer_tail_, __ATOMIC_RELEASE);
+  ++free_buffers_;
+
+  if (!starved_.empty() && (free_buffers_ >= buffer_count_ / 4))
+  {
+    std::vector< ChatUringStream* >  starved;
+    starved.swap(starved_);
+    for (std::size_t i = 0; i < starved.size(); ++i)
+    {
+      if (!starved[i]->closed_)
+      {
+        starved[i]->arm_recv();
+      }
+    }
+  }
+}
+
+inline void ChatUring::starve(ChatUringStream* stream)
+{
+  starved_.push_back(stream);
+}
+
+/// A stream is going away.
+inline void ChatUring::forget(ChatUringStream* stream)
+{
+  starved_.erase(std::remove(starved_.begin(), starved_.end(), stream),
+      starved_.end());
+  orphans_.erase(std::remove(orphans_.begin(), orphans_.end(), stream),
+      orphans_.end());
+}
+
+inline void ChatUring::drain_released()
+{
+  std::vector< ChatUringStream* >  released;
+  {
+    boost::mutex::scoped_lock  lock(release_mutex_);
+    released.swap(released_);
+    release_scheduled_ = false;
+  }
+  for (std::size_t i = 0; i < released.size(); ++i)
+  {
+    close_stream(released[i]);
+  }
+}
+
+inline void ChatUring::close_stream(ChatUringStream* stream)
+{
+  stream->close();
+  if (stream->idle())
+  {
+    delete stream;
+    return;
+  }
+  stream->orphaned_ = true;
+  orphans_.push_back(stream);
+}
+
+inline void ChatUring::destroy(ChatUringStream* stream)
+{
+  delete stream;
+}
+
+#endif // CHAT_URING_HPP
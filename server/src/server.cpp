@@ -13,16 +13,53 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include <algorithm>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
-#include <deque>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <list>
-#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
+#include <boost/container/deque.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/asio.hpp>
+#include <boost/thread/thread.hpp>
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+#if defined(CHAT_COROUTINES)
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#endif
+#include "../include/buffer_pool.h"
+#include "../include/compression.h"
+#include "../include/handler_allocator.h"
+#include "../include/history_log.h"
+#include "../include/log.h"
 #include "../include/message.h"
+#include "../include/metrics.h"
+#include "../include/ring_buffer.h"
+#include "../include/room.h"
+#include "../include/room_directory.h"
+#include "../include/shard.h"
+#if defined(CHAT_TLS)
+#include "../include/tls.h"
+#endif
+#if defined(CHAT_URING)
+#include "../include/uring.h"
+#endif
 
 
 using boost::asio::ip::tcp;
@@ -30,69 +67,1790 @@ using boost::asio::ip::tcp;
 
 //----------------------------------------------------------------------
 
-typedef std::deque< ChatMessage >  chatMessageQueue_t;
+/**
+* Settings shared by every listener of the process.
+*/
+struct ChatOptions
+{
+  /// What a session does when a new message would exceed its queue limits.
+  enum OverflowPolicy
+  {
+    drop_oldest,
+    drop_newest,
+    /// Replaces the pending backlog with one "N messages skipped" notice.
+    coalesce,
+    disconnect,
+    overflow_policy_count
+  };
+
+  ChatOptions()
+    : thread_count(boost::thread::hardware_concurrency()),
+      acceptor_count(0),
+      listen_backlog(boost::asio::socket_base::max_listen_connections),
+      preallocated_sessions(256),
+      max_rooms(65536),
+      max_body_length(ChatMessage::max_binary_body_length),
+      max_queued_msgs(10000),
+      max_queued_bytes(8 * 1024 * 1024),
+      overflow_policy(drop_oldest)
+  {
+  }
+
+  static const char* overflow_policy_name(OverflowPolicy policy)
+  {
+    static const char* const names[overflow_policy_count] =
+        { "drop-oldest", "drop-newest", "coalesce", "disconnect" };
+    return names[policy];
+  }
+
+  /// Returns overflow_policy_count for an unknown name.
+  static OverflowPolicy parse_overflow_policy(const std::string& name)
+  {
+    for (int i = 0; i < overflow_policy_count; ++i)
+    {
+      if (name == overflow_policy_name(OverflowPolicy(i)))
+      {
+        return OverflowPolicy(i);
+      }
+    }
+    return overflow_policy_count;
+  }
+
+  /// Worker threads, each running a shard of its own.
+  std::size_t  thread_count;
+  enum { max_thread_count = 1024 };
+
+  /// Listening sockets per port, sharing it with SO_REUSEPORT; 0 takes
+  /// one per worker thread.
+  std::size_t  acceptor_count;
+  int  listen_backlog;
+  /// Sessions whose memory is taken from the system up front.
+  std::size_t  preallocated_sessions;
+
+  /// Rooms of one listener; joining another one is refused.
+  std::size_t  max_rooms;
+
+  /// Longest body accepted from a client, bytes.
+  std::size_t  max_body_length;
+
+  /// Limits of the write queue of one session, including the write in
+  /// flight.
+  std::size_t  max_queued_msgs;
+  std::size_t  max_queued_bytes;
+  OverflowPolicy  overflow_policy;
+
+  /// Room logs; the prefix is the directory and each listener adds its
+  /// port to it.
+  ChatHistorySettings  history;
+
+  /// Deflated room traffic for the clients that ask for it.
+  ChatCompressionSettings  compression;
+
+#if defined(CHAT_TLS)
+  /// With a certificate, every listener serves TLS.
+  ChatTlsSettings  tls;
+#endif
+
+#if defined(CHAT_URING)
+  /// Plaintext sessions do their I/O through their shard's io_uring.
+  ChatUringSettings  uring;
+#endif
+};
+
+/// Built with CHAT_TLS only; sessions get a null one otherwise.
+class ChatTlsContext;
+
+//----------------------------------------------------------------------
+
+/**
+* How often the overflow policies fired, process-wide.
+*/
+struct ChatOverflowCounters
+  : private boost::noncopyable
+{
+  static ChatOverflowCounters& instance()
+  {
+    static ChatOverflowCounters counters;
+    return counters;
+  }
+
+  /// Overflow events per policy.
+  boost::atomic< std::size_t >  fired[ChatOptions::overflow_policy_count];
+  /// Messages which never reached their session.
+  boost::atomic< std::size_t >  dropped_msgs;
+
+private:
+  ChatOverflowCounters()
+    : dropped_msgs(0)
+  {
+    for (int i = 0; i < ChatOptions::overflow_policy_count; ++i)
+    {
+      fired[i] = 0;
+    }
+  }
+};
+
+//----------------------------------------------------------------------
+
+
+/**
+* Handlers of one session never run concurrently: socket operations,
+* the receive buffer and write_msgs_ are only touched from the session's
+* strand.
+*
+* A session lives on one shard (ChatShards): its socket and strand, and
+* the parts of its rooms that deliver to it, run on that shard's thread.
+*
+* Every read takes as much as fits into the receive buffer; consecutive
+* frames for the same room found there are handed to it as one batch.
+*
+* Memory for I/O is only held while there is I/O. An idle session waits
+* for data with a wait_read, which needs no buffer, and takes the
+* receive buffer from the pool for the read that follows; the buffer
+* goes back once it holds no partial frame. Likewise the write queue,
+* the gathered buffers and the write operation's memory go back when the
+* queue runs dry. What stays is the session object (under 1 KiB) and
+* Asio's per-socket state.
+*
+* A session may be subscribed to many rooms of its listener. Everybody
+* starts in the default room; binary clients join and leave others with
+* type_join and type_leave frames and may publish to any room they are
+* in. Legacy clients live in the default room only. Binary clients may
+* also ask a room they are in for a range of its history (type_history);
+* the room replays it to them alone.
+*
+* Joining a room brings its recent messages as one pre-serialized
+* ChatBacklog, which takes one entry of the write queue and one buffer
+* of the gathered write.
+*
+* A session starts by negotiating the framing: a binary client sends
+* ChatMessage::protocol_preface() right after connecting. If the first
+* bytes are anything else, or nothing arrives within negotiation_timeout,
+* the peer is served as a legacy client. A type_hello in the same read
+* as the preface asks for deflated messages (ChatMessage::hello_deflate);
+* the default room is joined once the hello had its chance.
+*
+* On a TLS listener (CHAT_TLS) the handshake comes first, driven by
+* waits on the socket like an idle read; a peer which has not finished
+* it within handshake_timeout is dropped. ChatTlsStream then does the
+* records of each direction the kernel did not take over (kTLS); the
+* rest of the session does not change.
+*
+* Built with CHAT_COROUTINES (C++20), the reader and the writer are two
+* coroutines on the strand instead of chains of bound completion
+* handlers: each holds one reference to the session for its lifetime,
+* and Asio recycles their frames per thread. Their operations are built
+* in the session's handler memory, as the handlers' are.
+*/
+class ChatSession
+  : public boost::enable_shared_from_this<ChatSession>
+{
+public:
+  typedef ChatRoomDirectory< ChatSession >  chatRoomDirectory_t;
+  typedef chatRoomDirectory_t::roomPTR  chatRoomPTR;
+
+private:
+  /// An entry of the write queue: a message or the backlog of a room.
+  struct Outgoing
+  {
+    /// A notice standing for 'skipped_' messages, or else a message.
+    explicit Outgoing(const chatMessagePTR& msg_, std::size_t skipped_ = 0)
+      : msg(msg_),
+        skipped(skipped_)
+    {
+    }
+
+    explicit Outgoing(const chatBacklogPTR& backlog_)
+      : backlog(backlog_),
+        skipped(0)
+    {
+    }
+
+    std::size_t length(ChatMessage::Framing framing) const
+    {
+      return msg ? msg->length(framing) : backlog->size();
+    }
+
+    /// Messages of a room in the entry; a notice is none.
+    std::size_t count() const
+    {
+      return msg ? (skipped ? 0 : 1) : backlog->count();
+    }
+
+    /// Never dropped: the room's deflated messages cannot be read
+    /// without it.
+    bool essential() const
+    {
+      return msg && (msg->type() == ChatMessage::type_dictionary);
+    }
+
+    chatMessagePTR  msg;
+    chatBacklogPTR  backlog;
+    std::size_t  skipped;
+  };
+
+  /// Unlike std::deque, holds no memory when default-constructed.
+  typedef boost::container::deque< Outgoing, ChatPoolAllocator< Outgoing > >
+      outgoingQueue_t;
+  typedef std::vector< Outgoing, ChatPoolAllocator< Outgoing > >
+      outgoingBatch_t;
+  typedef std::vector< boost::asio::const_buffer,
+      ChatPoolAllocator< boost::asio::const_buffer > >  writeBuffers_t;
+
+public:
+  ChatSession(ChatShards& shards, std::size_t shard,
+      chatRoomDirectory_t& rooms, const ChatOptions& options,
+      ChatTlsContext* tls_context)
+    : options_(options),
+      shard_(shard),
+      tls_context_(tls_context),
+      strand_(boost::asio::make_strand(shards[shard])),
+      socket_(shards[shard]),
+#if defined(CHAT_URING)
+      uring_(0),
+#endif
+#if defined(CHAT_COROUTINES)
+      write_wakeup_(shards[shard]),
+      read_done_(false),
+#endif
+      rooms_(rooms),
+      started_(false),
+      framing_(ChatMessage::legacy_framing),
+      negotiated_(false),
+      default_join_pending_(false),
+      compressed_(false),
+      read_buffer_(read_buffer_size),
+      reading_body_(false),
+      body_received_(0),
+      drain_scheduled_(false),
+      closed_(false),
+      queued_bytes_(0),
+      dropped_msgs_(0),
+      reported_msgs_(0),
+      reported_bytes_(0),
+      write_in_progress_(false),
+      preface_pending_(false),
+      writing_count_(0),
+      writing_bytes_(0),
+      write_started_(0)
+  {
+  }
+
+  ~ChatSession()
+  {
+#if defined(CHAT_URING)
+    if (uring_)
+    {
+      // Whatever thread lets the session go, the ring's is the one to
+      // end the stream.
+      uring_->ring().release(uring_);
+    }
+#endif
+    if (started_)
+    {
+      ChatMetrics::count(ChatThreadMetrics::closed);
+    }
+    write_msgs_.clear();
+    in_flight_.clear();
+    queued_bytes_ = 0;
+    report_queue();
+
+    if (dropped_msgs_ > 0)
+    {
+      CHAT_LOG(log_info, "event=session_end dropped=%lu",
+          static_cast< unsigned long >(dropped_msgs_));
+    }
+  }
+
+  tcp::socket& socket()
+  {
+    return socket_;
+  }
+
+  /// Sets aside the pooled memory of 'count' sessions.
+  static void reserve(std::size_t count)
+  {
+    ChatBufferPool&  pool = ChatBufferPool::instance();
+    // allocate_shared() puts the control block in front of the object.
+    pool.reserve(sizeof(ChatSession) + control_block_size, count);
+    pool.reserve(read_buffer_size, count);
+  }
+
+  void start()
+  {
+    started_ = true;
+#if defined(CHAT_TLS)
+    if (tls_context_)
+    {
+      boost::asio::dispatch(strand_, boost::bind(
+          &ChatSession::start_handshake, shared_from_this()));
+      return;
+    }
+#endif
+    boost::asio::dispatch(strand_, boost::bind(
+        &ChatSession::start_negotiation, shared_from_this()));
+  }
+
+  /**
+  * Called from the strands of the rooms: hands the messages over to our
+  * own, under one lock for the batch. Messages gather in inbox_ and one
+  * posted drain_inbox() takes all that arrived meanwhile, so a burst
+  * costs one handler, built in inbox_memory_.
+  */
+  void deliver(const chatMessageBatch_t& batch)
+  {
+    hand_over(batch.begin(), batch.end());
+  }
+
+  /// The recent messages of a room joined, in our framing.
+  void deliver(const chatBacklogPTR& backlog)
+  {
+    hand_over(&backlog, &backlog + 1);
+  }
+
+private:
+  /// Queues [first, last) to inbox_, each element making one Outgoing.
+  template< typename Iterator >
+  void hand_over(Iterator first, Iterator last)
+  {
+    {
+      boost::mutex::scoped_lock  lock(inbox_mutex_);
+      for ( ; first != last; ++first)
+      {
+        inbox_.push_back(Outgoing(*first));
+      }
+      if (drain_scheduled_)
+      {
+        return;
+      }
+      drain_scheduled_ = true;
+    }
+    boost::asio::post(strand_, make_alloc_handler(inbox_memory_,
+        boost::bind(&ChatSession::drain_inbox, shared_from_this())));
+  }
+
+#if defined(CHAT_TLS)
+  void start_handshake()
+  {
+    boost::system::error_code  ignored;
+    socket_.non_blocking(true, ignored);
+    try
+    {
+      tls_.reset(new ChatTlsStream(*tls_context_, socket_));
+    }
+    catch (const boost::system::system_error& e)
+    {
+      CHAT_LOG(log_error, "event=tls_unavailable error=\"%s\"", e.what());
+      socket_.close(ignored);
+      return;
+    }
+    start_timer(handshake_timeout,
+        boost::bind(&ChatSession::handle_handshake_timeout,
+          shared_from_this(), boost::asio::placeholders::error));
+    handle_handshake(boost::system::error_code());
+  }
+
+  /// A peer which has not finished the handshake in time is dropped.
+  void handle_handshake_timeout(const boost::system::error_code& error)
+  {
+    if (!error && !tls_->established())
+    {
+      CHAT_LOG(log_debug, "event=tls_handshake_timeout");
+      close();
+    }
+  }
+
+  /// Goes on with the handshake whenever the socket is ready for it.
+  void handle_handshake(const boost::system::error_code& wait_error)
+  {
+    boost::system::error_code  error = wait_error;
+    if (!error && !tls_->handshake(error)
+        && (error == boost::asio::error::would_block))
+    {
+      socket_.async_wait(tls_->read_wait(), boost::asio::bind_executor(
+          strand_, boost::bind(&ChatSession::handle_handshake,
+            shared_from_this(), boost::asio::placeholders::error)));
+      return;
+    }
+    if (error)
+    {
+      CHAT_LOG(log_debug, "event=tls_handshake_failed error=\"%s\"",
+          error.message().c_str());
+      negotiation_timer_.reset();
+      return;
+    }
+
+    ChatMetrics::count(ChatThreadMetrics::tls_handshakes);
+    ChatMetrics::count(ChatThreadMetrics::tls_resumptions,
+        tls_->resumed() ? 1 : 0);
+    ChatMetrics::count(ChatThreadMetrics::tls_ktls_send,
+        tls_->send_offloaded() ? 1 : 0);
+    ChatMetrics::count(ChatThreadMetrics::tls_ktls_recv,
+        tls_->recv_offloaded() ? 1 : 0);
+    CHAT_LOG(log_debug, "event=tls_handshake version=%s resumed=%d"
+        " ktls_send=%d ktls_recv=%d", tls_->version(), int(tls_->resumed()),
+        int(tls_->send_offloaded()), int(tls_->recv_offloaded()));
+    start_negotiation();
+  }
+#endif
+
+  /// Records read by ChatTlsStream rather than from the socket.
+  bool tls_reads() const
+  {
+#if defined(CHAT_TLS)
+    return tls_ && !tls_->recv_offloaded();
+#else
+    return false;
+#endif
+  }
+
+  bool tls_writes() const
+  {
+#if defined(CHAT_TLS)
+    return tls_ && !tls_->send_offloaded();
+#else
+    return false;
+#endif
+  }
+
+  /// Plaintext ChatTlsStream has already taken off the socket.
+  bool tls_pending() const
+  {
+#if defined(CHAT_TLS)
+    return tls_reads() && tls_->pending();
+#else
+    return false;
+#endif
+  }
+
+  /// Plaintext read and written through the shard's ChatUring.
+  bool uring_io() const
+  {
+#if defined(CHAT_URING)
+    return uring_ != 0;
+#else
+    return false;
+#endif
+  }
+
+  tcp::socket::wait_type read_wait() const
+  {
+#if defined(CHAT_TLS)
+    if (tls_reads())
+    {
+      return tls_->read_wait();
+    }
+#endif
+    return tcp::socket::wait_read;
+  }
+
+  void start_negotiation()
+  {
+    // Reads after a wait_read must not block.
+    boost::system::error_code  ignored;
+    socket_.non_blocking(true, ignored);
+#if defined(CHAT_URING)
+    if (options_.uring.enabled && !tls_context_)
+    {
+      uring_ = new ChatUringStream(boost::asio::use_service< ChatUring >(
+          strand_.get_inner_executor().context()), socket_);
+    }
+#endif
+
+#if defined(CHAT_COROUTINES)
+    boost::asio::co_spawn(strand_, read_loop(shared_from_this()),
+        boost::asio::detached);
+    boost::asio::co_spawn(strand_, write_loop(shared_from_this()),
+        boost::asio::detached);
+#else
+    start_read();
+#endif
+
+    start_timer(negotiation_timeout,
+        boost::bind(&ChatSession::handle_negotiation_timeout,
+          shared_from_this(), boost::asio::placeholders::error));
+  }
+
+  /**
+  * Runs the handler on the strand after 'timeout' ms, in a new
+  * negotiation_timer_; replacing or resetting it cancels the wait.
+  */
+  template< typename Handler >
+  void start_timer(long timeout, const Handler& handler)
+  {
+    negotiation_timer_ = boost::allocate_shared< boost::asio::deadline_timer >(
+        ChatPoolAllocator< boost::asio::deadline_timer >(),
+        socket_.get_executor());
+    negotiation_timer_->expires_from_now(
+        boost::posix_time::milliseconds(timeout));
+    negotiation_timer_->async_wait(
+        boost::asio::bind_executor(strand_, handler));
+  }
+
+  /// Also runs after the reader ended, which marks the session
+  /// negotiated.
+  void handle_negotiation_timeout(const boost::system::error_code& error)
+  {
+    negotiation_timer_.reset();
+    if (!error && !negotiated_)
+    {
+      // A silent peer is an old client waiting for the room's history.
+      negotiated_ = true;
+      join_room(ChatMessage::default_room);
+    }
+  }
+
+  /**
+  * Looks at the first bytes of the connection. Returns false while
+  * they have not arrived yet.
+  */
+  bool negotiate()
+  {
+    if (read_buffer_.size() < ChatMessage::preface_length)
+    {
+      return false;
+    }
+
+    char  preface[ChatMessage::preface_length];
+    read_buffer_.peek(preface, ChatMessage::preface_length);
+    negotiated_ = true;
+    // Destroying the timer cancels the wait.
+    negotiation_timer_.reset();
+    if (ChatMessage::is_protocol_preface(preface))
+    {
+      read_buffer_.consume(ChatMessage::preface_length);
+      framing_ = ChatMessage::binary_framing;
+      // The echoed preface must precede any message of the room.
+      preface_pending_ = true;
+      notify_writer();
+      // After the hello, if one came with the preface.
+      default_join_pending_ = true;
+      return true;
+    }
+    join_room(ChatMessage::default_room);
+    return true;
+  }
+
+  void join_default_room()
+  {
+    if (default_join_pending_)
+    {
+      default_join_pending_ = false;
+      join_room(ChatMessage::default_room);
+    }
+  }
+
+  /// Takes the client's capabilities, before it joins any room.
+  void handle_hello()
+  {
+    if (!default_join_pending_ || (read_msg_->body_length() < 1))
+    {
+      return;
+    }
+    const unsigned char  capabilities = read_msg_->body()[0];
+    compressed_ = options_.compression.enabled()
+        && (capabilities & ChatMessage::hello_deflate);
+  }
+
+  void join_room(boost::uint32_t id)
+  {
+    if (subscriptions_.count(id) > 0)
+    {
+      return;
+    }
+    if (subscriptions_.size() >= max_rooms_per_session)
+    {
+      CHAT_LOG(log_warning, "event=too_many_rooms room=%lu",
+          static_cast< unsigned long >(id));
+      return;
+    }
+
+    Subscription  subscription;
+    subscription.room = rooms_.find_or_create(id);
+    if (!subscription.room)
+    {
+      CHAT_LOG(log_warning, "event=room_limit room=%lu",
+          static_cast< unsigned long >(id));
+      return;
+    }
+    subscription.membership = boost::make_shared< ChatMembership >();
+    subscription.membership->shard = shard_;
+    subscription.membership->compressed = compressed_;
+    subscription.room->join(shared_from_this(), subscription.membership,
+        framing_);
+    subscriptions_[id] = subscription;
+  }
+
+  void leave_room(boost::uint32_t id)
+  {
+    const subscriptions_t::iterator  itr = subscriptions_.find(id);
+    if (itr != subscriptions_.end())
+    {
+      itr->second.room->leave(itr->second.membership);
+      subscriptions_.erase(itr);
+    }
+  }
+
+  void leave_rooms()
+  {
+    for (subscriptions_t::const_iterator itr = subscriptions_.begin();
+         itr != subscriptions_.end(); ++itr)
+    {
+      itr->second.room->leave(itr->second.membership);
+    }
+    subscriptions_.clear();
+  }
+
+#if defined(CHAT_COROUTINES)
+  /**
+  * The loops run on the strand's own type: any_io_executor cannot hold
+  * a strand without allocating, which it would at every suspension.
+  */
+  typedef boost::asio::strand< boost::asio::io_service::executor_type >
+      strand_t;
+  typedef boost::asio::awaitable< void, strand_t >  loop_t;
+  typedef boost::asio::use_awaitable_t< strand_t >  useStrand_t;
+  typedef ChatAllocToken< boost::asio::redirect_error_t< useStrand_t > >
+      useMemory_t;
+
+  /**
+  * Resumes the loop on the strand with the outcome in 'error'. As with
+  * the handlers, the operation, and the strand's invoker which runs its
+  * completion, are built in the loop's memory: Asio's recycling cache
+  * has one block per thread, which the two loops of a shard's sessions
+  * would take from each other.
+  */
+  static useMemory_t use_memory(ChatHandlerMemory& memory,
+      boost::system::error_code& error)
+  {
+    return make_alloc_token(memory,
+        boost::asio::redirect_error(useStrand_t(), error));
+  }
+
+  /**
+  * Reads until the peer goes away. The frame holds the only reference
+  * to the session the reader needs; completions resume it on the strand
+  * without binding a handler.
+  */
+  loop_t read_loop(boost::shared_ptr< ChatSession >)
+  {
+    boost::system::error_code  error;
+    std::size_t  bytes_transferred;
+    for ( ; ; )
+    {
+      bytes_transferred = 0;
+      error.clear();
+      if (read_buffer_.allocated() && !tls_reads() && !uring_io())
+      {
+        bytes_transferred = co_await socket_.async_read_some(
+            read_buffer_.prepare(), use_memory(read_memory_, error));
+      }
+      else
+      {
+        // Idle: wait for data without holding a buffer, and in no more
+        // handler memory than the wait takes.
+        read_memory_.release();
+#if defined(CHAT_URING)
+        if (uring_io())
+        {
+          co_await uring_->async_wait(use_memory(read_memory_, error));
+        }
+        else
+#endif
+        if (!tls_pending())
+        {
+          co_await socket_.async_wait(read_wait(),
+              use_memory(read_memory_, error));
+        }
+        if (!error && !read_ready(error, bytes_transferred))
+        {
+          continue;
+        }
+      }
+      if (!process_read(error, bytes_transferred))
+      {
+        break;
+      }
+    }
+
+    // Let the writer finish what is queued and end.
+    read_done_ = true;
+    notify_writer();
+  }
+#else
+  /**
+  * Fills whatever space the receive buffer has with one read when it
+  * holds the start of a frame; otherwise waits for the socket to become
+  * readable without a buffer. TLS records read in user space always
+  * take the second way, and skip the wait if a record is buffered; so
+  * does the io_uring transport, whose data waits in the shard's buffers.
+  */
+  void start_read()
+  {
+    if (tls_pending())
+    {
+      boost::asio::post(strand_, make_alloc_handler(read_memory_,
+          boost::bind(&ChatSession::handle_wait, shared_from_this(),
+            boost::system::error_code())));
+    }
+    else if (read_buffer_.allocated() && !tls_reads() && !uring_io())
+    {
+      socket_.async_read_some(read_buffer_.prepare(),
+          boost::asio::bind_executor(strand_, make_alloc_handler(read_memory_,
+            boost::bind(&ChatSession::handle_read, shared_from_this(),
+              boost::asio::placeholders::error,
+              boost::asio::placeholders::bytes_transferred))));
+    }
+#if defined(CHAT_URING)
+    else if (uring_io())
+    {
+      uring_->async_wait(
+          boost::asio::bind_executor(strand_, make_alloc_handler(read_memory_,
+            boost::bind(&ChatSession::handle_wait, shared_from_this(),
+              boost::asio::placeholders::error))));
+      read_memory_.release();
+    }
+#endif
+    else
+    {
+      socket_.async_wait(read_wait(),
+          boost::asio::bind_executor(strand_, make_alloc_handler(read_memory_,
+            boost::bind(&ChatSession::handle_wait, shared_from_this(),
+              boost::asio::placeholders::error))));
+      read_memory_.release();
+    }
+  }
+
+  void handle_wait(const boost::system::error_code& wait_error)
+  {
+    boost::system::error_code  error = wait_error;
+    std::size_t  bytes_transferred = 0;
+    if (!error && !read_ready(error, bytes_transferred))
+    {
+      start_read();
+      return;
+    }
+    handle_read(error, bytes_transferred);
+  }
+
+  void handle_read(const boost::system::error_code& error,
+      std::size_t bytes_transferred)
+  {
+    if (process_read(error, bytes_transferred))
+    {
+      start_read();
+    }
+  }
+#endif
+
+  /**
+  * Reads what arrived into a receive buffer from the pool, once the
+  * socket was reported readable. False if there was nothing after all;
+  * the buffer went back then.
+  */
+  bool read_ready(boost::system::error_code& error,
+      std::size_t& bytes_transferred)
+  {
+    read_buffer_.allocate();
+#if defined(CHAT_TLS)
+    if (tls_reads())
+    {
+      bytes_transferred = tls_->read_some(read_buffer_.prepare(), error);
+    }
+    else
+#endif
+#if defined(CHAT_URING)
+    if (uring_io())
+    {
+      bytes_transferred = uring_->read_some(read_buffer_.prepare(), error);
+    }
+    else
+#endif
+    bytes_transferred = socket_.read_some(read_buffer_.prepare(), error);
+    if (error == boost::asio::error::would_block)
+    {
+      read_buffer_.release();
+      error.clear();
+      return false;
+    }
+    return true;
+  }
+
+  /// Returns false when the session stops reading.
+  bool process_read(const boost::system::error_code& error,
+      std::size_t bytes_transferred)
+  {
+    if (error)
+    {
+      // A peer gone before its preface joins no room: the timeout sees
+      // it negotiated, should its wait have completed already.
+      negotiated_ = true;
+      default_join_pending_ = false;
+      negotiation_timer_.reset();
+      leave_rooms();
+      return false;
+    }
+
+    ChatScopedTimer  timer(ChatThreadMetrics::read_time);
+    ChatMetrics::count(ChatThreadMetrics::bytes_in, bytes_transferred);
+    read_buffer_.commit(bytes_transferred);
+    if (!negotiated_ && !negotiate())
+    {
+      return true;
+    }
+
+    const bool  parsed = parse_frames();
+    if (parsed)
+    {
+      join_default_room();
+    }
+    flush_read_batch();
+    if (read_buffer_.size() == 0)
+    {
+      // A body in progress is in read_msg_ already.
+      read_buffer_.release();
+    }
+    if (!parsed)
+    {
+      leave_rooms();
+      return false;
+    }
+    return true;
+  }
+
+  void flush_read_batch()
+  {
+    if (!read_batch_.empty())
+    {
+      read_batch_room_->deliver(read_batch_, shared_from_this(),
+          delivery_memory_);
+      read_batch_.clear();
+    }
+  }
+
+  /**
+  * Takes every complete frame out of the receive buffer. Messages are
+  * appended to read_batch_, join and leave commands are carried out in
+  * order. A body bigger than the buffer is copied out piece by piece over
+  * several reads. Returns false on a malformed header.
+  */
+  bool parse_frames()
+  {
+    const std::size_t  header_size = ChatMessage::header_size(framing_);
+    for ( ; ; )
+    {
+      if (!reading_body_)
+      {
+        if (read_buffer_.size() < header_size)
+        {
+          return true;
+        }
+        if (!read_msg_)
+        {
+          read_msg_ = make_message();
+        }
+        read_buffer_.read(read_msg_->header(framing_), header_size);
+        if (!read_msg_->decode_header(framing_, options_.max_body_length))
+        {
+          CHAT_LOG(log_warning, "event=bad_header framing=%s",
+              (framing_ == ChatMessage::binary_framing) ? "binary" : "legacy");
+          return false;
+        }
+        reading_body_ = true;
+        body_received_ = 0;
+      }
+
+      const std::size_t  n = std::min(read_buffer_.size(),
+          read_msg_->body_length() - body_received_);
+      if (n > 0)
+      {
+        read_buffer_.read(read_msg_->body() + body_received_, n);
+        body_received_ += n;
+      }
+      if (body_received_ < read_msg_->body_length())
+      {
+        return true;
+      }
+
+      reading_body_ = false;
+      handle_frame();
+    }
+  }
+
+  void handle_frame()
+  {
+    const boost::uint32_t  room = read_msg_->room();
+    if (read_msg_->type() == ChatMessage::type_hello)
+    {
+      handle_hello();
+      return;
+    }
+    join_default_room();
+    switch (read_msg_->type())
+    {
+      case ChatMessage::type_publish:
+        {
+          const subscriptions_t::const_iterator  itr =
+              subscriptions_.find(room);
+          if (itr == subscriptions_.end())
+          {
+            CHAT_LOG(log_debug, "event=publish_not_joined room=%lu",
+                static_cast< unsigned long >(room));
+            return;
+          }
+          if (itr->second.room != read_batch_room_)
+          {
+            flush_read_batch();
+            read_batch_room_ = itr->second.room;
+          }
+        }
+        // The filled buffer is handed over to the room as is; the next
+        // message is read into a fresh one. Only rooms deflate.
+        read_msg_->flags(read_msg_->flags() & ~ChatMessage::flag_deflate);
+        read_msg_->encode_headers();
+        ChatMetrics::count(ChatThreadMetrics::messages_in);
+        read_batch_.push_back(read_msg_);
+        read_msg_.reset();
+        break;
+
+      case ChatMessage::type_join:
+        flush_read_batch();
+        join_room(room);
+        break;
+
+      case ChatMessage::type_leave:
+        flush_read_batch();
+        leave_room(room);
+        break;
+
+      case ChatMessage::type_history:
+        flush_read_batch();
+        request_history(room);
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  void request_history(boost::uint32_t id)
+  {
+    boost::uint64_t  first;
+    boost::uint32_t  count;
+    const subscriptions_t::const_iterator  itr = subscriptions_.find(id);
+    if ((itr == subscriptions_.end())
+        || !read_msg_->decode_history_request(first, count))
+    {
+      CHAT_LOG(log_debug, "event=bad_history_request room=%lu",
+          static_cast< unsigned long >(id));
+      return;
+    }
+    itr->second.room->replay(shared_from_this(), first, count);
+  }
+
+  void drain_inbox()
+  {
+    {
+      boost::mutex::scoped_lock  lock(inbox_mutex_);
+      inbox_.swap(draining_);
+      drain_scheduled_ = false;
+    }
+
+    for (outgoingBatch_t::const_iterator itr = draining_.begin();
+         (itr != draining_.end()) && !closed_; ++itr)
+    {
+      do_deliver(*itr);
+    }
+    draining_.clear();
+
+    report_queue();
+    if (!closed_)
+    {
+      notify_writer();
+    }
+  }
+
+  void do_deliver(const Outgoing& item)
+  {
+    if (!item.essential() && overflows(item.length(framing_)))
+    {
+      handle_overflow(item);
+    }
+    else
+    {
+      enqueue(item);
+    }
+  }
+
+  /// Entries queued, those of the write in flight included.
+  std::size_t queued_msgs() const
+  {
+    return write_msgs_.size() + in_flight_.size();
+  }
+
+  /// Publishes the change of the queue since the last call to the gauges.
+  void report_queue()
+  {
+    ChatMetrics::adjust(ChatThreadMetrics::queued_msgs,
+        boost::int64_t(queued_msgs()) - boost::int64_t(reported_msgs_));
+    ChatMetrics::adjust(ChatThreadMetrics::queued_bytes,
+        boost::int64_t(queued_bytes_) - boost::int64_t(reported_bytes_));
+    reported_msgs_ = queued_msgs();
+    reported_bytes_ = queued_bytes_;
+  }
+
+  bool overflows(std::size_t length) const
+  {
+    return (queued_msgs() + 1 > options_.max_queued_msgs)
+        || (queued_bytes_ + length > options_.max_queued_bytes);
+  }
+
+  void enqueue(const Outgoing& item)
+  {
+    write_msgs_.push_back(item);
+    queued_bytes_ += item.length(framing_);
+  }
+
+  /**
+  * Drops the pending (not in flight) entries but the essential ones.
+  * Returns the number of messages dropped, those of the notices dropped
+  * included.
+  */
+  std::size_t drop_pending()
+  {
+    std::size_t  count = 0;
+    std::size_t  noticed = 0;
+    std::size_t  kept = 0;
+    for (std::size_t i = 0; i < write_msgs_.size(); ++i)
+    {
+      if (write_msgs_[i].essential())
+      {
+        write_msgs_[kept++] = write_msgs_[i];
+        continue;
+      }
+      queued_bytes_ -= write_msgs_[i].length(framing_);
+      count += write_msgs_[i].count();
+      noticed += write_msgs_[i].skipped;
+    }
+    write_msgs_.erase(write_msgs_.begin() + kept, write_msgs_.end());
+    count_dropped(count);
+    return count + noticed;
+  }
+
+  void count_dropped(std::size_t count)
+  {
+    dropped_msgs_ += count;
+    ChatOverflowCounters::instance().dropped_msgs += count;
+  }
+
+  /**
+  * Applies the overflow policy to a message which does not fit the
+  * queue: it is queued, dropped, or the session closed.
+  */
+  void handle_overflow(const Outgoing& item)
+  {
+    const ChatOptions::OverflowPolicy  policy = options_.overflow_policy;
+    ++ChatOverflowCounters::instance().fired[policy];
+    CHAT_LOG(log_debug, "event=queue_overflow policy=%s queued=%lu bytes=%lu",
+        ChatOptions::overflow_policy_name(policy),
+        static_cast< unsigned long >(queued_msgs()),
+        static_cast< unsigned long >(queued_bytes_));
+
+    const std::size_t  length = item.length(framing_);
+    switch (policy)
+    {
+      case ChatOptions::drop_oldest:
+        {
+          // The queue holds no entry in flight: its front is the oldest
+          // pending one. The essential entries met there stay, each one
+          // dropped behind them moving them back a place.
+          std::size_t  kept = 0;
+          while (overflows(length) && (kept < write_msgs_.size()))
+          {
+            const Outgoing&  oldest = write_msgs_[kept];
+            if (oldest.essential())
+            {
+              ++kept;
+              continue;
+            }
+            queued_bytes_ -= oldest.length(framing_);
+            count_dropped(oldest.count());
+            std::copy_backward(write_msgs_.begin(),
+                write_msgs_.begin() + kept, write_msgs_.begin() + kept + 1);
+            write_msgs_.pop_front();
+          }
+          if (overflows(length))
+          {
+            count_dropped(item.count());
+          }
+          else
+          {
+            enqueue(item);
+          }
+        }
+        break;
+
+      case ChatOptions::drop_newest:
+        count_dropped(item.count());
+        break;
+
+      case ChatOptions::coalesce:
+        {
+          const std::size_t  skipped = drop_pending();
+          if (skipped > 0)
+          {
+            enqueue(Outgoing(make_notice(skipped), skipped));
+          }
+          enqueue(item);
+        }
+        break;
+
+      case ChatOptions::disconnect:
+      default:
+        CHAT_LOG(log_warning, "event=slow_consumer_disconnected queued=%lu"
+            " bytes=%lu",
+            static_cast< unsigned long >(queued_msgs()),
+            static_cast< unsigned long >(queued_bytes_));
+        drop_pending();
+        count_dropped(item.count());
+        close();
+        break;
+    }
+  }
+
+  static chatMessagePTR make_notice(std::size_t skipped)
+  {
+    char  text[64];
+    const int  length = std::snprintf(text, sizeof(text),
+        "*** %lu messages skipped ***", static_cast< unsigned long >(skipped));
+    boost::shared_ptr< ChatMessage >  notice = make_message();
+    notice->body_length(length);
+    std::memcpy(notice->body(), text, length);
+    notice->encode_headers();
+    return notice;
+  }
+
+  void close()
+  {
+    closed_ = true;
+    boost::system::error_code  ignored;
+    negotiation_timer_.reset();
+    socket_.close(ignored);
+#if defined(CHAT_URING)
+    if (uring_)
+    {
+      uring_->close();
+    }
+#endif
+    leave_rooms();
+#if defined(CHAT_COROUTINES)
+    write_wakeup_.cancel(ignored);
+#endif
+  }
+
+  /**
+  * Gathers as many queued messages as the limits allow into one buffer
+  * sequence, so a backlog goes out with a single async_write. Every
+  * message contributes its header in our framing and its body; an echo
+  * of the preface goes first. The entries gathered leave the queue for
+  * in_flight_, which keeps them alive until the write completes.
+  */
+  void prepare_write()
+  {
+    write_buffers_.clear();
+    write_buffers_.reserve(max_write_buffers);
+    if (preface_pending_)
+    {
+      write_buffers_.push_back(boost::asio::buffer(
+          ChatMessage::protocol_preface(), ChatMessage::preface_length));
+      preface_pending_ = false;
+    }
+
+    in_flight_.reserve(max_write_buffers / 2);
+    writing_count_ = 0;
+    std::size_t  bytes = 0;
+    while (!write_msgs_.empty()
+        && (write_buffers_.size() + 2 <= max_write_buffers))
+    {
+      const Outgoing&  item = write_msgs_.front();
+      const std::size_t  length = item.length(framing_);
+      if (!in_flight_.empty() && (bytes + length > max_write_bytes))
+      {
+        break;
+      }
+      if (item.msg)
+      {
+        const ChatMessage&  msg = *item.msg;
+        write_buffers_.push_back(boost::asio::buffer(
+            msg.header(framing_), ChatMessage::header_size(framing_)));
+        write_buffers_.push_back(boost::asio::buffer(
+            msg.body(), msg.body_length(framing_)));
+      }
+      else
+      {
+        write_buffers_.push_back(boost::asio::buffer(
+            item.backlog->data(), item.backlog->size()));
+      }
+      bytes += length;
+      writing_count_ += item.count();
+      in_flight_.push_back(item);
+      write_msgs_.pop_front();
+    }
+    writing_bytes_ = bytes;
 
-//----------------------------------------------------------------------
+    write_started_ = ChatMetrics::now();
+    write_in_progress_ = true;
+  }
 
+  /// Returns false when the session stops writing.
+  bool complete_write(const boost::system::error_code& error)
+  {
+    write_in_progress_ = false;
+    if (error)
+    {
+      leave_rooms();
+      return false;
+    }
 
-class ChatParticipant
-{
-public:
-  virtual ~ChatParticipant() {}
-  virtual void deliver(const ChatMessage& msg) = 0;
-};
+    if (!in_flight_.empty())
+    {
+      ChatMetrics::record(ChatThreadMetrics::write_time,
+          ChatMetrics::now() - write_started_);
+      ChatMetrics::count(ChatThreadMetrics::messages_out, writing_count_);
+      ChatMetrics::count(ChatThreadMetrics::bytes_out, writing_bytes_);
+    }
+    in_flight_.clear();
+    queued_bytes_ -= writing_bytes_;
+    writing_count_ = 0;
+    writing_bytes_ = 0;
+    report_queue();
+    if (!write_pending())
+    {
+      release_write_memory();
+    }
+    return true;
+  }
+
+  /// The queue ran dry: an idle session keeps no write buffers.
+  void release_write_memory()
+  {
+    outgoingQueue_t().swap(write_msgs_);
+    outgoingBatch_t().swap(in_flight_);
+    writeBuffers_t().swap(write_buffers_);
+    write_memory_.release();
+#if defined(CHAT_TLS)
+    if (tls_)
+    {
+      tls_->release();
+    }
+#endif
+  }
 
+  /**
+  * Buffer sequence over write_buffers_ which does not own them: the write
+  * operation keeps a copy of its buffer sequence, and copying the vector
+  * would allocate.
+  */
+  struct BufferRange
+  {
+    typedef boost::asio::const_buffer  value_type;
+    typedef const boost::asio::const_buffer*  const_iterator;
 
-typedef boost::shared_ptr< ChatParticipant >  chatParticipantPTR;
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return last; }
 
+    const_iterator  first;
+    const_iterator  last;
+  };
 
-//----------------------------------------------------------------------
+  BufferRange write_range() const
+  {
+    const BufferRange  range = { write_buffers_.data(),
+        write_buffers_.data() + write_buffers_.size() };
+    return range;
+  }
+
+  bool write_pending() const
+  {
+    return preface_pending_ || !write_msgs_.empty();
+  }
+
+#if defined(CHAT_COROUTINES)
+  /// Wakes the writer if it waits for messages.
+  void notify_writer()
+  {
+    if (!write_in_progress_)
+    {
+      boost::system::error_code  ignored;
+      write_wakeup_.cancel(ignored);
+    }
+  }
+
+  /**
+  * Writes the queue out while the session lives. An idle writer sleeps
+  * on write_wakeup_, which never expires; notify_writer() cancels the
+  * wait.
+  */
+  loop_t write_loop(boost::shared_ptr< ChatSession >)
+  {
+    boost::system::error_code  error;
+    for ( ; ; )
+    {
+      if (!write_pending())
+      {
+        if (closed_ || read_done_)
+        {
+          co_return;
+        }
+        write_wakeup_.expires_at(boost::asio::steady_timer::time_point::max());
+        co_await write_wakeup_.async_wait(use_memory(write_memory_, error));
+        continue;
+      }
+
+      prepare_write();
+#if defined(CHAT_TLS)
+      if (tls_writes())
+      {
+        co_await boost::asio::async_write(*tls_, write_range(),
+            use_memory(write_memory_, error));
+      }
+      else
+#endif
+#if defined(CHAT_URING)
+      if (uring_io())
+      {
+        co_await boost::asio::async_write(*uring_, write_range(),
+            use_memory(write_memory_, error));
+      }
+      else
+#endif
+      co_await boost::asio::async_write(socket_, write_range(),
+          use_memory(write_memory_, error));
+      if (!complete_write(error))
+      {
+        co_return;
+      }
+    }
+  }
+#else
+  void notify_writer()
+  {
+    if (!write_in_progress_ && write_pending())
+    {
+      start_write();
+    }
+  }
+
+  void start_write()
+  {
+    prepare_write();
+#if defined(CHAT_TLS)
+    if (tls_writes())
+    {
+      start_write(*tls_);
+      return;
+    }
+#endif
+#if defined(CHAT_URING)
+    if (uring_io())
+    {
+      start_write(*uring_);
+      return;
+    }
+#endif
+    start_write(socket_);
+  }
+
+  template< typename Stream >
+  void start_write(Stream& stream)
+  {
+    boost::asio::async_write(stream, write_range(),
+        boost::asio::bind_executor(strand_, make_alloc_handler(write_memory_,
+          boost::bind(&ChatSession::handle_write, shared_from_this(),
+            boost::asio::placeholders::error))));
+  }
+
+  void handle_write(const boost::system::error_code& error)
+  {
+    if (complete_write(error) && write_pending())
+    {
+      start_write();
+    }
+  }
+#endif
+
+private:
+  const ChatOptions&  options_;
+  /// Index in ChatShards of the event loop running the session.
+  const std::size_t  shard_;
+  /// Null on a plaintext listener.
+  ChatTlsContext* const  tls_context_;
+  boost::asio::strand< boost::asio::io_service::executor_type >  strand_;
+  tcp::socket socket_;
+#if defined(CHAT_TLS)
+  /// Created on the strand once the connection is accepted.
+  boost::scoped_ptr< ChatTlsStream >  tls_;
+#endif
+#if defined(CHAT_URING)
+  /// Owns the socket's descriptor once created; its ring deletes it.
+  ChatUringStream*  uring_;
+#endif
+
+  /// The session never has more than one read and one write in flight:
+  /// their operations are built here instead of on the heap.
+  ChatHandlerMemory  read_memory_;
+  ChatHandlerMemory  write_memory_;
+
+  /// How long a new connection may stay silent before it is taken for
+  /// a legacy client, ms. The timer only exists until then.
+  enum { negotiation_timeout = 250 };
+  /// How long a TLS peer has for its handshake, ms, in the same timer.
+  enum { handshake_timeout = 10000 };
+  boost::shared_ptr< boost::asio::deadline_timer >  negotiation_timer_;
+
+#if defined(CHAT_COROUTINES)
+  boost::asio::steady_timer  write_wakeup_;
+  /// The reader is gone; the writer ends once the queue is empty.
+  bool  read_done_;
+#endif
+
+  struct Subscription
+  {
+    chatRoomPTR  room;
+    chatMembershipPTR  membership;
+  };
+  typedef boost::unordered_map< boost::uint32_t, Subscription >
+      subscriptions_t;
+
+  enum { max_rooms_per_session = 1024 };
+  chatRoomDirectory_t&  rooms_;
+  subscriptions_t  subscriptions_;
+
+  /// Accepted; an unused session of the acceptor is not counted.
+  bool  started_;
+
+  ChatMessage::Framing  framing_;
+  bool  negotiated_;
+  /// A binary client joins the default room after its hello.
+  bool  default_join_pending_;
+  /// Takes the rooms' deflated messages.
+  bool  compressed_;
 
+  enum { read_buffer_size = 16 * 1024 };
+  enum { control_block_size = 64 };
+  ChatRingBuffer  read_buffer_;
+  /// Message being parsed; the body may span several reads.
+  boost::shared_ptr< ChatMessage >  read_msg_;
+  bool  reading_body_;
+  std::size_t  body_received_;
+  chatMessageBatch_t  read_batch_;
+  chatRoomPTR  read_batch_room_;
+  ChatDeliveryMemory  delivery_memory_;
 
-class ChatRoom
+  /// Messages handed over by the rooms, guarded by inbox_mutex_.
+  boost::mutex  inbox_mutex_;
+  outgoingBatch_t  inbox_;
+  bool  drain_scheduled_;
+  ChatHandlerMemory  inbox_memory_;
+  /// The inbox being delivered, swapped with inbox_ to keep both buffers.
+  outgoingBatch_t  draining_;
+
+  bool  closed_;
+  outgoingQueue_t  write_msgs_;
+  std::size_t  queued_bytes_;
+  std::size_t  dropped_msgs_;
+  /// Queue size last published to the metrics.
+  std::size_t  reported_msgs_;
+  std::size_t  reported_bytes_;
+
+  /// Limits of one gathered write.
+  enum { max_write_buffers = 64 };
+  enum { max_write_bytes = 64 * 1024 };
+
+  bool  write_in_progress_;
+  /// The preface has to be echoed before anything else is written.
+  bool  preface_pending_;
+  /// Entries taken off write_msgs_ by the write in flight, and the
+  /// messages in them.
+  outgoingBatch_t  in_flight_;
+  std::size_t  writing_count_;
+  std::size_t  writing_bytes_;
+  boost::uint64_t  write_started_;
+  writeBuffers_t  write_buffers_;
+};
+
+typedef boost::shared_ptr<ChatSession> chatSessionPTR;
+
+//----------------------------------------------------------------------
+
+/**
+* A listener: the rooms of one port and the sockets accepting on it.
+*
+* With SO_REUSEPORT the port gets options.acceptor_count listening
+* sockets and the kernel spreads incoming connections over them, so
+* accepts on different threads do not queue behind one socket. A
+* completed accept is followed by non-blocking accepts of whatever else
+* waits in the backlog, up to max_accept_batch, before the next
+* asynchronous one: a reconnect storm costs one completion per batch
+* rather than one per connection.
+*
+* An accept that fails for want of descriptors or memory (EMFILE, ENFILE,
+* ENOBUFS, ENOMEM) would fail again at once while the connection waits
+* in the backlog: the socket waits on a timer instead, from
+* min_accept_retry_delay doubling to max_accept_retry_delay, until an
+* accept succeeds.
+*
+* Listening socket i runs on shard i; the sessions it accepts are dealt
+* out to the shards in turn.
+*
+* Given a ChatTlsContext, the listener serves TLS only.
+*
+* Sessions are allocated from ChatBufferPool, where main() sets aside
+* the memory of options.preallocated_sessions of them.
+*/
+class ChatServer
 {
 public:
-  void join(chatParticipantPTR participant)
+  ChatServer(ChatShards& shards, const tcp::endpoint& endpoint,
+      const ChatOptions& options, ChatTlsContext* tls_context = 0)
+    : options_(options),
+      shards_(shards),
+      tls_context_(tls_context),
+      rooms_(shards, listener_history(options, endpoint),
+        options.compression, options.max_rooms)
+  {
+#if defined(SO_REUSEPORT)
+    const std::size_t  count =
+        std::max< std::size_t >(options.acceptor_count, 1);
+#else
+    const std::size_t  count = 1;
+#endif
+    // The first socket settles the port if 0 was asked for.
+    tcp::endpoint  bound = endpoint;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      const acceptorPTR  acceptor = boost::make_shared< Acceptor >(
+          boost::ref(shards[i % shards.size()]));
+      listen(acceptor->socket, bound, count > 1);
+      bound = acceptor->socket.local_endpoint();
+      acceptors_.push_back(acceptor);
+    }
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      start_accept(acceptors_[i], new_session());
+    }
+  }
+
+  /// Rooms of different listeners keep apart logs.
+  static ChatHistorySettings listener_history(const ChatOptions& options,
+      const tcp::endpoint& endpoint)
+  {
+    ChatHistorySettings  history = options.history;
+    if (history.enabled())
+    {
+      std::ostringstream  prefix;
+      prefix << history.prefix << endpoint.port() << '-';
+      history.prefix = prefix.str();
+    }
+    return history;
+  }
+
+  unsigned short port() const
+  {
+    return acceptors_.front()->socket.local_endpoint().port();
+  }
+
+  ChatSession::chatRoomDirectory_t& rooms()
+  {
+    return rooms_;
+  }
+
+private:
+  struct Acceptor
+    : private boost::noncopyable
+  {
+    explicit Acceptor(boost::asio::io_service& io_service)
+      : socket(io_service),
+        retry_timer(io_service),
+        retry_delay(0)
+    {
+    }
+
+    tcp::acceptor  socket;
+    boost::asio::deadline_timer  retry_timer;
+    /// The wait before the next accept, ms; 0 while accepts succeed.
+    long  retry_delay;
+    ChatHandlerMemory  memory;
+  };
+
+  typedef boost::shared_ptr< Acceptor >  acceptorPTR;
+
+#if defined(SO_REUSEPORT)
+  typedef boost::asio::detail::socket_option::boolean<
+      SOL_SOCKET, SO_REUSEPORT >  reusePort_t;
+#endif
+
+  void listen(tcp::acceptor& acceptor, const tcp::endpoint& endpoint,
+      bool reuse_port)
+  {
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+    if (reuse_port)
+    {
+      acceptor.set_option(reusePort_t(true));
+    }
+#endif
+    acceptor.bind(endpoint);
+    acceptor.listen(options_.listen_backlog);
+    // For the batch: a synchronous accept returns would_block instead
+    // of waiting once the backlog is empty.
+    acceptor.non_blocking(true);
+  }
+
+  /// A session on the next shard; the acceptor's own may be another.
+  chatSessionPTR new_session()
+  {
+    return boost::allocate_shared< ChatSession >(
+        ChatPoolAllocator< ChatSession >(), shards_, shards_.next(), rooms_,
+        options_, tls_context_);
+  }
+
+  /**
+  * The handler holds the acceptor: stopped with the operation pending,
+  * its shard destroys the handler, and then the memory it was built in,
+  * after the listener is gone.
+  */
+  void start_accept(const acceptorPTR& acceptor,
+      const chatSessionPTR& session)
+  {
+    acceptor->socket.async_accept(session->socket(),
+        make_alloc_handler(acceptor->memory,
+          boost::bind(&ChatServer::handle_accept, this, acceptor, session,
+            boost::asio::placeholders::error)));
+  }
+
+  void handle_accept(const acceptorPTR& acceptor, chatSessionPTR session,
+      const boost::system::error_code& error)
+  {
+    ChatScopedTimer  timer(ChatThreadMetrics::accept_time);
+    if (error == boost::asio::error::operation_aborted)
+    {
+      return;
+    }
+    if (out_of_resources(error))
+    {
+      retry_accept(acceptor, session, error);
+      return;
+    }
+    if (!error)
+    {
+      acceptor->retry_delay = 0;
+      start_session(session);
+      session = accept_pending(*acceptor);
+    }
+
+    start_accept(acceptor, session);
+  }
+
+  static bool out_of_resources(const boost::system::error_code& error)
   {
-    participants_.insert(participant);
-    std::for_each(recent_msgs_.begin(), recent_msgs_.end(),
-        boost::bind(&ChatParticipant::deliver, participant, _1));
+    return (error == boost::asio::error::no_descriptors)
+        || (error == boost::system::errc::too_many_files_open_in_system)
+        || (error == boost::asio::error::no_buffer_space)
+        || (error == boost::asio::error::no_memory);
   }
 
-  void leave(chatParticipantPTR participant)
+  void retry_accept(const acceptorPTR& acceptor,
+      const chatSessionPTR& session, const boost::system::error_code& error)
   {
-    participants_.erase(participant);
+    if (acceptor->retry_delay == 0)
+    {
+      CHAT_LOG(log_warning, "event=accept_failed error=\"%s\"",
+          error.message().c_str());
+      acceptor->retry_delay = min_accept_retry_delay;
+    }
+    else
+    {
+      acceptor->retry_delay = std::min< long >(2 * acceptor->retry_delay,
+          max_accept_retry_delay);
+    }
+    acceptor->retry_timer.expires_from_now(
+        boost::posix_time::milliseconds(acceptor->retry_delay));
+    acceptor->retry_timer.async_wait(make_alloc_handler(acceptor->memory,
+        boost::bind(&ChatServer::handle_retry, this, acceptor, session,
+          boost::asio::placeholders::error)));
   }
 
-  void deliver(const ChatMessage& msg)
+  void handle_retry(const acceptorPTR& acceptor,
+      const chatSessionPTR& session, const boost::system::error_code& error)
   {
-    const auto s = msg.str();
-    std::cout << "[" << s << "]";
+    if (!error)
+    {
+      start_accept(acceptor, session);
+    }
+  }
 
-    recent_msgs_.push_back(msg);
-    while (recent_msgs_.size() > max_recent_msgs)
-      recent_msgs_.pop_front();
+  /**
+  * Takes the connections already waiting in the backlog. Returns the
+  * session left for the next asynchronous accept.
+  */
+  chatSessionPTR accept_pending(Acceptor& acceptor)
+  {
+    chatSessionPTR  session = new_session();
+    for (std::size_t i = 1; i < max_accept_batch; ++i)
+    {
+      boost::system::error_code  error;
+      acceptor.socket.accept(session->socket(), error);
+      if (error)
+      {
+        break;
+      }
+      start_session(session);
+      session = new_session();
+    }
+    return session;
+  }
 
-    std::for_each(participants_.begin(), participants_.end(),
-        boost::bind(&ChatParticipant::deliver, _1, boost::ref(msg)));
+  void start_session(const chatSessionPTR& session)
+  {
+    ChatMetrics::count(ChatThreadMetrics::accepted);
+    session->start();
   }
 
 private:
-  std::set< chatParticipantPTR >  participants_;
-  enum { max_recent_msgs = 100 };
-  chatMessageQueue_t  recent_msgs_;
+  enum { max_accept_batch = 64 };
+  /// Waits before accepting again after a shortage, ms.
+  enum { min_accept_retry_delay = 10 };
+  enum { max_accept_retry_delay = 1000 };
+
+  const ChatOptions&  options_;
+  ChatShards&  shards_;
+  ChatTlsContext* const  tls_context_;
+  ChatSession::chatRoomDirectory_t  rooms_;
+  std::vector< acceptorPTR >  acceptors_;
 };
 
+typedef boost::shared_ptr< ChatServer >  chatServerPTR;
+typedef std::list< chatServerPTR >  chatServerList_t;
+
 //----------------------------------------------------------------------
 
-class ChatSession
-  : public ChatParticipant,
-    public boost::enable_shared_from_this<ChatSession>
+/**
+* One scrape: reads the request head, answers with the metrics in the
+* Prometheus text format and closes. A client which has not sent its
+* request and taken the answer within request_timeout is dropped.
+*/
+class ChatMetricsConnection
+  : public boost::enable_shared_from_this< ChatMetricsConnection >
 {
 public:
-  ChatSession(boost::asio::io_service& io_service, ChatRoom& room)
+  ChatMetricsConnection(boost::asio::io_service& io_service,
+      chatServerList_t& servers)
     : socket_(io_service),
-      room_(room)
+      timer_(io_service),
+      servers_(servers),
+      request_(max_request_length)
   {
   }
 
@@ -103,129 +1861,184 @@ public:
 
   void start()
   {
-    room_.join(shared_from_this());
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(read_msg_.data(), ChatMessage::header_length),
-        boost::bind(
-          &ChatSession::handle_read_header, shared_from_this(),
+    timer_.expires_from_now(boost::posix_time::milliseconds(
+        long(request_timeout)));
+    timer_.async_wait(boost::bind(&ChatMetricsConnection::handle_timeout,
+          shared_from_this(), boost::asio::placeholders::error));
+    boost::asio::async_read_until(socket_, request_, "\r\n\r\n",
+        boost::bind(&ChatMetricsConnection::handle_read, shared_from_this(),
           boost::asio::placeholders::error));
   }
 
-  void deliver(const ChatMessage& msg)
+private:
+  void handle_timeout(const boost::system::error_code& error)
   {
-    bool write_in_progress = !write_msgs_.empty();
-    write_msgs_.push_back(msg);
-    if (!write_in_progress)
+    if (!error)
     {
-      boost::asio::async_write(socket_,
-          boost::asio::buffer(write_msgs_.front().data(),
-            write_msgs_.front().length()),
-          boost::bind(&ChatSession::handle_write, shared_from_this(),
-            boost::asio::placeholders::error));
+      // Cancels the read or the write.
+      boost::system::error_code  ignored;
+      socket_.close(ignored);
     }
   }
 
-  void handle_read_header(const boost::system::error_code& error)
+  void handle_read(const boost::system::error_code& error)
   {
-    if (!error && read_msg_.decode_header())
+    if (error)
     {
-      boost::asio::async_read(socket_,
-          boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-          boost::bind(&ChatSession::handle_read_body, shared_from_this(),
-            boost::asio::placeholders::error));
+      timer_.cancel();
+      return;
+    }
+
+    std::istream  request(&request_);
+    std::string  method, path;
+    request >> method >> path;
+    if ((method == "GET") && ((path == "/metrics") || (path == "/")))
+    {
+      std::ostringstream  body;
+      write_metrics(body);
+      response_ = reply("200 OK", body.str());
     }
     else
     {
-      room_.leave(shared_from_this());
+      response_ = reply("404 Not Found", "Not found\n");
     }
+
+    boost::asio::async_write(socket_, boost::asio::buffer(response_),
+        boost::bind(&ChatMetricsConnection::handle_write, shared_from_this(),
+          boost::asio::placeholders::error));
   }
 
-  void handle_read_body(const boost::system::error_code& error)
+  void handle_write(const boost::system::error_code& /*error*/)
   {
-    if (!error)
+    boost::system::error_code  ignored;
+    socket_.shutdown(tcp::socket::shutdown_both, ignored);
+    timer_.cancel(ignored);
+  }
+
+  static std::string reply(const char* status, const std::string& body)
+  {
+    std::ostringstream  os;
+    os << "HTTP/1.0 " << status << "\r\n"
+       << "Content-Type: text/plain; version=0.0.4\r\n"
+       << "Content-Length: " << body.size() << "\r\n"
+       << "Connection: close\r\n\r\n"
+       << body;
+    return os.str();
+  }
+
+  void write_metrics(std::ostream& os)
+  {
+    ChatMetrics::instance().write(os);
+
+    ChatOverflowCounters&  overflow = ChatOverflowCounters::instance();
+    os << "# HELP chat_overflow_total Write queue overflows by policy.\n"
+       << "# TYPE chat_overflow_total counter\n";
+    for (int i = 0; i < ChatOptions::overflow_policy_count; ++i)
     {
-      room_.deliver(read_msg_);
-      boost::asio::async_read(socket_,
-          boost::asio::buffer(read_msg_.data(), ChatMessage::header_length),
-          boost::bind(&ChatSession::handle_read_header, shared_from_this(),
-            boost::asio::placeholders::error));
+      os << "chat_overflow_total{policy=\""
+         << ChatOptions::overflow_policy_name(ChatOptions::OverflowPolicy(i))
+         << "\"} " << overflow.fired[i].load() << '\n';
     }
-    else
+    os << "# HELP chat_dropped_messages_total Messages dropped by"
+          " overflow policies.\n"
+       << "# TYPE chat_dropped_messages_total counter\n"
+       << "chat_dropped_messages_total " << overflow.dropped_msgs.load() << '\n'
+       << "# HELP chat_log_dropped_total Log records lost to a full ring.\n"
+       << "# TYPE chat_log_dropped_total counter\n"
+       << "chat_log_dropped_total " << ChatLog::instance().dropped() << '\n';
+    write_resident_memory(os);
+
+    os << "# HELP chat_rooms Rooms of the listener.\n"
+       << "# TYPE chat_rooms gauge\n";
+    for (chatServerList_t::const_iterator itr = servers_.begin();
+         itr != servers_.end(); ++itr)
     {
-      room_.leave(shared_from_this());
+      ChatServer&  server = **itr;
+      os << "chat_rooms{listener=\"" << server.port() << "\"} "
+         << server.rooms().size() << '\n';
     }
   }
 
-  void handle_write(const boost::system::error_code& error)
+  /// What a session costs, seen from outside: see bench/src/idlegen.cpp.
+  static void write_resident_memory(std::ostream& os)
   {
-    if (!error)
-    {
-      write_msgs_.pop_front();
-      if (!write_msgs_.empty())
-      {
-        boost::asio::async_write(socket_,
-            boost::asio::buffer(write_msgs_.front().data(),
-              write_msgs_.front().length()),
-            boost::bind(&ChatSession::handle_write, shared_from_this(),
-              boost::asio::placeholders::error));
-      }
-    }
-    else
+#if defined(__linux__)
+    std::ifstream  statm("/proc/self/statm");
+    unsigned long  size = 0;
+    unsigned long  resident = 0;
+    if (statm >> size >> resident)
     {
-      room_.leave(shared_from_this());
+      os << "# HELP process_resident_memory_bytes Resident memory size in"
+            " bytes.\n"
+         << "# TYPE process_resident_memory_bytes gauge\n"
+         << "process_resident_memory_bytes "
+         << resident * static_cast< unsigned long >(sysconf(_SC_PAGESIZE))
+         << '\n';
     }
+#endif
   }
 
 private:
-  tcp::socket socket_;
-  ChatRoom& room_;
-  ChatMessage read_msg_;
-  chatMessageQueue_t write_msgs_;
-};
+  enum { max_request_length = 8 * 1024 };
+  /// How long a scrape may take, ms.
+  enum { request_timeout = 5000 };
 
-typedef boost::shared_ptr<ChatSession> chatSessionPTR;
+  tcp::socket  socket_;
+  boost::asio::deadline_timer  timer_;
+  chatServerList_t&  servers_;
+  boost::asio::streambuf  request_;
+  std::string  response_;
+};
 
-//----------------------------------------------------------------------
+typedef boost::shared_ptr< ChatMetricsConnection >  chatMetricsConnectionPTR;
 
-class ChatServer
+/**
+* Local HTTP endpoint of the metrics, for Prometheus to scrape. It runs
+* on the first shard along with its sessions; a scrape only takes the
+* locks of the per-thread histograms, one at a time, and reads the
+* counters the threads and the room directories keep up to date. It
+* walks no rooms: participants are summed per thread, messages counted
+* as the threads' broadcasts.
+*/
+class ChatMetricsServer
 {
 public:
-  ChatServer(boost::asio::io_service& io_service,
-      const tcp::endpoint& endpoint)
+  ChatMetricsServer(boost::asio::io_service& io_service,
+      const tcp::endpoint& endpoint, chatServerList_t& servers)
     : io_service_(io_service),
-      acceptor_(io_service, endpoint)
+      acceptor_(io_service, endpoint),
+      servers_(servers)
   {
     start_accept();
   }
 
+private:
   void start_accept()
   {
-    chatSessionPTR new_session(new ChatSession(io_service_, room_));
-    acceptor_.async_accept(new_session->socket(),
-        boost::bind(&ChatServer::handle_accept, this, new_session,
+    chatMetricsConnectionPTR  connection(
+        new ChatMetricsConnection(io_service_, servers_));
+    acceptor_.async_accept(connection->socket(),
+        boost::bind(&ChatMetricsServer::handle_accept, this, connection,
           boost::asio::placeholders::error));
   }
 
-  void handle_accept(chatSessionPTR session,
+  void handle_accept(chatMetricsConnectionPTR connection,
       const boost::system::error_code& error)
   {
     if (!error)
     {
-      session->start();
+      connection->start();
     }
 
     start_accept();
   }
 
 private:
-  boost::asio::io_service& io_service_;
-  tcp::acceptor acceptor_;
-  ChatRoom room_;
+  boost::asio::io_service&  io_service_;
+  tcp::acceptor  acceptor_;
+  chatServerList_t&  servers_;
 };
 
-typedef boost::shared_ptr< ChatServer >  chatServerPTR;
-typedef std::list< chatServerPTR >  chatServerList_t;
-
 //----------------------------------------------------------------------
 
 
@@ -236,23 +2049,213 @@ int main(int argc, char* argv[]) {
 
   try
   {
-    if (argc < 2)
+    ChatOptions  options;
+    int  metrics_port = 0;
+    int  first_port = 1;
+    for ( ; (first_port + 1 < argc) && (argv[first_port][0] == '-');
+         first_port += 2)
+    {
+      using namespace std; // For atoi.
+      const std::string  name = argv[first_port];
+      const int  value = atoi(argv[first_port + 1]);
+      if (name == "-t")
+      {
+        if ((value < 1) || (value > ChatOptions::max_thread_count))
+        {
+          first_port = argc;
+        }
+        options.thread_count = value;
+      }
+      else if (name == "-l")
+      {
+        const ChatLogLevel  level = ChatLog::parse_level(argv[first_port + 1]);
+        if (level == log_level_count)
+        {
+          first_port = argc;
+        }
+        else
+        {
+          ChatLog::instance().level(level);
+        }
+      }
+      else if (name == "-q")
+      {
+        options.max_queued_msgs = std::max(value, 1);
+      }
+      else if (name == "-b")
+      {
+        options.max_queued_bytes = std::max(value, 1);
+      }
+      else if (name == "-p")
+      {
+        options.overflow_policy =
+            ChatOptions::parse_overflow_policy(argv[first_port + 1]);
+        if (options.overflow_policy == ChatOptions::overflow_policy_count)
+        {
+          first_port = argc;
+        }
+      }
+      else if (name == "-M")
+      {
+        metrics_port = value;
+      }
+      else if (name == "-A")
+      {
+        options.acceptor_count = std::max(value, 1);
+      }
+      else if (name == "-L")
+      {
+        options.listen_backlog = std::max(value, 1);
+      }
+      else if (name == "-P")
+      {
+        options.preallocated_sessions = std::max(value, 0);
+      }
+      else if (name == "-R")
+      {
+        options.max_rooms = std::max(value, 1);
+      }
+      else if (name == "-H")
+      {
+        options.history.prefix = std::string(argv[first_port + 1]) + "/";
+      }
+      else if (name == "-S")
+      {
+        options.history.sync_interval = std::max(value, 0);
+      }
+      else if (name == "-m")
+      {
+        options.max_body_length = std::min< std::size_t >(
+            value, ChatMessage::max_binary_body_length);
+      }
+#if defined(CHAT_DEFLATE)
+      else if (name == "-Z")
+      {
+        options.compression.level = std::min(std::max(value, 0), 9);
+      }
+#endif
+#if defined(CHAT_TLS)
+      else if (name == "-C")
+      {
+        options.tls.certificate_chain = argv[first_port + 1];
+      }
+      else if (name == "-K")
+      {
+        options.tls.private_key = argv[first_port + 1];
+      }
+      else if (name == "-O")
+      {
+        options.tls.kernel_offload = (value != 0);
+      }
+#endif
+#if defined(CHAT_URING)
+      else if (name == "-U")
+      {
+        options.uring.enabled = (value != 0);
+      }
+#endif
+      else
+      {
+        first_port = argc;
+      }
+    }
+    if (options.thread_count == 0)
+    {
+      options.thread_count = 1;
+    }
+    if (options.acceptor_count == 0)
+    {
+      options.acceptor_count = options.thread_count;
+    }
+
+    if (argc <= first_port)
     {
-      std::cerr << "Usage: server <port> [<port> ...]\n";
+      std::cerr << "Usage: server [-t <threads 1-1024>] [-m <max body bytes>]"
+          " [-l debug|info|warning|error|off]"
+          " [-q <max queued messages>] [-b <max queued bytes>]"
+          " [-p drop-oldest|drop-newest|coalesce|disconnect]"
+          " [-M <metrics port>] [-A <acceptors per port>]"
+          " [-L <listen backlog>] [-P <preallocated sessions>]"
+          " [-R <max rooms per port>]"
+          " [-H <history directory>]"
+          " [-S <history sync ms>]"
+#if defined(CHAT_DEFLATE)
+          " [-Z <deflate level 1-9, 0 off>]"
+#endif
+#if defined(CHAT_TLS)
+          " [-C <TLS certificate chain> [-K <private key>] [-O <kTLS 0|1>]]"
+#endif
+#if defined(CHAT_URING)
+          " [-U <io_uring 0|1>]"
+#endif
+          " <port> [<port> ...]\n";
       return 1;
     }
 
-    boost::asio::io_service  io_service;
+    ChatShards  shards(options.thread_count);
+    boost::asio::io_service&  io_service = shards[0];
+
+    ChatTlsContext*  tls_context = 0;
+#if defined(CHAT_TLS)
+    boost::scoped_ptr< ChatTlsContext >  tls;
+    if (options.tls.enabled())
+    {
+      tls.reset(new ChatTlsContext(options.tls));
+      tls_context = tls.get();
+#if defined(SIGPIPE)
+      // OpenSSL writes with write(), which raises SIGPIPE on a connection
+      // the peer has reset; Asio's own writes do not.
+      std::signal(SIGPIPE, SIG_IGN);
+#endif
+    }
+#endif
+
+#if defined(CHAT_URING)
+    // One ring per shard; where the kernel lacks what it needs, sessions
+    // stay on the reactor.
+    for (std::size_t i = 0; options.uring.enabled && (i < shards.size()); ++i)
+    {
+      ChatUring*  ring = new ChatUring(shards[i], options.uring);
+      boost::asio::add_service(shards[i], ring);
+      if (!ring->valid())
+      {
+        CHAT_LOG(log_warning, "event=uring_unavailable error=\"%s\"",
+            ring->failure().c_str());
+        options.uring.enabled = false;
+      }
+    }
+#endif
 
+    ChatSession::reserve(options.preallocated_sessions);
     chatServerList_t  servers;
-    for (int i = 1; i < argc; ++i) {
+    for (int i = first_port; i < argc; ++i) {
       using namespace std; // For atoi.
       tcp::endpoint endpoint(tcp::v4(), atoi(argv[i]));
-      chatServerPTR server(new ChatServer(io_service, endpoint));
+      chatServerPTR server(new ChatServer(shards, endpoint, options,
+          tls_context));
       servers.push_back(server);
     }
 
-    io_service.run();
+    // Scrapes are served on the loopback interface only.
+    boost::scoped_ptr< ChatMetricsServer >  metrics;
+    if (metrics_port > 0)
+    {
+      metrics.reset(new ChatMetricsServer(io_service,
+          tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+            metrics_port),
+          servers));
+    }
+
+    // Stop cleanly on SIGINT/SIGTERM, so the log is flushed (and a
+    // profiling build writes its profile) on exit.
+    boost::asio::signal_set  signals(io_service, SIGINT, SIGTERM);
+    signals.async_wait(boost::bind(&ChatShards::stop, &shards));
+
+    // Every worker runs the event loop of its shard; the rooms pass
+    // messages between shards, strands keep both free of data races.
+    ChatLog::instance().start();
+    shards.run();
+    ChatLog::instance().stop();
 
   } catch (std::exception& e)
   {